@@ -0,0 +1,32 @@
+#!/usr/bin/env bash
+# Compare the native plugin with the lua handle path on the same rdb file,
+# both count keys, elements and bytes by type.
+#
+# $ cd src && make && make plugins
+# $ ../plugins/bench.sh dump.rdb [runs]
+set -e
+
+RDB=${1:?usage: $0 file.rdb [runs]}
+RUNS=${2:-3}
+DIR=$(cd "$(dirname "$0")" && pwd)
+RDBTOOLS=${RDBTOOLS:-$DIR/../src/rdbtools}
+
+run() {
+    local name=$1; shift
+    local i start end best=
+    for ((i = 0; i < RUNS; i++)); do
+        start=$(date +%s%N)
+        "$RDBTOOLS" -f "$RDB" "$@" > /dev/null
+        end=$(date +%s%N)
+        (( best == 0 || end - start < best )) && best=$((end - start))
+    done
+    printf "%-8s best of %d: %d ms\n" "$name" "$RUNS" $((best / 1000000))
+}
+
+run lua -s "$DIR/keycount.lua"
+run plugin --plugin "$DIR/keycount.so"
+
+# both should print the same stats
+diff <("$RDBTOOLS" -f "$RDB" -s "$DIR/keycount.lua") \
+     <("$RDBTOOLS" -f "$RDB" --plugin "$DIR/keycount.so") > /dev/null \
+    || echo "WARN: lua and plugin output differ"
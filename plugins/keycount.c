@@ -0,0 +1,96 @@
+/*
+ * Example plugin, count keys, elements and bytes by type, same as
+ * keycount.lua does with handle(item).
+ *
+ * $ cd src && make plugins
+ * $ ./rdbtools -f ../tests/dump7.2.rdb --plugin ../plugins/keycount.so
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rdb_plugin.h"
+
+#define MAX_TYPES 8
+
+typedef struct {
+    const char *name;
+    uint64_t keys;
+    uint64_t elements;
+    uint64_t bytes;
+} type_stat;
+
+typedef struct {
+    type_stat types[MAX_TYPES];
+    int ntypes;
+    type_stat *cur;
+} keycount;
+
+static type_stat *
+keycount_type(keycount *kc, const char *name)
+{
+    int i;
+
+    for (i = 0; i < kc->ntypes; i++) {
+        // type names are constants of rdbtools, pointers can be compared.
+        if (kc->types[i].name == name) return &kc->types[i];
+    }
+    if (kc->ntypes == MAX_TYPES) return NULL;
+    kc->types[kc->ntypes].name = name;
+    return &kc->types[kc->ntypes++];
+}
+
+static int
+keycount_key_begin(void *ud, const rdb_key_info *key)
+{
+    keycount *kc = ud;
+
+    if ((kc->cur = keycount_type(kc, key->type_name)) == NULL) return -1;
+    kc->cur->keys++;
+    kc->cur->bytes += key->key.len;
+    return RDB_PLUGIN_OK;
+}
+
+static int
+keycount_element(void *ud, const rdb_key_info *key, const rdb_element *elem)
+{
+    keycount *kc = ud;
+
+    kc->cur->elements++;
+    kc->cur->bytes += elem->member.len + elem->value.len;
+    return RDB_PLUGIN_OK;
+}
+
+static int
+keycount_eof(void *ud)
+{
+    int i;
+    keycount *kc = ud;
+
+    for (i = 0; i < kc->ntypes; i++) {
+        printf("%s\t%llu\t%llu\t%llu\n", kc->types[i].name,
+                (unsigned long long)kc->types[i].keys,
+                (unsigned long long)kc->types[i].elements,
+                (unsigned long long)kc->types[i].bytes);
+    }
+    return RDB_PLUGIN_OK;
+}
+
+static void
+keycount_release(void *ud)
+{
+    free(ud);
+}
+
+int
+rdb_plugin_init(rdb_plugin *plugin)
+{
+    if (plugin->abi_version != RDB_PLUGIN_ABI_VERSION) return -1;
+    if ((plugin->ud = calloc(1, sizeof(keycount))) == NULL) return -1;
+
+    plugin->on_key_begin = keycount_key_begin;
+    plugin->on_element = keycount_element;
+    plugin->on_eof = keycount_eof;
+    plugin->release = keycount_release;
+    return 0;
+}
@@ -0,0 +1,50 @@
+-- count keys, elements and bytes by type, same as keycount.c does.
+retain_items = false
+
+local stats, order = {}, {}
+
+local function count(item)
+    local st = stats[item.type]
+    if not st then
+        st = { keys = 0, elements = 0, bytes = 0 }
+        stats[item.type] = st
+        order[#order + 1] = item.type
+    end
+    st.keys = st.keys + 1
+    st.bytes = st.bytes + #item.key
+    local value = item.value
+    if type(value) == "string" then
+        st.elements = st.elements + 1
+        st.bytes = st.bytes + #value
+    elseif item.type == "list" or item.type == "set" then
+        for _, v in ipairs(value) do
+            st.elements = st.elements + 1
+            st.bytes = st.bytes + #v
+        end
+    elseif item.type == "stream" then
+        for _, entry in ipairs(value) do
+            for f, v in pairs(entry.fields) do
+                st.elements = st.elements + 1
+                st.bytes = st.bytes + #f + #v
+            end
+        end
+    elseif type(value) == "table" then
+        for f, v in pairs(value) do
+            st.elements = st.elements + 1
+            st.bytes = st.bytes + #f + #v
+        end
+    end
+end
+
+function handle(item)
+    count(item)
+end
+
+-- print when the lua state is closed after the last key, kept in a global
+-- so it's not collected before.
+keycount_report = setmetatable({}, { __gc = function()
+    for _, t in ipairs(order) do
+        local st = stats[t]
+        print(string.format("%s\t%d\t%d\t%d", t, st.keys, st.elements, st.bytes))
+    end
+end })
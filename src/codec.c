@@ -0,0 +1,465 @@
+#include "codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "log.h"
+
+#define CODEC_IN_SIZE (256 * 1024)
+
+/*
+ * Decompressed blocks are passed from the thread to the reader by a ring,
+ * the thread fills blocks[(first + count) % CODEC_BLOCKS], and the reader
+ * drains blocks[first] from pos.
+ */
+struct codec {
+    int type;
+    int fd;
+    int wake[2];    /* written by codec_stop, the thread may be blocked on fd */
+    char head[CODEC_MAGIC_SIZE];
+    size_t head_len, head_pos;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *blocks[CODEC_BLOCKS];
+    size_t lens[CODEC_BLOCKS];
+    int first, count;
+    size_t pos;
+    int eof, stop;
+    char err[128];
+    // written by the thread, read by stats of the parser
+    uint64_t in_bytes, out_bytes;
+    uint64_t cpu_ns;
+};
+
+int
+codec_detect(const unsigned char *buf, size_t n)
+{
+    if (n >= 2 && buf[0] == 0x1f && buf[1] == 0x8b) return CODEC_GZIP;
+    if (n >= 4 && buf[0] == 0x28 && buf[1] == 0xb5 && buf[2] == 0x2f && buf[3] == 0xfd) return CODEC_ZSTD;
+    if (n >= 4 && buf[0] == 0x04 && buf[1] == 0x22 && buf[2] == 0x4d && buf[3] == 0x18) return CODEC_LZ4;
+    return CODEC_NONE;
+}
+
+const char *
+codec_name(int type)
+{
+    switch (type) {
+        case CODEC_GZIP: return "gzip";
+        case CODEC_ZSTD: return "zstd";
+        case CODEC_LZ4: return "lz4";
+    }
+    return "none";
+}
+
+/* compressed input, the magic bytes read by the detection come first */
+static ssize_t
+codec_input(codec *c, char *buf, size_t n)
+{
+    struct pollfd fds[2];
+    ssize_t bytes;
+
+    if (c->head_pos < c->head_len) {
+        bytes = c->head_len - c->head_pos;
+        if ((size_t)bytes > n) bytes = n;
+        memcpy(buf, c->head + c->head_pos, bytes);
+        c->head_pos += bytes;
+        return bytes;
+    }
+    // stdin or a fifo may block for ever, wait for codec_stop as well
+    fds[0].fd = c->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = c->wake[0];
+    fds[1].events = POLLIN;
+    while (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) {
+            snprintf(c->err, sizeof(c->err), "poll failed, %s", strerror(errno));
+            return -1;
+        }
+    }
+    if (fds[1].revents) return -1;
+    while ((bytes = read(c->fd, buf, n)) < 0 && errno == EINTR);
+    if (bytes < 0) {
+        snprintf(c->err, sizeof(c->err), "read failed, %s", strerror(errno));
+    } else {
+        __atomic_store_n(&c->in_bytes, c->in_bytes + bytes, __ATOMIC_RELAXED);
+    }
+    return bytes;
+}
+
+/* wait for a free block, NULL if the reader stopped */
+static char *
+codec_acquire(codec *c)
+{
+    char *block;
+
+    pthread_mutex_lock(&c->lock);
+    while (c->count == CODEC_BLOCKS && !c->stop) {
+        pthread_cond_wait(&c->cond, &c->lock);
+    }
+    block = c->stop ? NULL : c->blocks[(c->first + c->count) % CODEC_BLOCKS];
+    pthread_mutex_unlock(&c->lock);
+    return block;
+}
+
+static void
+codec_publish(codec *c, size_t len)
+{
+    struct timespec ts;
+
+    if (len == 0) return;
+    // once per block, the cost of the clock is nothing to decompress one
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        __atomic_store_n(&c->cpu_ns, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&c->out_bytes, c->out_bytes + len, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&c->lock);
+    c->lens[(c->first + c->count) % CODEC_BLOCKS] = len;
+    c->count++;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* gzip files may have several members, like the output of pigz */
+static void
+codec_run_gzip(codec *c, char *in)
+{
+    z_stream zs;
+    char *out;
+    ssize_t n;
+    int ret, ended = 0, full = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    // 32 to detect gzip or zlib header
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        snprintf(c->err, sizeof(c->err), "inflateInit failed");
+        return;
+    }
+    if ((out = codec_acquire(c)) == NULL) goto END;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = CODEC_BLOCK_SIZE;
+    for (;;) {
+        if (zs.avail_in == 0 && !full) {
+            if ((n = codec_input(c, in, CODEC_IN_SIZE)) < 0) goto END;
+            if (n == 0) {
+                if (!ended) snprintf(c->err, sizeof(c->err), "gzip input is truncated");
+                break;
+            }
+            zs.next_in = (Bytef *)in;
+            zs.avail_in = n;
+        }
+        if (ended && zs.avail_in > 0) {
+            if (zs.avail_in == 1 && zs.next_in[0] == 0x1f) {
+                // the magic is split by the read, get the other byte
+                in[0] = 0x1f;
+                if ((n = codec_input(c, in + 1, CODEC_IN_SIZE - 1)) < 0) goto END;
+                zs.next_in = (Bytef *)in;
+                zs.avail_in = n + 1;
+            }
+            // only a gzip member may follow, zero padding of tapes or files isn't one
+            if (zs.avail_in < 2 || zs.next_in[0] != 0x1f || zs.next_in[1] != 0x8b) {
+                logger(WARN, "Ignored bytes after the end of gzip input, they are not a gzip member.");
+                break;
+            }
+            inflateReset(&zs);
+            ended = 0;
+        }
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            ended = 1;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            snprintf(c->err, sizeof(c->err), "inflate failed, %s", zs.msg ? zs.msg : "bad data");
+            goto END;
+        }
+        full = zs.avail_out == 0;
+        // the rdb may end with the member, pass it before waiting for more input
+        if (full || (ended && zs.avail_in == 0 && zs.avail_out < CODEC_BLOCK_SIZE)) {
+            codec_publish(c, CODEC_BLOCK_SIZE - zs.avail_out);
+            if ((out = codec_acquire(c)) == NULL) goto END;
+            zs.next_out = (Bytef *)out;
+            zs.avail_out = CODEC_BLOCK_SIZE;
+        }
+    }
+    codec_publish(c, CODEC_BLOCK_SIZE - zs.avail_out);
+
+END:
+    inflateEnd(&zs);
+}
+
+#ifdef USE_ZSTD
+static void
+codec_run_zstd(codec *c, char *in)
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer src = { in, 0, 0 };
+    ZSTD_outBuffer dst = { NULL, CODEC_BLOCK_SIZE, 0 };
+    size_t ret;
+    ssize_t n;
+    int ended = 0, full = 0;
+
+    if ((dctx = ZSTD_createDCtx()) == NULL) {
+        snprintf(c->err, sizeof(c->err), "ZSTD_createDCtx failed");
+        return;
+    }
+    if ((dst.dst = codec_acquire(c)) == NULL) goto END;
+    for (;;) {
+        if (src.pos == src.size && !full) {
+            if ((n = codec_input(c, in, CODEC_IN_SIZE)) < 0) goto END;
+            if (n == 0) {
+                if (!ended) snprintf(c->err, sizeof(c->err), "zstd input is truncated");
+                break;
+            }
+            src.size = n;
+            src.pos = 0;
+        }
+        ret = ZSTD_decompressStream(dctx, &dst, &src);
+        if (ZSTD_isError(ret)) {
+            snprintf(c->err, sizeof(c->err), "zstd decompress failed, %s", ZSTD_getErrorName(ret));
+            goto END;
+        }
+        // 0 at the end of a frame
+        ended = ret == 0;
+        full = dst.pos == dst.size;
+        if (full) {
+            codec_publish(c, dst.pos);
+            if ((dst.dst = codec_acquire(c)) == NULL) goto END;
+            dst.pos = 0;
+        }
+    }
+    codec_publish(c, dst.pos);
+
+END:
+    ZSTD_freeDCtx(dctx);
+}
+#endif
+
+#ifdef USE_LZ4
+static void
+codec_run_lz4(codec *c, char *in)
+{
+    LZ4F_dctx *dctx;
+    char *out;
+    size_t ret, in_pos = 0, in_len = 0, out_pos = 0, src_size, dst_size;
+    ssize_t n;
+    int ended = 0, full = 0;
+
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+        snprintf(c->err, sizeof(c->err), "LZ4F_createDecompressionContext failed");
+        return;
+    }
+    if ((out = codec_acquire(c)) == NULL) goto END;
+    for (;;) {
+        if (in_pos == in_len && !full) {
+            if ((n = codec_input(c, in, CODEC_IN_SIZE)) < 0) goto END;
+            if (n == 0) {
+                if (!ended) snprintf(c->err, sizeof(c->err), "lz4 input is truncated");
+                break;
+            }
+            in_len = n;
+            in_pos = 0;
+        }
+        src_size = in_len - in_pos;
+        dst_size = CODEC_BLOCK_SIZE - out_pos;
+        ret = LZ4F_decompress(dctx, out + out_pos, &dst_size, in + in_pos, &src_size, NULL);
+        if (LZ4F_isError(ret)) {
+            snprintf(c->err, sizeof(c->err), "lz4 decompress failed, %s", LZ4F_getErrorName(ret));
+            goto END;
+        }
+        in_pos += src_size;
+        out_pos += dst_size;
+        // 0 at the end of a frame
+        ended = ret == 0;
+        full = out_pos == CODEC_BLOCK_SIZE;
+        if (full) {
+            codec_publish(c, out_pos);
+            if ((out = codec_acquire(c)) == NULL) goto END;
+            out_pos = 0;
+        }
+    }
+    codec_publish(c, out_pos);
+
+END:
+    LZ4F_freeDecompressionContext(dctx);
+}
+#endif
+
+static void *
+codec_thread(void *arg)
+{
+    codec *c = arg;
+    char *in;
+
+    if ((in = malloc(CODEC_IN_SIZE)) == NULL) {
+        snprintf(c->err, sizeof(c->err), "malloc failed");
+    } else {
+        switch (c->type) {
+            case CODEC_GZIP: codec_run_gzip(c, in); break;
+#ifdef USE_ZSTD
+            case CODEC_ZSTD: codec_run_zstd(c, in); break;
+#endif
+#ifdef USE_LZ4
+            case CODEC_LZ4: codec_run_lz4(c, in); break;
+#endif
+        }
+        free(in);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->eof = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/* zstd and lz4 are optional at build time */
+int
+codec_supported(int type)
+{
+#ifndef USE_ZSTD
+    if (CODEC_ZSTD == type) return 0;
+#endif
+#ifndef USE_LZ4
+    if (CODEC_LZ4 == type) return 0;
+#endif
+    return 1;
+}
+
+/*
+ * Start to decompress fd, head is the bytes which were read for detection.
+ * Return NULL if the codec isn't supported, or malloc or the thread failed.
+ */
+codec *
+codec_start(int type, int fd, const char *head, size_t head_len)
+{
+    codec *c;
+    int i;
+
+    if (!codec_supported(type) || (c = calloc(1, sizeof(codec))) == NULL) return NULL;
+    if (pipe(c->wake) != 0) {
+        free(c);
+        return NULL;
+    }
+    c->type = type;
+    c->fd = fd;
+    c->head_len = head_len < CODEC_MAGIC_SIZE ? head_len : CODEC_MAGIC_SIZE;
+    memcpy(c->head, head, c->head_len);
+    for (i = 0; i < CODEC_BLOCKS; i++) {
+        if ((c->blocks[i] = malloc(CODEC_BLOCK_SIZE)) == NULL) goto ERR;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    if (pthread_create(&c->thread, NULL, codec_thread, c) != 0) {
+        pthread_mutex_destroy(&c->lock);
+        pthread_cond_destroy(&c->cond);
+        goto ERR;
+    }
+    return c;
+
+ERR:
+    for (i = 0; i < CODEC_BLOCKS; i++) free(c->blocks[i]);
+    close(c->wake[0]);
+    close(c->wake[1]);
+    free(c);
+    return NULL;
+}
+
+/* fill function of the reader, returns 0 at the end, -1 on error */
+ssize_t
+codec_read(void *ud, char *buf, size_t n)
+{
+    codec *c = ud;
+    size_t len;
+    char *block;
+
+    pthread_mutex_lock(&c->lock);
+    while (c->count == 0 && !c->eof) {
+        pthread_cond_wait(&c->cond, &c->lock);
+    }
+    if (c->count == 0) {
+        pthread_mutex_unlock(&c->lock);
+        if (c->err[0] == '\0') return 0;
+        errno = EIO;
+        return -1;
+    }
+    block = c->blocks[c->first];
+    len = c->lens[c->first];
+    pthread_mutex_unlock(&c->lock);
+
+    // the block is not touched by the thread until it's released
+    if (n > len - c->pos) n = len - c->pos;
+    memcpy(buf, block + c->pos, n);
+    c->pos += n;
+    if (c->pos == len) {
+        pthread_mutex_lock(&c->lock);
+        c->first = (c->first + 1) % CODEC_BLOCKS;
+        c->count--;
+        c->pos = 0;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+    }
+    return n;
+}
+
+/* why codec_read failed */
+const char *
+codec_error(const codec *c)
+{
+    return c->err;
+}
+
+/*
+ * Compressed bytes of the first out bytes, blocks are decompressed ahead of
+ * the reader, so it's scaled by the ratio so far rather than what was read.
+ */
+uint64_t
+codec_input_bytes(const codec *c, uint64_t out)
+{
+    uint64_t in = __atomic_load_n(&c->in_bytes, __ATOMIC_RELAXED);
+    uint64_t total = __atomic_load_n(&c->out_bytes, __ATOMIC_RELAXED);
+
+    if (total == 0 || out >= total) return in;
+    return (double)in * out / total;
+}
+
+/* cpu time of the thread, as of the last block it decompressed */
+uint64_t
+codec_cpu_ns(const codec *c)
+{
+    return __atomic_load_n(&c->cpu_ns, __ATOMIC_RELAXED);
+}
+
+void
+codec_stop(codec *c)
+{
+    int i;
+
+    if (!c) return;
+    pthread_mutex_lock(&c->lock);
+    c->stop = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    // the thread checks stop in codec_acquire, but it may wait for input
+    while (write(c->wake[1], "", 1) < 0 && errno == EINTR);
+    pthread_join(c->thread, NULL);
+
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    for (i = 0; i < CODEC_BLOCKS; i++) free(c->blocks[i]);
+    close(c->wake[0]);
+    close(c->wake[1]);
+    free(c);
+}
@@ -0,0 +1,33 @@
+/*
+ * Compressed input, the rdb is decompressed by a thread into blocks which
+ * are read by the parser, so decompression and parsing run on two cores.
+ */
+#ifndef _CODEC_H_
+#define _CODEC_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CODEC_NONE 0
+#define CODEC_GZIP 1
+#define CODEC_ZSTD 2
+#define CODEC_LZ4  3
+
+// bytes needed by codec_detect
+#define CODEC_MAGIC_SIZE 4
+
+#define CODEC_BLOCK_SIZE (1024 * 1024)
+#define CODEC_BLOCKS 4
+
+typedef struct codec codec;
+
+int codec_detect(const unsigned char *buf, size_t n);
+const char *codec_name(int type);
+int codec_supported(int type);
+codec *codec_start(int type, int fd, const char *head, size_t head_len);
+ssize_t codec_read(void *ud, char *buf, size_t n);
+const char *codec_error(const codec *c);
+uint64_t codec_input_bytes(const codec *c, uint64_t out);
+uint64_t codec_cpu_ns(const codec *c);
+void codec_stop(codec *c);
+#endif
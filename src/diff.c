@@ -0,0 +1,383 @@
+#include "diff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "rdb.h"
+#include "digest.h"
+#include "extsort.h"
+#include "util.h"
+#include "log.h"
+
+#define DIFF_BUILD 0
+#define DIFF_PROBE 1
+
+// the value of sorted records: fingerprint and expire time
+#define DIFF_VAL_SIZE 16
+// db is prepended to the key of sorted records, big endian so it sorts first
+#define DIFF_DB_SIZE 4
+
+typedef struct {
+    uint64_t fp;
+    int64_t expire;
+    size_t key_off;
+    uint32_t key_len;
+    int db;
+    int seen;
+} diff_rec;
+
+typedef struct {
+    int stage;          /* DIFF_BUILD or DIFF_PROBE */
+    int swapped;        /* the table is built from the new file */
+    size_t max_keys;
+    const char *tmp_dir;
+    digest_state digest;
+
+    /* hash table of the build file */
+    diff_rec *recs;
+    size_t nrecs, recs_cap;
+    char *keys;
+    size_t keys_len, keys_cap;
+    uint32_t *slots;    /* index of recs + 1, 0 if empty */
+    size_t nslots;
+
+    /* both files are sorted instead once the table is full */
+    extsort *sorted[2];
+    char *sort_key;
+    size_t sort_key_cap;
+
+    size_t changes;
+} diff_ctx;
+
+/* print the change, in_old/in_new are the records of the key in each file */
+static void
+diff_emit(diff_ctx *ctx, int db, const char *key, size_t len,
+        const diff_rec *in_old, const diff_rec *in_new)
+{
+    if (in_old && in_new && in_old->fp == in_new->fp && in_old->expire == in_new->expire) return;
+
+    if (!in_old || !in_new) {
+        printf("%s\t%d\t", in_old ? "removed" : "added", db);
+        print_escaped(stdout, key, len);
+        putchar('\n');
+        ctx->changes++;
+        return;
+    }
+    if (in_old->fp != in_new->fp) {
+        printf("changed\t%d\t", db);
+        print_escaped(stdout, key, len);
+        putchar('\n');
+        ctx->changes++;
+    }
+    if (in_old->expire != in_new->expire) {
+        printf("expire\t%d\t", db);
+        print_escaped(stdout, key, len);
+        printf("\t%lld\t%lld\n", (long long)in_old->expire, (long long)in_new->expire);
+        ctx->changes++;
+    }
+}
+
+/* a key of the build file and/or the probe file, NULL if it's not in that file */
+static void
+diff_emit_sides(diff_ctx *ctx, int db, const char *key, size_t len,
+        const diff_rec *build, const diff_rec *probe)
+{
+    if (ctx->swapped) {
+        diff_emit(ctx, db, key, len, probe, build);
+    } else {
+        diff_emit(ctx, db, key, len, build, probe);
+    }
+}
+
+static uint64_t
+diff_hash(int db, const char *key, size_t len)
+{
+    return murmur3_64(key, len, (uint64_t)db);
+}
+
+static diff_rec *
+diff_lookup(diff_ctx *ctx, int db, const char *key, size_t len, uint32_t **slot)
+{
+    size_t i, mask = ctx->nslots - 1;
+    diff_rec *r;
+
+    if (ctx->nslots == 0) return NULL;
+    for (i = diff_hash(db, key, len) & mask; ctx->slots[i]; i = (i + 1) & mask) {
+        r = &ctx->recs[ctx->slots[i] - 1];
+        if (r->db == db && r->key_len == len && memcmp(ctx->keys + r->key_off, key, len) == 0) {
+            return r;
+        }
+    }
+    if (slot) *slot = &ctx->slots[i];
+    return NULL;
+}
+
+static void
+diff_rehash(diff_ctx *ctx, size_t nslots)
+{
+    size_t i;
+    uint32_t *slot;
+    diff_rec *r;
+
+    free(ctx->slots);
+    if ((ctx->slots = calloc(nslots, sizeof(uint32_t))) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at diff.\n");
+    }
+    ctx->nslots = nslots;
+    for (i = 0; i < ctx->nrecs; i++) {
+        r = &ctx->recs[i];
+        diff_lookup(ctx, r->db, ctx->keys + r->key_off, r->key_len, &slot);
+        *slot = i + 1;
+    }
+}
+
+static void
+diff_table_add(diff_ctx *ctx, int db, const char *key, size_t len, uint64_t fp, int64_t expire)
+{
+    diff_rec *r;
+    uint32_t *slot;
+    void *ptr;
+    size_t cap;
+
+    if (ctx->nrecs == ctx->recs_cap) {
+        ctx->recs_cap = ctx->recs_cap ? ctx->recs_cap * 2 : 1024;
+        if ((ptr = realloc(ctx->recs, sizeof(diff_rec) * ctx->recs_cap)) == NULL) {
+            logger(ERROR, "Exited, as malloc failed at diff.\n");
+        }
+        ctx->recs = ptr;
+    }
+    if (ctx->keys_len + len > ctx->keys_cap) {
+        cap = ctx->keys_cap ? ctx->keys_cap : 64 * 1024;
+        while (cap < ctx->keys_len + len) cap *= 2;
+        if ((ptr = realloc(ctx->keys, cap)) == NULL) {
+            logger(ERROR, "Exited, as malloc failed at diff.\n");
+        }
+        ctx->keys = ptr;
+        ctx->keys_cap = cap;
+    }
+    // keep the load factor under 1/2
+    if ((ctx->nrecs + 1) * 2 > ctx->nslots) diff_rehash(ctx, ctx->nslots ? ctx->nslots * 2 : 2048);
+
+    r = &ctx->recs[ctx->nrecs];
+    r->fp = fp;
+    r->expire = expire;
+    r->key_off = ctx->keys_len;
+    r->key_len = len;
+    r->db = db;
+    r->seen = 0;
+    memcpy(ctx->keys + ctx->keys_len, key, len);
+    ctx->keys_len += len;
+    if (diff_lookup(ctx, db, key, len, &slot) == NULL) *slot = ctx->nrecs + 1;
+    ctx->nrecs++;
+}
+
+static void
+diff_sort_add(diff_ctx *ctx, int side, int db, const char *key, size_t len, uint64_t fp, int64_t expire)
+{
+    char val[DIFF_VAL_SIZE];
+    unsigned char *k;
+
+    if (len + DIFF_DB_SIZE > ctx->sort_key_cap) {
+        free(ctx->sort_key);
+        ctx->sort_key_cap = (len + DIFF_DB_SIZE) * 2;
+        if ((ctx->sort_key = malloc(ctx->sort_key_cap)) == NULL) {
+            logger(ERROR, "Exited, as malloc failed at diff.\n");
+        }
+    }
+    k = (unsigned char *)ctx->sort_key;
+    k[0] = (uint32_t)db >> 24;
+    k[1] = (uint32_t)db >> 16;
+    k[2] = (uint32_t)db >> 8;
+    k[3] = (uint32_t)db;
+    memcpy(ctx->sort_key + DIFF_DB_SIZE, key, len);
+    memcpy(val, &fp, 8);
+    memcpy(val + 8, &expire, 8);
+    extsort_add(ctx->sorted[side], ctx->sort_key, len + DIFF_DB_SIZE, val, DIFF_VAL_SIZE);
+}
+
+/* the table is full, move it to the sorter of the build file */
+static void
+diff_spill_table(diff_ctx *ctx)
+{
+    size_t i;
+    diff_rec *r;
+
+    ctx->sorted[DIFF_BUILD] = extsort_create(ctx->tmp_dir, ctx->max_keys, 0);
+    ctx->sorted[DIFF_PROBE] = extsort_create(ctx->tmp_dir, ctx->max_keys, 0);
+    for (i = 0; i < ctx->nrecs; i++) {
+        r = &ctx->recs[i];
+        diff_sort_add(ctx, DIFF_BUILD, r->db, ctx->keys + r->key_off, r->key_len, r->fp, r->expire);
+    }
+    free(ctx->recs);
+    free(ctx->keys);
+    free(ctx->slots);
+    ctx->recs = NULL;
+    ctx->keys = NULL;
+    ctx->slots = NULL;
+    ctx->nrecs = ctx->recs_cap = ctx->keys_len = ctx->keys_cap = ctx->nslots = 0;
+}
+
+static int
+diff_on_key_begin(void *ud, const rdb_key_info *key)
+{
+    diff_ctx *ctx = ud;
+
+    digest_init(&ctx->digest, key->type_name);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+diff_on_element(void *ud, const rdb_key_info *key, const rdb_element *elem)
+{
+    diff_ctx *ctx = ud;
+
+    digest_add(&ctx->digest, elem->member.ptr, elem->member.len, elem->value.ptr, elem->value.len,
+            elem->id.ptr, elem->id.len);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+diff_on_key_end(void *ud, const rdb_key_info *key)
+{
+    diff_ctx *ctx = ud;
+    digest128 d;
+    diff_rec rec, *r;
+
+    digest_final(&ctx->digest, &d);
+    if (ctx->sorted[DIFF_BUILD]) {
+        diff_sort_add(ctx, ctx->stage, key->db_num, key->key.ptr, key->key.len, d.h1, key->expire_time);
+    } else if (ctx->stage == DIFF_BUILD) {
+        if (ctx->nrecs == ctx->max_keys) {
+            diff_spill_table(ctx);
+            diff_sort_add(ctx, DIFF_BUILD, key->db_num, key->key.ptr, key->key.len, d.h1, key->expire_time);
+        } else {
+            diff_table_add(ctx, key->db_num, key->key.ptr, key->key.len, d.h1, key->expire_time);
+        }
+    } else {
+        rec.fp = d.h1;
+        rec.expire = key->expire_time;
+        if ((r = diff_lookup(ctx, key->db_num, key->key.ptr, key->key.len, NULL)) != NULL) r->seen = 1;
+        diff_emit_sides(ctx, key->db_num, key->key.ptr, key->key.len, r, &rec);
+    }
+    return RDB_PLUGIN_OK;
+}
+
+static void
+diff_parse(diff_ctx *ctx, const char *path)
+{
+    rdb_plugin handlers;
+    rdb_parser *p;
+    uint64_t offset = 0;
+    const char *msg;
+    int ret;
+
+    memset(&handlers, 0, sizeof(handlers));
+    handlers.abi_version = RDB_PLUGIN_ABI_VERSION;
+    handlers.ud = ctx;
+    handlers.on_key_begin = diff_on_key_begin;
+    handlers.on_element = diff_on_element;
+    handlers.on_key_end = diff_on_key_end;
+
+    if ((p = rdb_parser_create(&handlers)) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at create parser.\n");
+    }
+    if ((ret = rdb_parser_open(p, path)) == 0) ret = rdb_parser_run(p);
+    if (ret != 0) {
+        msg = rdb_parser_error(p, &offset);
+        logger(ERROR, "Exited, as rdb %s can't be parsed, %s at offset %llu.\n", path, msg,
+                (unsigned long long)offset);
+    }
+    rdb_parser_free(p);
+}
+
+static void
+diff_sorted_rec(const rdb_slice *key, const rdb_slice *val, int *db, diff_rec *rec)
+{
+    const unsigned char *k = (const unsigned char *)key->ptr;
+
+    *db = (int)(((uint32_t)k[0] << 24) | ((uint32_t)k[1] << 16) | ((uint32_t)k[2] << 8) | k[3]);
+    memcpy(&rec->fp, val->ptr, 8);
+    memcpy(&rec->expire, val->ptr + 8, 8);
+}
+
+/* merge join of the sorted files */
+static void
+diff_merge(diff_ctx *ctx)
+{
+    rdb_slice bk, bv, pk, pv;
+    diff_rec brec, prec;
+    int db, cmp, has_b, has_p;
+    size_t len;
+
+    extsort_finish(ctx->sorted[DIFF_BUILD]);
+    extsort_finish(ctx->sorted[DIFF_PROBE]);
+    has_b = extsort_next(ctx->sorted[DIFF_BUILD], &bk, &bv);
+    has_p = extsort_next(ctx->sorted[DIFF_PROBE], &pk, &pv);
+    while (has_b || has_p) {
+        if (has_b && has_p) {
+            len = bk.len < pk.len ? bk.len : pk.len;
+            if ((cmp = memcmp(bk.ptr, pk.ptr, len)) == 0) cmp = bk.len < pk.len ? -1 : bk.len > pk.len;
+        } else {
+            cmp = has_b ? -1 : 1;
+        }
+        if (cmp <= 0) diff_sorted_rec(&bk, &bv, &db, &brec);
+        if (cmp >= 0) diff_sorted_rec(&pk, &pv, &db, &prec);
+        if (cmp < 0) {
+            diff_emit_sides(ctx, db, bk.ptr + DIFF_DB_SIZE, bk.len - DIFF_DB_SIZE, &brec, NULL);
+        } else {
+            diff_emit_sides(ctx, db, pk.ptr + DIFF_DB_SIZE, pk.len - DIFF_DB_SIZE,
+                    cmp == 0 ? &brec : NULL, &prec);
+        }
+        if (cmp <= 0) has_b = extsort_next(ctx->sorted[DIFF_BUILD], &bk, &bv);
+        if (cmp >= 0) has_p = extsort_next(ctx->sorted[DIFF_PROBE], &pk, &pv);
+    }
+}
+
+size_t
+diff_run(const char *old_path, const char *new_path, size_t max_keys, const char *tmp_dir)
+{
+    diff_ctx ctx;
+    struct stat st_old, st_new;
+    const char *build, *probe;
+    size_t i, changes;
+    diff_rec *r;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.max_keys = max_keys > 0 ? max_keys : DIFF_DEFAULT_MAX_KEYS;
+    ctx.tmp_dir = tmp_dir;
+    // the table is built from the smaller file
+    if (stat(old_path, &st_old) == 0 && stat(new_path, &st_new) == 0
+            && st_new.st_size < st_old.st_size) {
+        ctx.swapped = 1;
+    }
+    build = ctx.swapped ? new_path : old_path;
+    probe = ctx.swapped ? old_path : new_path;
+
+    ctx.stage = DIFF_BUILD;
+    diff_parse(&ctx, build);
+    ctx.stage = DIFF_PROBE;
+    diff_parse(&ctx, probe);
+
+    if (ctx.sorted[DIFF_BUILD]) {
+        diff_merge(&ctx);
+        extsort_free(ctx.sorted[DIFF_BUILD]);
+        extsort_free(ctx.sorted[DIFF_PROBE]);
+    } else {
+        // keys of the build file which are not in the probe file
+        for (i = 0; i < ctx.nrecs; i++) {
+            r = &ctx.recs[i];
+            if (!r->seen) diff_emit_sides(&ctx, r->db, ctx.keys + r->key_off, r->key_len, r, NULL);
+        }
+    }
+    fflush(stdout);
+
+    changes = ctx.changes;
+    free(ctx.recs);
+    free(ctx.keys);
+    free(ctx.slots);
+    free(ctx.sort_key);
+    return changes;
+}
@@ -0,0 +1,18 @@
+/*
+ * Diff of two rdb files by key, value fingerprint and expire time. Keys of
+ * the smaller file are kept in a hash table while the other one streams by,
+ * and both files are sorted into runs on disk if it has more than max_keys.
+ */
+#ifndef _DIFF_H_
+#define _DIFF_H_
+#include <stddef.h>
+
+#define DIFF_DEFAULT_MAX_KEYS (4 * 1024 * 1024)
+
+/*
+ * print a line for each key which is added, removed, changed or whose
+ * expire time is changed from old_path to new_path, the count of them is
+ * returned.
+ */
+size_t diff_run(const char *old_path, const char *new_path, size_t max_keys, const char *tmp_dir);
+#endif
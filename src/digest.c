@@ -0,0 +1,184 @@
+#include "digest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "endian.h"
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t
+fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* MurmurHash3_x64_128 by Austin Appleby, which is in the public domain */
+void
+murmur3_128(const void *key, size_t len, uint64_t seed, digest128 *out)
+{
+    const uint8_t *data = key, *tail;
+    size_t i, nblocks = len / 16;
+    uint64_t h1 = seed, h2 = seed, k1, k2;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+    for (i = 0; i < nblocks; i++) {
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+        memrev64ifbe(&k1);
+        memrev64ifbe(&k2);
+
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    tail = data + nblocks * 16;
+    k1 = k2 = 0;
+    switch (len & 15) {
+        case 15: k2 ^= (uint64_t)tail[14] << 48; /* fall through */
+        case 14: k2 ^= (uint64_t)tail[13] << 40; /* fall through */
+        case 13: k2 ^= (uint64_t)tail[12] << 32; /* fall through */
+        case 12: k2 ^= (uint64_t)tail[11] << 24; /* fall through */
+        case 11: k2 ^= (uint64_t)tail[10] << 16; /* fall through */
+        case 10: k2 ^= (uint64_t)tail[9] << 8;   /* fall through */
+        case 9:  k2 ^= (uint64_t)tail[8];
+                 k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+                 /* fall through */
+        case 8:  k1 ^= (uint64_t)tail[7] << 56;  /* fall through */
+        case 7:  k1 ^= (uint64_t)tail[6] << 48;  /* fall through */
+        case 6:  k1 ^= (uint64_t)tail[5] << 40;  /* fall through */
+        case 5:  k1 ^= (uint64_t)tail[4] << 32;  /* fall through */
+        case 4:  k1 ^= (uint64_t)tail[3] << 24;  /* fall through */
+        case 3:  k1 ^= (uint64_t)tail[2] << 16;  /* fall through */
+        case 2:  k1 ^= (uint64_t)tail[1] << 8;   /* fall through */
+        case 1:  k1 ^= (uint64_t)tail[0];
+                 k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+    out->h1 = h1;
+    out->h2 = h2;
+}
+
+uint64_t
+murmur3_64(const void *key, size_t len, uint64_t seed)
+{
+    digest128 d;
+
+    murmur3_128(key, len, seed, &d);
+    return d.h1;
+}
+
+void
+digest_init(digest_state *d, const char *type_name)
+{
+    memset(d, 0, sizeof(*d));
+    d->type_name = type_name;
+    d->ordered = strcmp(type_name, "set") != 0 && strcmp(type_name, "hash") != 0
+        && strcmp(type_name, "zset") != 0;
+    d->scores = strcmp(type_name, "zset") == 0;
+}
+
+/*
+ * The shortest text of the score which reads back as the same double into
+ * buf, or 0 if it's not a number, then it's hashed as it is.
+ */
+static size_t
+digest_score(const char *s, size_t len, char *buf, size_t size)
+{
+    char tmp[64], *end;
+    double v;
+    int prec, n = 0;
+
+    if (len == 0 || len >= sizeof(tmp)) return 0;
+    memcpy(tmp, s, len);
+    tmp[len] = '\0';
+    v = strtod(tmp, &end);
+    if (*end != '\0') return 0;
+    for (prec = 15; prec <= 17; prec++) {
+        n = snprintf(buf, size, "%.*g", prec, v);
+        if (strtod(buf, NULL) == v) break;
+    }
+    return n;
+}
+
+/* chain the fields of a stream entry with its id */
+static void
+digest_flush_group(digest_state *d)
+{
+    uint64_t chain[5];
+
+    chain[0] = d->acc.h1;
+    chain[1] = d->acc.h2;
+    chain[2] = d->group.h1;
+    chain[3] = d->group.h2;
+    chain[4] = d->group_id;
+    murmur3_128(chain, sizeof(chain), d->count, &d->acc);
+    d->group.h1 = d->group.h2 = 0;
+    d->in_group = 0;
+}
+
+void
+digest_add(digest_state *d, const char *member, size_t mlen, const char *value, size_t vlen,
+        const char *id, size_t id_len)
+{
+    digest128 e, chain[2];
+    uint64_t id_hash;
+    char score[32];
+    size_t n;
+
+    if (d->scores && value && (n = digest_score(value, vlen, score, sizeof(score))) > 0) {
+        value = score;
+        vlen = n;
+    }
+    // each part seeds the next, so ("ab", "c") and ("a", "bc") differ
+    murmur3_128(member, mlen, 0, &e);
+    if (value) murmur3_128(value, vlen, e.h1 ^ (e.h2 << 1), &e);
+
+    if (id) {
+        id_hash = murmur3_64(id, id_len, 0);
+        if (d->in_group && d->group_id != id_hash) digest_flush_group(d);
+        d->group_id = id_hash;
+        d->group.h1 += e.h1;
+        d->group.h2 += e.h2;
+        d->in_group = 1;
+    } else if (d->ordered) {
+        chain[0] = d->acc;
+        chain[1] = e;
+        murmur3_128(chain, sizeof(chain), d->count, &d->acc);
+    } else {
+        d->acc.h1 += e.h1;
+        d->acc.h2 += e.h2;
+    }
+    d->count++;
+}
+
+void
+digest_final(digest_state *d, digest128 *out)
+{
+    uint64_t buf[3];
+
+    if (d->in_group) digest_flush_group(d);
+    buf[0] = d->acc.h1;
+    buf[1] = d->acc.h2;
+    buf[2] = d->count;
+    murmur3_128(buf, sizeof(buf), murmur3_64(d->type_name, strlen(d->type_name), 0), out);
+}
+
+void
+digest_hex(const digest128 *d, char *buf)
+{
+    snprintf(buf, DIGEST_HEX_SIZE, "%016llx%016llx", (unsigned long long)d->h1, (unsigned long long)d->h2);
+}
@@ -0,0 +1,43 @@
+/*
+ * Fingerprints of decoded values, so dumps can be compared key by key
+ * without keeping the values. Elements of sets, hashes and zsets are
+ * combined in any order, since their order in rdb depends on encoding and
+ * rehashing, elements of lists and strings in order. Stream entries are
+ * in order, fields of an entry in any order, as lua gets them in a table.
+ * Zset scores are hashed as the shortest text of the double, as skiplists
+ * store binary doubles and listpacks or old rdb versions store text.
+ */
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t h1;
+    uint64_t h2;
+} digest128;
+
+typedef struct {
+    digest128 acc;
+    digest128 group;    /* fields of the current stream entry */
+    uint64_t group_id;
+    uint64_t count;
+    int ordered;
+    int scores;         /* values are zset scores */
+    int in_group;
+    const char *type_name;
+} digest_state;
+
+// 32 hex chars and '\0'
+#define DIGEST_HEX_SIZE 33
+
+void murmur3_128(const void *key, size_t len, uint64_t seed, digest128 *out);
+uint64_t murmur3_64(const void *key, size_t len, uint64_t seed);
+
+void digest_init(digest_state *d, const char *type_name);
+/* value and id may be NULL, e.g. for list elements */
+void digest_add(digest_state *d, const char *member, size_t mlen, const char *value, size_t vlen,
+        const char *id, size_t id_len);
+void digest_final(digest_state *d, digest128 *out);
+void digest_hex(const digest128 *d, char *buf);
+#endif
@@ -0,0 +1,321 @@
+#include "extsort.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define EXTSORT_RUN_BUF_SIZE (64 * 1024)
+
+typedef struct {
+    size_t off;     /* offset of key in arena, value follows it */
+    uint32_t klen;
+    uint32_t vlen;
+} extsort_rec;
+
+typedef struct {
+    FILE *fp;
+    char *buf;
+    size_t cap;
+    uint32_t klen;
+    uint32_t vlen;
+    int has;
+} extsort_run;
+
+struct extsort {
+    char *tmp_dir;
+    size_t max_records, max_bytes;
+    extsort_rec *recs;
+    size_t nrecs, recs_cap;
+    char *arena;
+    size_t arena_len, arena_cap;
+    extsort_run *runs;
+    size_t nruns;
+    size_t iter;
+    int *tree;      /* loser tree of runs, tree[0] is the winner */
+    int last;       /* run of the record returned by the last extsort_next */
+};
+
+// qsort has no user data, sorting is never nested
+static const char *sort_arena;
+
+static int
+extsort_cmp_key(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int ret = memcmp(a, b, alen < blen ? alen : blen);
+    if (ret != 0) return ret;
+    return alen < blen ? -1 : alen > blen;
+}
+
+static int
+extsort_cmp_rec(const void *a, const void *b)
+{
+    const extsort_rec *ra = a, *rb = b;
+    return extsort_cmp_key(sort_arena + ra->off, ra->klen, sort_arena + rb->off, rb->klen);
+}
+
+extsort *
+extsort_create(const char *tmp_dir, size_t max_records, size_t max_bytes)
+{
+    extsort *s;
+
+    if ((s = calloc(1, sizeof(extsort))) == NULL
+            || (tmp_dir && (s->tmp_dir = strdup(tmp_dir)) == NULL)) {
+        logger(ERROR, "Exited, as malloc failed at extsort.\n");
+    }
+    s->max_records = max_records;
+    s->max_bytes = max_bytes;
+    s->last = -1;
+    return s;
+}
+
+static FILE *
+extsort_open_run(extsort *s)
+{
+    char path[4096];
+    FILE *fp;
+    int fd;
+
+    if (!s->tmp_dir) {
+        fp = tmpfile();
+    } else {
+        snprintf(path, sizeof(path), "%s/rdbtools-run.XXXXXX", s->tmp_dir);
+        if ((fd = mkstemp(path)) < 0) {
+            logger(ERROR, "Exited, as create run in %s failed, %s.\n", s->tmp_dir, strerror(errno));
+        }
+        // the run is gone with the fd, even if we're killed
+        unlink(path);
+        fp = fdopen(fd, "w+");
+    }
+    if (!fp) logger(ERROR, "Exited, as create run file failed, %s.\n", strerror(errno));
+    setvbuf(fp, NULL, _IOFBF, EXTSORT_RUN_BUF_SIZE);
+    return fp;
+}
+
+static void
+extsort_sort(extsort *s)
+{
+    sort_arena = s->arena;
+    qsort(s->recs, s->nrecs, sizeof(extsort_rec), extsort_cmp_rec);
+}
+
+static void
+extsort_spill(extsort *s)
+{
+    size_t i;
+    extsort_run *runs;
+    extsort_rec *r;
+    FILE *fp;
+
+    extsort_sort(s);
+    fp = extsort_open_run(s);
+    for (i = 0; i < s->nrecs; i++) {
+        r = &s->recs[i];
+        if (fwrite(&r->klen, 4, 1, fp) != 1 || fwrite(&r->vlen, 4, 1, fp) != 1
+                || fwrite(s->arena + r->off, r->klen + r->vlen, 1, fp) != 1) {
+            logger(ERROR, "Exited, as write run file failed, %s.\n", strerror(errno));
+        }
+    }
+    if (fflush(fp) != 0) logger(ERROR, "Exited, as write run file failed, %s.\n", strerror(errno));
+    rewind(fp);
+
+    if ((runs = realloc(s->runs, sizeof(extsort_run) * (s->nruns + 1))) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at extsort.\n");
+    }
+    s->runs = runs;
+    memset(&s->runs[s->nruns], 0, sizeof(extsort_run));
+    s->runs[s->nruns++].fp = fp;
+    s->nrecs = 0;
+    s->arena_len = 0;
+}
+
+void
+extsort_add(extsort *s, const char *key, size_t klen, const char *val, size_t vlen)
+{
+    char *arena;
+    extsort_rec *r;
+    size_t cap;
+
+    if (s->nrecs > 0 && ((s->max_records && s->nrecs == s->max_records)
+                || (s->max_bytes && s->arena_len + klen + vlen > s->max_bytes))) {
+        extsort_spill(s);
+    }
+    if (s->nrecs == s->recs_cap) {
+        cap = s->recs_cap ? s->recs_cap * 2 : 1024;
+        if ((r = realloc(s->recs, sizeof(extsort_rec) * cap)) == NULL) {
+            logger(ERROR, "Exited, as malloc failed at extsort.\n");
+        }
+        s->recs = r;
+        s->recs_cap = cap;
+    }
+    if (s->arena_len + klen + vlen > s->arena_cap) {
+        cap = s->arena_cap ? s->arena_cap : 4096;
+        while (cap < s->arena_len + klen + vlen) cap *= 2;
+        if ((arena = realloc(s->arena, cap)) == NULL) {
+            logger(ERROR, "Exited, as malloc failed at extsort.\n");
+        }
+        s->arena = arena;
+        s->arena_cap = cap;
+    }
+    r = &s->recs[s->nrecs++];
+    r->off = s->arena_len;
+    r->klen = klen;
+    r->vlen = vlen;
+    memcpy(s->arena + s->arena_len, key, klen);
+    if (vlen) memcpy(s->arena + s->arena_len + klen, val, vlen);
+    s->arena_len += klen + vlen;
+}
+
+static void
+extsort_read_run(extsort_run *run)
+{
+    size_t len;
+
+    if (fread(&run->klen, 4, 1, run->fp) != 1 || fread(&run->vlen, 4, 1, run->fp) != 1) {
+        run->has = 0;
+        return;
+    }
+    len = (size_t)run->klen + run->vlen;
+    if (len > run->cap) {
+        free(run->buf);
+        run->cap = len * 2;
+        if ((run->buf = malloc(run->cap)) == NULL) {
+            logger(ERROR, "Exited, as malloc failed at extsort.\n");
+        }
+    }
+    if (len && fread(run->buf, len, 1, run->fp) != 1) {
+        logger(ERROR, "Exited, as read run file failed.\n");
+    }
+    run->has = 1;
+}
+
+/* a is before b, exhausted runs are after all, equal keys by run order */
+static int
+extsort_run_less(extsort *s, int a, int b)
+{
+    extsort_run *ra = &s->runs[a], *rb = &s->runs[b];
+    int cmp;
+
+    if (!ra->has) return 0;
+    if (!rb->has) return 1;
+    cmp = extsort_cmp_key(ra->buf, ra->klen, rb->buf, rb->klen);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+/* node n of the tree, nodes from nruns are the runs, return the winner of n */
+static int
+extsort_build_tree(extsort *s, size_t n)
+{
+    int l, r;
+
+    if (n >= s->nruns) return n - s->nruns;
+    l = extsort_build_tree(s, 2 * n);
+    r = extsort_build_tree(s, 2 * n + 1);
+    if (extsort_run_less(s, l, r)) {
+        s->tree[n] = r;
+        return l;
+    }
+    s->tree[n] = l;
+    return r;
+}
+
+/* the winner got a new record, replay its matches up to the root */
+static void
+extsort_replay(extsort *s, int w)
+{
+    size_t t;
+    int tmp;
+
+    for (t = (w + s->nruns) / 2; t > 0; t /= 2) {
+        if (extsort_run_less(s, s->tree[t], w)) {
+            tmp = s->tree[t];
+            s->tree[t] = w;
+            w = tmp;
+        }
+    }
+    s->tree[0] = w;
+}
+
+void
+extsort_finish(extsort *s)
+{
+    size_t i;
+
+    if (s->nruns == 0) {
+        // everything fits in memory, no run is written
+        extsort_sort(s);
+        return;
+    }
+    if (s->nrecs > 0) extsort_spill(s);
+    free(s->recs);
+    free(s->arena);
+    s->recs = NULL;
+    s->arena = NULL;
+    for (i = 0; i < s->nruns; i++) extsort_read_run(&s->runs[i]);
+    if ((s->tree = malloc(sizeof(int) * s->nruns)) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at extsort.\n");
+    }
+    s->tree[0] = extsort_build_tree(s, 1);
+}
+
+int
+extsort_next(extsort *s, rdb_slice *key, rdb_slice *val)
+{
+    int w;
+    extsort_run *run;
+    extsort_rec *r;
+
+    if (s->nruns == 0) {
+        if (s->iter == s->nrecs) return 0;
+        r = &s->recs[s->iter++];
+        key->ptr = s->arena + r->off;
+        key->len = r->klen;
+        val->ptr = s->arena + r->off + r->klen;
+        val->len = r->vlen;
+        return 1;
+    }
+
+    if (s->last >= 0) {
+        extsort_read_run(&s->runs[s->last]);
+        extsort_replay(s, s->last);
+    }
+    w = s->tree[0];
+    run = &s->runs[w];
+    if (!run->has) {
+        s->last = -1;
+        return 0;
+    }
+    s->last = w;
+    key->ptr = run->buf;
+    key->len = run->klen;
+    val->ptr = run->buf + run->klen;
+    val->len = run->vlen;
+    return 1;
+}
+
+size_t
+extsort_runs(const extsort *s)
+{
+    return s->nruns;
+}
+
+void
+extsort_free(extsort *s)
+{
+    size_t i;
+
+    for (i = 0; i < s->nruns; i++) {
+        fclose(s->runs[i].fp);
+        free(s->runs[i].buf);
+    }
+    free(s->runs);
+    free(s->tree);
+    free(s->recs);
+    free(s->arena);
+    free(s->tmp_dir);
+    free(s);
+}
@@ -0,0 +1,23 @@
+/*
+ * External sort of (key, value) records. Records are sorted in memory and
+ * written to a run file whenever max_records or max_bytes are buffered,
+ * then the runs are merged by a loser tree, so memory is bounded whatever
+ * the input is.
+ */
+#ifndef _EXTSORT_H_
+#define _EXTSORT_H_
+#include <stddef.h>
+#include "rdb_plugin.h"
+
+typedef struct extsort extsort;
+
+/* tmp_dir is where runs are written, NULL for tmpfile(). 0 is no limit */
+extsort *extsort_create(const char *tmp_dir, size_t max_records, size_t max_bytes);
+void extsort_add(extsort *s, const char *key, size_t klen, const char *val, size_t vlen);
+/* no more records, then they're read in order of key by extsort_next */
+void extsort_finish(extsort *s);
+/* the record is valid until the next call, 0 if there're no more */
+int extsort_next(extsort *s, rdb_slice *key, rdb_slice *val);
+size_t extsort_runs(const extsort *s);
+void extsort_free(extsort *s);
+#endif
@@ -1,9 +1,18 @@
 #include "intset.h"
 #include <stdio.h> 
 #include <string.h> 
+#include <pthread.h>
 
 #include "endian.h"
 
+// members are little endian, so x86 can widen them as they're in memory
+#if defined(__x86_64__) && defined(__GNUC__)
+#define INTSET_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef void intset_widen_fn(const uint8_t *src, int64_t *out, uint32_t n);
+
 uint8_t
 intset_get(intset *is, int pos, int64_t *v)
 {
@@ -29,6 +38,206 @@ intset_get(intset *is, int pos, int64_t *v)
     return 1;
 }
 
+const char *
+intset_first(const intset *is)
+{
+    return (const char *)is->contents;
+}
+
+/*
+ * Read the member at p in the width of encoding, return the start of the
+ * next member, or NULL if p is the end of intset.
+ */
+const char *
+intset_next(const intset *is, const char *p, int64_t *v)
+{
+    int64_t v64;
+    int32_t v32;
+    int16_t v16;
+
+    if (p >= (const char *)is->contents + (size_t)is->length * is->encoding) return NULL;
+    switch (is->encoding) {
+        case sizeof(int64_t):
+            memcpy(&v64, p, sizeof(int64_t));
+            memrev64ifbe(&v64);
+            *v = v64;
+            break;
+        case sizeof(int32_t):
+            memcpy(&v32, p, sizeof(int32_t));
+            memrev32ifbe(&v32);
+            *v = v32;
+            break;
+        default:
+            memcpy(&v16, p, sizeof(int16_t));
+            memrev16ifbe(&v16);
+            *v = v16;
+    }
+    return p + is->encoding;
+}
+
+static void
+intset_widen16(const uint8_t *src, int64_t *out, uint32_t n)
+{
+    uint32_t i;
+    int16_t v16;
+
+    for (i = 0; i < n; i++) {
+        memcpy(&v16, src + i * 2, 2);
+        memrev16ifbe(&v16);
+        out[i] = v16;
+    }
+}
+
+static void
+intset_widen32(const uint8_t *src, int64_t *out, uint32_t n)
+{
+    uint32_t i;
+    int32_t v32;
+
+    for (i = 0; i < n; i++) {
+        memcpy(&v32, src + i * 4, 4);
+        memrev32ifbe(&v32);
+        out[i] = v32;
+    }
+}
+
+static void
+intset_widen64(const uint8_t *src, int64_t *out, uint32_t n)
+{
+    uint32_t i;
+
+    memcpy(out, src, (size_t)n * 8);
+    for (i = 0; i < n; i++) memrev64ifbe(&out[i]);
+}
+
+#ifdef INTSET_SIMD
+__attribute__((target("avx2"))) static void
+intset_widen16_avx2(const uint8_t *src, int64_t *out, uint32_t n)
+{
+    uint32_t i;
+    __m128i v;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtepi16_epi64(v));
+        _mm256_storeu_si256((__m256i *)(out + i + 4), _mm256_cvtepi16_epi64(_mm_srli_si128(v, 8)));
+    }
+    intset_widen16(src + i * 2, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+intset_widen32_avx2(const uint8_t *src, int64_t *out, uint32_t n)
+{
+    uint32_t i;
+    __m256i v;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+        _mm256_storeu_si256((__m256i *)(out + i + 4), _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+    }
+    intset_widen32(src + i * 4, out + i, n - i);
+}
+
+__attribute__((target("sse4.1"))) static void
+intset_widen16_sse4(const uint8_t *src, int64_t *out, uint32_t n)
+{
+    uint32_t i;
+    __m128i v;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_cvtepi16_epi64(v));
+        _mm_storeu_si128((__m128i *)(out + i + 2), _mm_cvtepi16_epi64(_mm_srli_si128(v, 4)));
+        _mm_storeu_si128((__m128i *)(out + i + 4), _mm_cvtepi16_epi64(_mm_srli_si128(v, 8)));
+        _mm_storeu_si128((__m128i *)(out + i + 6), _mm_cvtepi16_epi64(_mm_srli_si128(v, 12)));
+    }
+    intset_widen16(src + i * 2, out + i, n - i);
+}
+
+__attribute__((target("sse4.1"))) static void
+intset_widen32_sse4(const uint8_t *src, int64_t *out, uint32_t n)
+{
+    uint32_t i;
+    __m128i v;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_cvtepi32_epi64(v));
+        _mm_storeu_si128((__m128i *)(out + i + 2), _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+    }
+    intset_widen32(src + i * 4, out + i, n - i);
+}
+#endif
+
+static intset_widen_fn *widen16, *widen32;
+static pthread_once_t widen_once = PTHREAD_ONCE_INIT;
+
+/* pick the widest kernel the cpu runs, the build doesn't need -mavx2 */
+static void
+intset_init_widen(void)
+{
+    widen16 = intset_widen16;
+    widen32 = intset_widen32;
+#ifdef INTSET_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        widen16 = intset_widen16_avx2;
+        widen32 = intset_widen32_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        widen16 = intset_widen16_sse4;
+        widen32 = intset_widen32_sse4;
+    }
+#endif
+}
+
+/*
+ * Widen up to n members from pos into out, return the count of them. It
+ * takes the encoding once for all of them, rather than intset_get for each.
+ */
+uint32_t
+intset_decode(const intset *is, uint32_t pos, int64_t *out, uint32_t n)
+{
+    const uint8_t *src;
+
+    if (pos >= is->length) return 0;
+    if (n > is->length - pos) n = is->length - pos;
+    pthread_once(&widen_once, intset_init_widen);
+
+    src = is->contents + (size_t)pos * is->encoding;
+    if (is->encoding == sizeof(int64_t)) {
+        intset_widen64(src, out, n);
+    } else if (is->encoding == sizeof(int32_t)) {
+        widen32(src, out, n);
+    } else {
+        widen16(src, out, n);
+    }
+    return n;
+}
+
+/*
+ * Check the intset of len bytes once before it's decoded, return NULL if
+ * it's fine, or the reason and its offset in *off.
+ */
+const char *
+intset_validate(const char *is, size_t len, size_t *off)
+{
+    uint32_t encoding, length;
+
+    *off = 0;
+    if (len < 8) return "shorter than the header";
+    memcpy(&encoding, is, 4);
+    memcpy(&length, is + 4, 4);
+    memrev32ifbe(&encoding);
+    memrev32ifbe(&length);
+    if (encoding != sizeof(int16_t) && encoding != sizeof(int32_t) && encoding != sizeof(int64_t)) {
+        return "unknown encoding";
+    }
+    *off = 4;
+    if (8 + (uint64_t)length * encoding != len) return "count of members doesn't match the size";
+    return NULL;
+}
+
 void
 intset_dump(intset *is)
 {
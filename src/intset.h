@@ -1,6 +1,11 @@
 #ifndef _INTSET_H_
 #define _INTSET_H_
 #include <stdint.h>
+#include <stddef.h>
+
+// members decoded at a time by intset_decode on the stack
+#define INTSET_DECODE_BATCH 256
+
 typedef struct {
     uint32_t encoding; /* int16, int32 or int64 */
     uint32_t length;
@@ -9,4 +14,8 @@ typedef struct {
 
 void intset_dump(intset *is);
 uint8_t intset_get(intset *is, int pos, int64_t *v);
+const char *intset_first(const intset *is);
+const char *intset_next(const intset *is, const char *p, int64_t *v);
+uint32_t intset_decode(const intset *is, uint32_t pos, int64_t *out, uint32_t n);
+const char *intset_validate(const char *is, size_t len, size_t *off);
 #endif
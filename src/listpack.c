@@ -0,0 +1,164 @@
+#include "listpack.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "endian.h"
+
+static uint32_t
+listpack_backlen_size(uint32_t len)
+{
+    if (len < 128) {
+        return 1;
+    } else if (len < 16384) {
+        return 2;
+    } else if (len < 2097152) {
+        return 3;
+    } else if (len < 268435456) {
+        return 4;
+    }
+    return 5;
+}
+
+const char *
+listpack_first(const char *lp)
+{
+    return lp + LP_HDR_SIZE;
+}
+
+/*
+ * Decode the entry at p without any copy, return the start of the next
+ * entry, or NULL if p is the end of listpack.
+ */
+const char *
+listpack_next(const char *p, lp_entry *entry)
+{
+    const uint8_t *s = (const uint8_t *)p;
+    uint32_t len;
+    uint64_t uv;
+
+    entry->sval = NULL;
+    entry->slen = 0;
+    if (s[0] == LP_EOF) return NULL;
+
+    if ((s[0] & LP_ENC_7BIT_UINT_MASK) == LP_ENC_7BIT_UINT) {
+        entry->lval = s[0] & 0x7f;
+        len = 1;
+    } else if ((s[0] & LP_ENC_6BIT_STR_MASK) == LP_ENC_6BIT_STR) {
+        entry->slen = s[0] & 0x3f;
+        entry->sval = p + 1;
+        len = 1 + entry->slen;
+    } else if ((s[0] & LP_ENC_13BIT_INT_MASK) == LP_ENC_13BIT_INT) {
+        uv = ((s[0] & 0x1f) << 8) | s[1];
+        entry->lval = uv >= (1 << 12) ? (int64_t)uv - (1 << 13) : (int64_t)uv;
+        len = 2;
+    } else if ((s[0] & LP_ENC_12BIT_STR_MASK) == LP_ENC_12BIT_STR) {
+        entry->slen = ((s[0] & 0x0f) << 8) | s[1];
+        entry->sval = p + 2;
+        len = 2 + entry->slen;
+    } else if (s[0] == LP_ENC_16BIT_INT) {
+        entry->lval = (int16_t)(s[1] | (s[2] << 8));
+        len = 3;
+    } else if (s[0] == LP_ENC_24BIT_INT) {
+        uv = s[1] | (s[2] << 8) | ((uint32_t)s[3] << 16);
+        entry->lval = uv >= (1 << 23) ? (int64_t)uv - (1 << 24) : (int64_t)uv;
+        len = 4;
+    } else if (s[0] == LP_ENC_32BIT_INT) {
+        entry->lval = (int32_t)(s[1] | (s[2] << 8) | (s[3] << 16) | ((uint32_t)s[4] << 24));
+        len = 5;
+    } else if (s[0] == LP_ENC_64BIT_INT) {
+        memcpy(&uv, s + 1, 8);
+        memrev64ifbe(&uv);
+        entry->lval = (int64_t)uv;
+        len = 9;
+    } else {
+        // LP_ENC_32BIT_STR
+        entry->slen = s[1] | (s[2] << 8) | (s[3] << 16) | ((uint32_t)s[4] << 24);
+        entry->sval = p + 5;
+        len = 5 + entry->slen;
+    }
+
+    return p + len + listpack_backlen_size(len);
+}
+
+/* the back length ends at p, it's stored from the last byte, 7 bits a byte */
+static uint64_t
+listpack_decode_backlen(const uint8_t *p, size_t n)
+{
+    uint64_t v = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        v |= (uint64_t)(p[-(long)i] & 0x7f) << (7 * i);
+    }
+    return v;
+}
+
+/*
+ * Check the listpack of len bytes once before it's decoded by the unchecked
+ * listpack_next, return NULL if it's fine, or the reason and its offset in
+ * *off. pairs is set for hash and zset, whose entries come in pairs.
+ */
+const char *
+listpack_validate(const char *lp, size_t len, int pairs, size_t *off)
+{
+    const uint8_t *s = (const uint8_t *)lp;
+    size_t p = LP_HDR_SIZE, hdr, back;
+    uint64_t elen, slen;
+    uint32_t count = 0;
+    uint8_t enc;
+
+    *off = 0;
+    if (len < LP_HDR_SIZE + 1) return "shorter than the header";
+    if (LP_BYTES(lp) != len) return "total bytes in the header don't match";
+
+    while (p < len && s[p] != LP_EOF) {
+        *off = p;
+        enc = s[p];
+        hdr = 1;
+        slen = 0;
+        if ((enc & LP_ENC_7BIT_UINT_MASK) == LP_ENC_7BIT_UINT) {
+            // the value is in the encoding byte
+        } else if ((enc & LP_ENC_6BIT_STR_MASK) == LP_ENC_6BIT_STR) {
+            slen = enc & 0x3f;
+        } else if ((enc & LP_ENC_13BIT_INT_MASK) == LP_ENC_13BIT_INT) {
+            slen = 1;
+        } else if ((enc & LP_ENC_12BIT_STR_MASK) == LP_ENC_12BIT_STR) {
+            if (p + 2 > len) return "entry runs past the end";
+            slen = ((enc & 0x0f) << 8) | s[p + 1];
+            hdr = 2;
+        } else if (enc == LP_ENC_16BIT_INT) {
+            slen = 2;
+        } else if (enc == LP_ENC_24BIT_INT) {
+            slen = 3;
+        } else if (enc == LP_ENC_32BIT_INT) {
+            slen = 4;
+        } else if (enc == LP_ENC_64BIT_INT) {
+            slen = 8;
+        } else if (enc == LP_ENC_32BIT_STR) {
+            if (p + 5 > len) return "entry runs past the end";
+            slen = s[p + 1] | (s[p + 2] << 8) | (s[p + 3] << 16) | ((uint32_t)s[p + 4] << 24);
+            hdr = 5;
+        } else {
+            return "unknown encoding of entry";
+        }
+        elen = hdr + slen;
+        back = listpack_backlen_size(elen);
+        // an entry is followed by the next one or the end byte at least
+        if (p + elen + back >= len) return "entry runs past the end";
+        if (listpack_decode_backlen(s + p + elen + back - 1, back) != elen) {
+            return "back length of entry doesn't match";
+        }
+        p += elen + back;
+        count++;
+    }
+    *off = p;
+    if (p >= len) return "no end byte";
+    if (p != len - 1) return "bytes after the end byte";
+    *off = 4;
+    if (LP_LEN(lp) != 0xffff && LP_LEN(lp) != count) return "count of entries in the header doesn't match";
+    if (pairs && count % 2 != 0) return "odd count of entries in pairs";
+    return NULL;
+}
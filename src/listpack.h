@@ -0,0 +1,41 @@
+#ifndef _LISTPACK_H_
+#define _LISTPACK_H_
+#include <stdint.h>
+#include <stddef.h>
+
+#define LP_HDR_SIZE 6
+#define LP_EOF 0xff
+
+#define LP_ENC_7BIT_UINT       0x00
+#define LP_ENC_7BIT_UINT_MASK  0x80
+#define LP_ENC_6BIT_STR        0x80
+#define LP_ENC_6BIT_STR_MASK   0xc0
+#define LP_ENC_13BIT_INT       0xc0
+#define LP_ENC_13BIT_INT_MASK  0xe0
+#define LP_ENC_12BIT_STR       0xe0
+#define LP_ENC_12BIT_STR_MASK  0xf0
+#define LP_ENC_16BIT_INT       0xf1
+#define LP_ENC_24BIT_INT       0xf2
+#define LP_ENC_32BIT_INT       0xf3
+#define LP_ENC_64BIT_INT       0xf4
+#define LP_ENC_32BIT_STR       0xf0
+
+#define LP_BYTES(lp) ((uint32_t)(uint8_t)(lp)[0] | ((uint32_t)(uint8_t)(lp)[1] << 8) \
+        | ((uint32_t)(uint8_t)(lp)[2] << 16) | ((uint32_t)(uint8_t)(lp)[3] << 24))
+#define LP_LEN(lp) ((uint16_t)((uint8_t)(lp)[4] | ((uint8_t)(lp)[5] << 8)))
+#define LP_LEN_HINT(lp) (LP_LEN(lp) == 0xffff ? 0 : LP_LEN(lp))
+
+/*
+ * A view of listpack entry, sval points into the listpack buffer when the
+ * entry is string, or NULL when the entry is integer which is stored in lval.
+ */
+typedef struct {
+    const char *sval;
+    uint32_t slen;
+    int64_t lval;
+} lp_entry;
+
+const char *listpack_first(const char *lp);
+const char *listpack_next(const char *p, lp_entry *entry);
+const char *listpack_validate(const char *lp, size_t len, int pairs, size_t *off);
+#endif
@@ -6,36 +6,228 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <getopt.h>
 #include "rdb.h"
+#include "rdb_lua.h"
+#include "plugin.h"
+#include "sync.h"
+#include "pool.h"
+#include "diff.h"
+#include "sortkeys.h"
+#include "validate.h"
+#include "progress.h"
 #include "log.h"
 
+#define OPT_GC_MODE 1000
+#define OPT_GC_PAUSE 1001
+#define OPT_GC_STEPMUL 1002
+#define OPT_GC_STEP_KB 1003
+#define OPT_PLUGIN 1004
+#define OPT_FROM_SOCKET 1005
+#define OPT_DIFF 1006
+#define OPT_DIFF_MAX_KEYS 1007
+#define OPT_SORT_KEYS 1008
+#define OPT_SORT_MEM 1009
+#define OPT_TMP_DIR 1010
+#define OPT_DIGEST 1011
+#define OPT_INT_VALUES 1012
+#define OPT_VALIDATE 1013
+#define OPT_SALVAGE 1014
+#define OPT_PROGRESS 1015
+#define OPT_PROGRESS_INTERVAL 1016
+#define OPT_STATS_FILE 1017
+
+typedef struct {
+    lua_State *L;
+    rdb_plugin *plugin;
+    const char *master_addr;
+    int digest;
+    int validate;
+    int salvage;
+} rdb_job;
+
+/* parse one rdb by the script or plugin, errors exit the worker */
+static int
+job_run(void *ud, const char *path)
+{
+    int ret;
+    rdb_job *job = ud;
+    rdb_parser *parser;
+    uint64_t offset = 0;
+    const char *msg;
+
+    if (job->L) {
+        rdb_lua_set_source(job->L, path);
+        parser = rdb_lua_parser_create(job->L);
+    } else {
+        if (job->plugin->on_source && job->plugin->on_source(job->plugin->ud, path) < 0) {
+            logger(ERROR, "Exited, as plugin failed at source %s.\n", path);
+        }
+        parser = rdb_parser_create(job->plugin);
+    }
+    if (!parser) logger(ERROR, "Exited, as malloc failed at create parser.\n");
+    // lua sets the digest of items itself
+    if (!job->L) rdb_parser_set_digest(parser, job->digest);
+    rdb_parser_set_validate(parser, job->validate);
+    progress_attach(parser, path);
+    if (job->master_addr) {
+        ret = sync_load(parser, job->master_addr);
+    } else if ((ret = rdb_parser_open(parser, path)) == 0) {
+        rdb_parser_set_salvage(parser, job->salvage);
+        ret = rdb_parser_run(parser);
+    }
+    // the parser only returns errors, the tool exits on them
+    if (ret != 0) {
+        msg = rdb_parser_error(parser, &offset);
+        logger(ERROR, "Exited, as rdb %s can't be parsed, %s at offset %llu.\n", path, msg,
+                (unsigned long long)offset);
+    }
+    progress_done(parser, path);
+    rdb_parser_free(parser);
+    return 0;
+}
+
+static char *
+job_finish(void *ud, size_t *len)
+{
+    rdb_job *job = ud;
+
+    if (job->L) return script_finish(job->L, len);
+    if (job->plugin->finish) return job->plugin->finish(job->plugin->ud, len);
+    return NULL;
+}
+
+static void
+job_release(void *ud)
+{
+    rdb_job *job = ud;
+
+    if (job->plugin) plugin_release(job->plugin);
+    if (job->L) lua_close(job->L);
+}
+
+static void
+job_reduce(rdb_job *job, pool_result *results, int n)
+{
+    int i;
+    char **data;
+    size_t *lens;
+    rdb_slice *slices;
+
+    if (job->L) {
+        data = malloc(sizeof(char *) * n);
+        lens = malloc(sizeof(size_t) * n);
+        if (!data || !lens) logger(ERROR, "Exited, as malloc failed at reduce.\n");
+        for (i = 0; i < n; i++) {
+            data[i] = results[i].data;
+            lens[i] = results[i].len;
+        }
+        script_reduce(job->L, data, lens, n);
+        free(data);
+        free(lens);
+    } else if (job->plugin->reduce) {
+        if ((slices = malloc(sizeof(rdb_slice) * n)) == NULL) {
+            logger(ERROR, "Exited, as malloc failed at reduce.\n");
+        }
+        for (i = 0; i < n; i++) {
+            slices[i].ptr = results[i].data;
+            slices[i].len = results[i].len;
+        }
+        if (job->plugin->reduce(job->plugin->ud, slices, n) < 0) {
+            logger(ERROR, "Exited, as plugin failed at reduce.\n");
+        }
+        free(slices);
+    }
+}
+
 static void
 usage(void)
 {
-    fprintf(stderr, "USAGE: ./rdbtools [-f file] -V -h\n");
+    fprintf(stderr, "USAGE: ./rdbtools [-f file]... [-j jobs] -V -h\n");
     fprintf(stderr, "\t-V --version \n");
     fprintf(stderr, "\t-h --help show usage \n");
-    fprintf(stderr, "\t-f --file specify which rdb file would be parsed.\n");
+    fprintf(stderr, "\t-f --file specify which rdb file would be parsed, - reads from stdin.\n");
+    fprintf(stderr, "\t   may be given many times, a directory takes its *.rdb* files, a quoted pattern is globbed.\n");
+    fprintf(stderr, "\t-j --jobs parse many rdb files by N worker processes, default is the count of cores.\n");
     fprintf(stderr, "\t-s --file specify which lua script, default is ../scripts/example.lua\n");
-    fprintf(stderr, "\t Notice: This tool only test on redis 2.2 and 2.4, 2.6, 2.8.\n\n");
+    fprintf(stderr, "\t-l --lazy-lzf don't decompress lzf string until item.value is accessed.\n");
+    fprintf(stderr, "\t--int-values push intset members and integer encoded values to lua as numbers.\n");
+    fprintf(stderr, "\t-b --batch-size pass N items to handle_batch(items) at once, default is 128.\n");
+    fprintf(stderr, "\t--gc-mode inc|gen lua gc mode, default is inc.\n");
+    fprintf(stderr, "\t--gc-pause --gc-stepmul set lua gc pause and step multiplier.\n");
+    fprintf(stderr, "\t--gc-step-kb run a lua gc step once heap grew N kb, 0 leaves it to lua, default is 4096.\n");
+    fprintf(stderr, "\t--plugin path.so pass keys to a native plugin instead of lua script, see rdb_plugin.h.\n");
+    fprintf(stderr, "\t--from-socket host:port|path full sync from a redis master instead of -f, nothing is written to disk.\n");
+    fprintf(stderr, "\t--diff old.rdb new.rdb print keys which are added, removed, changed or whose expire is changed.\n");
+    fprintf(stderr, "\t--diff-max-keys N keys kept in memory by --diff, runs are sorted on disk beyond it, default is %d.\n",
+            DIFF_DEFAULT_MAX_KEYS);
+    fprintf(stderr, "\t--sort-keys pass keys to --plugin in order of db and key, or print them without a plugin.\n");
+    fprintf(stderr, "\t--sort-mem N mb of keys sorted in memory by --sort-keys, default is %d.\n", SORTKEYS_DEFAULT_MEM_MB);
+    fprintf(stderr, "\t--digest set item.digest, or key->digest of plugins, a 128 bit fingerprint of the value.\n");
+    fprintf(stderr, "\t--validate report bad values with their offset, key and reason, and skip them instead of exiting.\n");
+    fprintf(stderr, "\t   without -s or --plugin, only check the files, exit with 1 if any value is bad.\n");
+    fprintf(stderr, "\t--salvage like --validate, and skip records which can't be parsed to the next one which can.\n");
+    fprintf(stderr, "\t--progress print bytes/s, keys/s, percent, eta and the split of time on stderr while parsing.\n");
+    fprintf(stderr, "\t--progress-interval N seconds between reports of --progress and --stats-file, default is %d.\n",
+            PROGRESS_DEFAULT_INTERVAL);
+    fprintf(stderr, "\t--stats-file path append the same stats as json lines to path, and a last one for each rdb file.\n");
+    fprintf(stderr, "\t--tmp-dir dir where --sort-keys and --diff write sorted runs, default is $TMPDIR or /tmp.\n");
+    fprintf(stderr, "\t Notice: This tool was tested on redis 2.2 ~ 7.2 (rdb version 1 ~ 11).\n\n");
 }
 
 int
 main(int argc, char **argv)
 {
-    int c;
-    char *rdb_file = NULL;
+    int c, i, nfiles = 0, nresults, jobs = 0;
+    char **rdb_files = NULL;
     char *lua_file = NULL;
-    int is_show_help = 0, is_show_version = 0;
-    char short_options [] = { "hVf:s:" };
-    lua_State *L;
+    char *plugin_file = NULL;
+    char *master_addr = NULL;
+    char *diff_old = NULL;
+    size_t diff_max_keys = DIFF_DEFAULT_MAX_KEYS;
+    int is_sort_keys = 0, is_digest = 0, is_int_values = 0, is_validate = 0;
+    int is_salvage = 0, is_progress = 0, progress_interval = 0;
+    char *stats_file = NULL;
+    const char *handler_name = NULL;
+    uint64_t bad_values = 0;
+    size_t sort_mem_mb = SORTKEYS_DEFAULT_MEM_MB;
+    char *tmp_dir = getenv("TMPDIR");
+    int is_show_help = 0, is_show_version = 0, is_lazy_lzf = 0, batch_size = 0;
+    char short_options [] = { "hVlf:s:b:j:" };
+    lua_State *L = NULL;
+    rdb_plugin *plugin = NULL;
+    rdb_job job;
+    pool_worker worker;
+    pool_result *results;
+    script_gc_policy gc_policy = { SCRIPT_GC_INC, 0, 0, 4096 };
 
     struct option long_options[] = {
          { "help", no_argument, NULL, 'h' }, /* help */
          { "version", no_argument, NULL, 'V' }, /* version */
          { "rdb-iile-path", required_argument,  NULL, 'f' }, /* rdb file path*/
          { "lua_file-path", required_argument,  NULL, 's' }, /* rdb file path*/
+         { "lazy-lzf", no_argument,  NULL, 'l' }, /* decompress lzf string on demand */
+         { "batch-size", required_argument,  NULL, 'b' }, /* items per handle_batch call */
+         { "jobs", required_argument,  NULL, 'j' }, /* worker processes of many rdb files */
+         { "gc-mode", required_argument,  NULL, OPT_GC_MODE },
+         { "gc-pause", required_argument,  NULL, OPT_GC_PAUSE },
+         { "gc-stepmul", required_argument,  NULL, OPT_GC_STEPMUL },
+         { "gc-step-kb", required_argument,  NULL, OPT_GC_STEP_KB },
+         { "plugin", required_argument,  NULL, OPT_PLUGIN }, /* native plugin instead of lua */
+         { "from-socket", required_argument,  NULL, OPT_FROM_SOCKET }, /* replicate from master */
+         { "diff", required_argument,  NULL, OPT_DIFF }, /* diff of two rdb files */
+         { "diff-max-keys", required_argument,  NULL, OPT_DIFF_MAX_KEYS },
+         { "sort-keys", no_argument,  NULL, OPT_SORT_KEYS }, /* keys in order */
+         { "sort-mem", required_argument,  NULL, OPT_SORT_MEM },
+         { "tmp-dir", required_argument,  NULL, OPT_TMP_DIR },
+         { "digest", no_argument,  NULL, OPT_DIGEST }, /* fingerprint of values */
+         { "int-values", no_argument,  NULL, OPT_INT_VALUES }, /* integers as lua numbers */
+         { "validate", no_argument,  NULL, OPT_VALIDATE }, /* skip bad values */
+         { "salvage", no_argument,  NULL, OPT_SALVAGE }, /* skip bad records */
+         { "progress", no_argument,  NULL, OPT_PROGRESS }, /* progress on stderr */
+         { "progress-interval", required_argument,  NULL, OPT_PROGRESS_INTERVAL },
+         { "stats-file", required_argument,  NULL, OPT_STATS_FILE }, /* progress as json lines */
          { NULL, 0, NULL, 0  }
     };
 
@@ -52,11 +244,80 @@ main(int argc, char **argv)
                 is_show_version = 1;
                 break;
             case 'f':
-                rdb_file = optarg;
+                pool_expand(optarg, &rdb_files, &nfiles);
                 break;
             case 's':
                 lua_file = optarg;
                 break;
+            case 'l':
+                is_lazy_lzf = 1;
+                break;
+            case 'b':
+                batch_size = atoi(optarg);
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case OPT_GC_MODE:
+                if (strcmp(optarg, "gen") == 0) {
+                    gc_policy.mode = SCRIPT_GC_GEN;
+                } else if (strcmp(optarg, "inc") == 0) {
+                    gc_policy.mode = SCRIPT_GC_INC;
+                } else {
+                    logger(ERROR, "unknown gc mode %s, should be inc or gen.\n", optarg);
+                }
+                break;
+            case OPT_GC_PAUSE:
+                gc_policy.pause = atoi(optarg);
+                break;
+            case OPT_GC_STEPMUL:
+                gc_policy.stepmul = atoi(optarg);
+                break;
+            case OPT_GC_STEP_KB:
+                gc_policy.step_kb = atoi(optarg);
+                break;
+            case OPT_PLUGIN:
+                plugin_file = optarg;
+                break;
+            case OPT_FROM_SOCKET:
+                master_addr = optarg;
+                break;
+            case OPT_DIFF:
+                diff_old = optarg;
+                break;
+            case OPT_DIFF_MAX_KEYS:
+                diff_max_keys = strtoull(optarg, NULL, 10);
+                break;
+            case OPT_SORT_KEYS:
+                is_sort_keys = 1;
+                break;
+            case OPT_SORT_MEM:
+                sort_mem_mb = strtoull(optarg, NULL, 10);
+                break;
+            case OPT_TMP_DIR:
+                tmp_dir = optarg;
+                break;
+            case OPT_DIGEST:
+                is_digest = 1;
+                break;
+            case OPT_INT_VALUES:
+                is_int_values = 1;
+                break;
+            case OPT_VALIDATE:
+                is_validate = 1;
+                break;
+            case OPT_SALVAGE:
+                is_validate = is_salvage = 1;
+                break;
+            case OPT_PROGRESS:
+                is_progress = 1;
+                break;
+            case OPT_PROGRESS_INTERVAL:
+                progress_interval = atoi(optarg);
+                break;
+            case OPT_STATS_FILE:
+                stats_file = optarg;
+                break;
             default:
                 exit(0);
         }
@@ -71,23 +332,107 @@ main(int argc, char **argv)
     if(is_show_version || is_show_help) {
         exit(0);
     }
-    if(!rdb_file) {
+    if (diff_old) {
+        // the new file is the argument after the old one
+        if (optind >= argc) {
+            logger(ERROR, "You must specify both files by --diff old.rdb new.rdb.\n");
+        }
+        if (access(diff_old, R_OK) != 0 || access(argv[optind], R_OK) != 0) {
+            logger(ERROR, "rdb file %s or %s is not exists.\n", diff_old, argv[optind]);
+        }
+        diff_run(diff_old, argv[optind], diff_max_keys, tmp_dir);
+        return 0;
+    }
+    if(!nfiles && !master_addr) {
         logger(ERROR, "You must specify rdb file by option -f filepath.\n");
     }
-    if(!lua_file) {
-        lua_file = "../scripts/example.lua";
+    if (nfiles && master_addr) {
+        logger(ERROR, "--from-socket can't be used with -f.\n");
+    }
+    for (i = 0; i < nfiles; i++) {
+        if (strcmp(rdb_files[i], "-") == 0) {
+            if (nfiles > 1) logger(ERROR, "stdin can't be parsed with other rdb files.\n");
+        } else if (access(rdb_files[i], R_OK) != 0) {
+            logger(ERROR, "rdb file %s is not exists.\n", rdb_files[i]);
+        }
+    }
+    // time of the handlers is of the plugin or lua, unless keys are only checked or sorted
+    if (plugin_file) {
+        handler_name = "plugin";
+    } else if (!is_sort_keys && (lua_file || !is_validate || master_addr)) {
+        handler_name = "lua";
+    }
+    progress_init(is_progress, stats_file, progress_interval, handler_name);
+
+    if (is_validate && !lua_file && !plugin_file && !master_addr) {
+        for (i = 0; i < nfiles; i++) {
+            bad_values += validate_run(rdb_files[i], is_salvage);
+            free(rdb_files[i]);
+        }
+        free(rdb_files);
+        return bad_values > 0;
+    }
+
+    if (is_sort_keys) {
+        // keys are replayed from the sorted runs, which only native outputs take
+        if (nfiles != 1 || master_addr) {
+            logger(ERROR, "--sort-keys takes one rdb file by -f.\n");
+        }
+        if (lua_file) {
+            logger(ERROR, "--sort-keys can't be used with -s, only --plugin takes the sorted keys.\n");
+        }
+        if (plugin_file) plugin = plugin_load(plugin_file);
+        sortkeys_run(rdb_files[0], plugin, sort_mem_mb << 20, tmp_dir, is_digest);
+        if (plugin) plugin_release(plugin);
+        free(rdb_files[0]);
+        free(rdb_files);
+        return 0;
     }
-    if (access(rdb_file, R_OK) != 0)
-    {
-        logger(ERROR, "rdb file %s is not exists.\n", rdb_file);
+
+    if (plugin_file) {
+        plugin = plugin_load(plugin_file);
+    } else {
+        if(!lua_file) {
+            lua_file = "../scripts/example.lua";
+        }
+        if (access(lua_file, R_OK) != 0)
+        {
+            logger(ERROR, "lua file %s is not exists.\n", lua_file);
+        }
+        L = script_init(lua_file);
+        script_set_gc_policy(L, &gc_policy);
+        script_set_batch_size(L, batch_size);
+        rdb_lua_set_lazy_lzf(L, is_lazy_lzf);
+        rdb_lua_set_digest(L, is_digest);
+        rdb_lua_set_int_values(L, is_int_values);
+    }
+
+    job.L = L;
+    job.plugin = plugin;
+    job.master_addr = master_addr;
+    job.digest = is_digest;
+    job.validate = is_validate;
+    job.salvage = is_salvage;
+    worker.ud = &job;
+    worker.run = job_run;
+    worker.finish = job_finish;
+    worker.release = job_release;
+    if (master_addr) {
+        // a single job which syncs from the master, the address is its source
+        if ((rdb_files = malloc(sizeof(char *))) == NULL || (rdb_files[0] = strdup(master_addr)) == NULL) {
+            logger(ERROR, "Exited, as malloc failed at from socket.\n");
+        }
+        nfiles = 1;
     }
-    if (access(lua_file, R_OK) != 0)
-    {
-        logger(ERROR, "lua file %s is not exists.\n", lua_file);
+    if (jobs <= 0) jobs = pool_default_jobs();
+    if ((nresults = pool_run(rdb_files, nfiles, jobs, &worker, &results)) < 0) {
+        logger(ERROR, "Exited, as some of the rdb files can't be parsed.\n");
     }
+    job_reduce(&job, results, nresults);
+    pool_free_results(results, nresults);
 
-    L = script_init(lua_file);
-    rdb_load(L, rdb_file);
-    lua_close(L);
+    for (i = 0; i < nfiles; i++) free(rdb_files[i]);
+    free(rdb_files);
+    job_release(&job);
     return 0;
 }
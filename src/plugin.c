@@ -0,0 +1,43 @@
+#include "plugin.h"
+
+#include <stdlib.h>
+#include <dlfcn.h>
+
+#include "log.h"
+
+static void *plugin_handle = NULL;
+
+rdb_plugin *
+plugin_load(const char *path)
+{
+    rdb_plugin *plugin;
+    rdb_plugin_init_fn init;
+
+    if ((plugin_handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+        logger(ERROR, "Exited, as load plugin failed: %s\n", dlerror());
+    }
+    if ((init = (rdb_plugin_init_fn)dlsym(plugin_handle, RDB_PLUGIN_INIT_SYMBOL)) == NULL) {
+        logger(ERROR, "Exited, as %s is not found in plugin %s.\n", RDB_PLUGIN_INIT_SYMBOL, path);
+    }
+
+    if ((plugin = calloc(1, sizeof(rdb_plugin))) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at load plugin.\n");
+    }
+    plugin->abi_version = RDB_PLUGIN_ABI_VERSION;
+    if (init(plugin) != 0) {
+        logger(ERROR, "Exited, as init plugin %s failed.\n", path);
+    }
+    if (plugin->abi_version != RDB_PLUGIN_ABI_VERSION) {
+        logger(ERROR, "Exited, as plugin abi version %d is not %d.\n", plugin->abi_version, RDB_PLUGIN_ABI_VERSION);
+    }
+    return plugin;
+}
+
+void
+plugin_release(rdb_plugin *plugin)
+{
+    if (plugin->release) plugin->release(plugin->ud);
+    free(plugin);
+    dlclose(plugin_handle);
+    plugin_handle = NULL;
+}
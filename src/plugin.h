@@ -0,0 +1,7 @@
+#ifndef _PLUGIN_H_
+#define _PLUGIN_H_
+#include "rdb_plugin.h"
+
+rdb_plugin *plugin_load(const char *path);
+void plugin_release(rdb_plugin *plugin);
+#endif
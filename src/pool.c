@@ -0,0 +1,236 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <glob.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "log.h"
+
+static void
+pool_add_file(char ***files, int *nfiles, const char *path)
+{
+    char **list;
+
+    if ((list = realloc(*files, sizeof(char *) * (*nfiles + 1))) == NULL
+            || (list[*nfiles] = strdup(path)) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at add file.\n");
+    }
+    *files = list;
+    (*nfiles)++;
+}
+
+static int
+pool_filter_rdb(const struct dirent *ent)
+{
+    return ent->d_name[0] != '.' && strstr(ent->d_name, ".rdb") != NULL;
+}
+
+static void
+pool_expand_dir(const char *dir, char ***files, int *nfiles)
+{
+    struct dirent **ents;
+    struct stat st;
+    char path[4096];
+    int i, n;
+
+    if ((n = scandir(dir, &ents, pool_filter_rdb, alphasort)) < 0) {
+        logger(ERROR, "Exited, as scan dir %s failed, %s.\n", dir, strerror(errno));
+    }
+    for (i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, ents[i]->d_name);
+        if (stat(path, &st) == 0 && !S_ISDIR(st.st_mode)) pool_add_file(files, nfiles, path);
+        free(ents[i]);
+    }
+    free(ents);
+}
+
+void
+pool_expand(const char *arg, char ***files, int *nfiles)
+{
+    struct stat st;
+    glob_t g;
+    size_t i;
+
+    if (strcmp(arg, "-") != 0 && stat(arg, &st) == 0) {
+        if (S_ISDIR(st.st_mode)) {
+            pool_expand_dir(arg, files, nfiles);
+        } else {
+            pool_add_file(files, nfiles, arg);
+        }
+        return;
+    }
+    if (!strpbrk(arg, "*?[")) {
+        // stdin, or a missing file which is reported by the caller
+        pool_add_file(files, nfiles, arg);
+        return;
+    }
+    if (glob(arg, 0, NULL, &g) != 0) {
+        logger(ERROR, "Exited, as no rdb file matches %s.\n", arg);
+    }
+    for (i = 0; i < g.gl_pathc; i++) {
+        pool_add_file(files, nfiles, g.gl_pathv[i]);
+    }
+    globfree(&g);
+}
+
+int
+pool_default_jobs(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static void
+pool_write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) continue;
+            logger(ERROR, "Exited, as write to pool pipe failed, %s.\n", strerror(errno));
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void
+pool_read_all(int fd, pool_result *r)
+{
+    char *buf;
+    size_t cap = 0;
+    ssize_t n;
+
+    r->data = NULL;
+    r->len = 0;
+    for (;;) {
+        if (r->len == cap) {
+            cap = cap ? cap * 2 : 4096;
+            if ((buf = realloc(r->data, cap)) == NULL) {
+                logger(ERROR, "Exited, as malloc failed at read result.\n");
+            }
+            r->data = buf;
+        }
+        if ((n = read(fd, r->data + r->len, cap - r->len)) < 0) {
+            if (errno == EINTR) continue;
+            logger(ERROR, "Exited, as read from worker failed, %s.\n", strerror(errno));
+        }
+        if (n == 0) break;
+        r->len += n;
+    }
+    if (r->len == 0) {
+        free(r->data);
+        r->data = NULL;
+    }
+}
+
+/* take file indexes from the task pipe until it's closed */
+static void
+pool_worker_main(char **files, int task_fd, int result_fd, pool_worker *w)
+{
+    int idx, failed = 0;
+    ssize_t n;
+    char *data;
+    size_t len = 0;
+
+    // print flushes per line, so lines of workers don't interleave
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    for (;;) {
+        // indexes are written in one piece, a read never splits them
+        if ((n = read(task_fd, &idx, sizeof(idx))) < 0 && errno == EINTR) continue;
+        if (n != sizeof(idx)) break;
+        if (w->run(w->ud, files[idx]) != 0) failed = 1;
+    }
+    if (w->finish && (data = w->finish(w->ud, &len)) != NULL) {
+        pool_write_all(result_fd, data, len);
+        free(data);
+    }
+    close(result_fd);
+    if (w->release) w->release(w->ud);
+    exit(failed);
+}
+
+int
+pool_run(char **files, int nfiles, int jobs, pool_worker *w, pool_result **results)
+{
+    int i, status, failed = 0, task_fds[2], result_fds[2], *fds;
+    pid_t *pids;
+
+    if (jobs > nfiles) jobs = nfiles;
+    if (jobs < 1) jobs = 1;
+    if ((*results = calloc(jobs, sizeof(pool_result))) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at pool.\n");
+    }
+    if (jobs == 1) {
+        for (i = 0; i < nfiles; i++) {
+            if (w->run(w->ud, files[i]) != 0) failed = 1;
+        }
+        if (w->finish) (*results)[0].data = w->finish(w->ud, &(*results)[0].len);
+        if (failed) {
+            pool_free_results(*results, jobs);
+            return -1;
+        }
+        return jobs;
+    }
+
+    pids = malloc(sizeof(pid_t) * jobs);
+    fds = malloc(sizeof(int) * jobs);
+    if (!pids || !fds || pipe(task_fds) != 0) {
+        logger(ERROR, "Exited, as create worker pool failed.\n");
+    }
+    // buffered output would be written twice by the workers
+    fflush(stdout);
+    for (i = 0; i < jobs; i++) {
+        if (pipe(result_fds) != 0 || (pids[i] = fork()) < 0) {
+            logger(ERROR, "Exited, as start worker failed, %s.\n", strerror(errno));
+        }
+        if (pids[i] == 0) {
+            close(task_fds[1]);
+            close(result_fds[0]);
+            pool_worker_main(files, task_fds[0], result_fds[1], w);
+        }
+        close(result_fds[1]);
+        fds[i] = result_fds[0];
+    }
+    close(task_fds[0]);
+    // if all workers are gone, fail on the write rather than be killed
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < nfiles; i++) {
+        pool_write_all(task_fds[1], (char *)&i, sizeof(i));
+    }
+    close(task_fds[1]);
+
+    // a worker writes its result after the tasks are gone, read them in order
+    for (i = 0; i < jobs; i++) {
+        pool_read_all(fds[i], &(*results)[i]);
+        close(fds[i]);
+    }
+    for (i = 0; i < jobs; i++) {
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+    }
+    free(pids);
+    free(fds);
+    if (failed) {
+        pool_free_results(*results, jobs);
+        return -1;
+    }
+    return jobs;
+}
+
+void
+pool_free_results(pool_result *results, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) free(results[i].data);
+    free(results);
+}
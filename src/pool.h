@@ -0,0 +1,36 @@
+/*
+ * Parse many rdb files, e.g. dumps of all shards of a cluster, by a pool of
+ * forked workers. Workers take the next file from a shared pipe, so big and
+ * small dumps are balanced, and each returns one partial result when the
+ * files run out, which is merged by the main process.
+ */
+#ifndef _POOL_H_
+#define _POOL_H_
+#include <stddef.h>
+
+typedef struct {
+    void *ud;
+    /* parse one file in the worker, non-zero if it can't be parsed */
+    int (*run)(void *ud, const char *path);
+    /* partial result of the worker after its last file, malloc'd or NULL */
+    char *(*finish)(void *ud, size_t *len);
+    /* called in the worker before it exits, may be NULL */
+    void (*release)(void *ud);
+} pool_worker;
+
+typedef struct {
+    char *data;     /* NULL if the worker has no result */
+    size_t len;
+} pool_result;
+
+/* add arg to files, a directory adds its *.rdb* files and a pattern is globbed */
+void pool_expand(const char *arg, char ***files, int *nfiles);
+int pool_default_jobs(void);
+/*
+ * Run w over files by jobs workers, files are parsed in the calling process
+ * if jobs is 1. Results of workers are stored in *results, the count of
+ * them is returned, or -1 if any file failed.
+ */
+int pool_run(char **files, int nfiles, int jobs, pool_worker *w, pool_result **results);
+void pool_free_results(pool_result *results, int n);
+#endif
@@ -0,0 +1,168 @@
+#include "progress.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static int show_progress;
+static const char *stats_path;
+static int interval_ms = PROGRESS_DEFAULT_INTERVAL * 1000;
+static const char *handler_label = "handlers";
+
+void
+progress_init(int show, const char *stats_file, int interval_sec, const char *handler_name)
+{
+    int fd;
+
+    show_progress = show;
+    stats_path = stats_file;
+    if (interval_sec > 0) interval_ms = interval_sec * 1000;
+    if (handler_name) handler_label = handler_name;
+    if (stats_file) {
+        if ((fd = open(stats_file, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+            logger(ERROR, "Exited, as open stats file %s failed, %s.\n", stats_file, strerror(errno));
+        }
+        close(fd);
+    }
+}
+
+/* 1.5G, 310.2k, units of 1024 for bytes or 1000 for counts */
+static void
+progress_human(char *buf, size_t size, double v, double base)
+{
+    const char *units = " kMGTP";
+    int i = 0;
+
+    while (v >= base && units[i + 1]) {
+        v /= base;
+        i++;
+    }
+    if (i == 0) {
+        snprintf(buf, size, "%.0f", v);
+    } else {
+        snprintf(buf, size, "%.1f%c", v, units[i]);
+    }
+}
+
+static double
+progress_ratio(double a, double b)
+{
+    return b > 0 ? a / b : 0;
+}
+
+/* -1 if it's unknown */
+static double
+progress_eta(const rdb_stats *st)
+{
+    double rate = progress_ratio(st->input_bytes, st->elapsed_us / 1e6);
+
+    if (!st->input_size || rate <= 0) return -1;
+    if (st->input_bytes >= st->input_size) return 0;
+    return (st->input_size - st->input_bytes) / rate;
+}
+
+static void
+progress_print(const char *path, const rdb_stats *st, int done)
+{
+    char bytes[16], size[16], bps[16], kps[16], eta[32];
+    double sec = st->elapsed_us / 1e6, left = progress_eta(st);
+    double busy = st->decode_us + st->lzf_us + st->handler_us;
+
+    progress_human(bytes, sizeof(bytes), st->loaded_bytes, 1024);
+    progress_human(bps, sizeof(bps), progress_ratio(st->loaded_bytes, sec), 1024);
+    progress_human(kps, sizeof(kps), progress_ratio(st->keys, sec), 1000);
+    fprintf(stderr, "%s %s: %sB", done ? "done" : "progress", path, bytes);
+    if (st->input_size) {
+        progress_human(size, sizeof(size), st->input_size, 1024);
+        fprintf(stderr, " %.1f%% of %sB", 100 * progress_ratio(st->input_bytes, st->input_size), size);
+    }
+    fprintf(stderr, ", %sB/s, %s keys/s", bps, kps);
+    if (!done && left >= 0) {
+        snprintf(eta, sizeof(eta), "%dm%02ds", (int)left / 60, (int)left % 60);
+        fprintf(stderr, ", eta %s", eta);
+    } else if (done) {
+        fprintf(stderr, ", %.1fs", sec);
+    }
+    if (busy > 0) {
+        fprintf(stderr, ", decode %.0f%% lzf %.0f%% %s %.0f%%", 100 * st->decode_us / busy,
+                100 * st->lzf_us / busy, handler_label, 100 * st->handler_us / busy);
+    }
+    if (st->decompress_us) fprintf(stderr, ", decompress %.2fs cpu", st->decompress_us / 1e6);
+    fputc('\n', stderr);
+}
+
+/* json string of s, quotes and control bytes are escaped */
+static void
+progress_json_str(char *buf, size_t size, const char *s)
+{
+    size_t n = 0;
+
+    buf[n++] = '"';
+    for (; *s && n + 8 < size; s++) {
+        if (*s == '"' || *s == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = *s;
+        } else if ((unsigned char)*s < 0x20) {
+            n += snprintf(buf + n, size - n, "\\u%04x", (unsigned char)*s);
+        } else {
+            buf[n++] = *s;
+        }
+    }
+    buf[n++] = '"';
+    buf[n] = '\0';
+}
+
+static void
+progress_write_json(const char *path, const rdb_stats *st, int done)
+{
+    char name[4096], line[8192];
+    double sec = st->elapsed_us / 1e6;
+    int fd, len;
+
+    progress_json_str(name, sizeof(name), path);
+    len = snprintf(line, sizeof(line), "{\"file\":%s,\"pid\":%d,\"done\":%s,\"elapsed_sec\":%.3f,"
+            "\"loaded_bytes\":%llu,\"input_bytes\":%llu,\"input_size\":%llu,\"percent\":%.2f,"
+            "\"bytes_per_sec\":%.0f,\"keys\":%llu,\"keys_per_sec\":%.0f,\"eta_sec\":%.0f,"
+            "\"decode_sec\":%.3f,\"lzf_sec\":%.3f,\"handler_sec\":%.3f,\"decompress_sec\":%.3f}\n",
+            name, (int)getpid(), done ? "true" : "false", sec,
+            (unsigned long long)st->loaded_bytes, (unsigned long long)st->input_bytes,
+            (unsigned long long)st->input_size, 100 * progress_ratio(st->input_bytes, st->input_size),
+            progress_ratio(st->loaded_bytes, sec), (unsigned long long)st->keys,
+            progress_ratio(st->keys, sec), done ? 0 : progress_eta(st),
+            st->decode_us / 1e6, st->lzf_us / 1e6, st->handler_us / 1e6, st->decompress_us / 1e6);
+    // a single write with O_APPEND, lines of the workers never mix
+    if ((fd = open(stats_path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0
+            || write(fd, line, len) != len) {
+        logger(WARN, "Write stats file %s failed, %s.", stats_path, strerror(errno));
+    }
+    if (fd >= 0) close(fd);
+}
+
+static void
+progress_report(void *ud, const rdb_stats *st)
+{
+    if (show_progress) progress_print(ud, st, 0);
+    if (stats_path) progress_write_json(ud, st, 0);
+}
+
+void
+progress_attach(rdb_parser *p, const char *path)
+{
+    if (!show_progress && !stats_path) return;
+    rdb_parser_set_progress(p, progress_report, (void *)path, interval_ms);
+}
+
+void
+progress_done(rdb_parser *p, const char *path)
+{
+    rdb_stats st;
+
+    if (!show_progress && !stats_path) return;
+    rdb_parser_stats(p, &st);
+    if (show_progress) progress_print(path, &st, 1);
+    if (stats_path) progress_write_json(path, &st, 1);
+}
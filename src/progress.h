@@ -0,0 +1,18 @@
+/*
+ * Progress of long runs, a line on stderr and a json line appended to the
+ * stats file at every interval, and when a rdb file is done. Json lines of
+ * worker processes don't interleave, each one is a single write.
+ */
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+#include "rdb.h"
+
+#define PROGRESS_DEFAULT_INTERVAL 1
+
+/* show on stderr, and or append to stats_file, handler_name labels handler time */
+void progress_init(int show, const char *stats_file, int interval_sec, const char *handler_name);
+/* report the parser of path while it runs, if progress is enabled */
+void progress_attach(rdb_parser *p, const char *path);
+/* the last report of path, after the parser ran to the end */
+void progress_done(rdb_parser *p, const char *path);
+#endif
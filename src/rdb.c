@@ -1,282 +1,639 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 
+#include "rdb_internal.h"
 #include "util.h"
 #include "lzf.h"
 #include "intset.h"
 #include "ziplist.h"
 #include "zipmap.h"
-#include "script.h"
+#include "listpack.h"
+#include "stream.h"
 #include "crc64.h"
 #include "log.h"
 #include "endian.h"
+#include "codec.h"
 
-#define MAGIC_STR "REDIS"
-#define REDIS_EXPIRE_SEC 0xfd
-#define REDIS_EXPIRE_MS 0xfc
-#define REDIS_SELECT_DB 0xfe
-#define REDIS_EOF 0xff
+// ================================== BUFFERED READER. ==================================== //
 
-#define REDIS_RDB_STRING  0
-#define REDIS_RDB_LIST    1
-#define REDIS_RDB_SET     2
-#define REDIS_RDB_ZSET    3
-#define REDIS_RDB_HASH    4
+static ssize_t
+rdb_fd_fill(void *ud, char *buf, size_t n)
+{
+    rdb_reader *r = ud;
+    ssize_t bytes;
 
-#define REDIS_RDB_ZIPMAP  9
-#define REDIS_RDB_LIST_ZIPLIST 10 
-#define REDIS_RDB_INTSET  11 
-#define REDIS_RDB_ZSET_ZIPLIST 12 
-#define REDIS_RDB_HASH_ZIPLIST 13 
+    while ((bytes = read(r->fd, buf, n)) < 0 && errno == EINTR);
+    return bytes;
+}
 
-#define REDIS_RDB_6B 0
-#define REDIS_RDB_14B 1
-#define REDIS_RDB_32B 2
-#define REDIS_RDB_ENCV 3
-#define REDIS_RDB_LENERR UINT_MAX
+/* add consumed bytes into cksum, before they're dropped from the buffer */
+static void
+rdb_update_crc(rdb_parser *p)
+{
+    rdb_reader *r = &p->reader;
 
-#define REDIS_RDB_ENC_INT8 0
-#define REDIS_RDB_ENC_INT16 1
-#define REDIS_RDB_ENC_INT32 2
-#define REDIS_RDB_ENC_LZF 3
+    if (r->pos > r->crc_pos) {
+        p->cksum = crc64(p->cksum, (unsigned char *)r->buf + r->crc_pos, r->pos - r->crc_pos);
+        r->crc_pos = r->pos;
+    }
+}
 
-#define KEY_FIELD_STR "key"
-#define VAL_FIELD_STR "value"
-#define TYPE_FIELD_STR "type"
-#define EXP_FIELD_STR "expire_time" 
-#define DB_NUM_STR "db_num"
-#define VERSION_STR "version"
-#define MAGIC_VERSION 5
+/* move unread bytes to the front of the buffer */
+static void
+rdb_reader_compact(rdb_parser *p)
+{
+    rdb_reader *r = &p->reader;
 
-// NOTE: trick here, version set 5 as we want to calc crc where read version field.
-int version = MAGIC_VERSION;
-uint64_t cksum = 0;
-uint64_t loaded_bytes = 0;
+    rdb_update_crc(p);
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+        r->end -= r->pos;
+        r->pos = r->crc_pos = 0;
+    }
+}
 
+/* the fill function of the reader failed */
+static void
+rdb_fail_read(rdb_parser *p)
+{
+    rdb_fail(p, RDB_ERR_IO, "read rdb failed, %s", p->codec ? codec_error(p->codec) : strerror(errno));
+}
 
+/* move unread bytes to the front and read more, return bytes available */
+static size_t
+rdb_reader_fill(rdb_parser *p)
+{
+    rdb_reader *r = &p->reader;
+    ssize_t n;
 
-// ================================== COMMON UTIL FOR RDB. ==================================== //
+    rdb_reader_compact(p);
+    if ((n = r->fill(r->ud, r->buf + r->end, r->cap - r->end)) < 0) rdb_fail_read(p);
+    r->end += n;
+    return r->end - r->pos;
+}
 
-static ssize_t    
-rdb_crc_read(int fildes, void *buf, size_t nbyte)
+/* read up to nbyte, less only at the end of input */
+static size_t
+rdb_crc_read(rdb_parser *p, void *buf, size_t nbyte)
 {
-    ssize_t len;
-    len = read(fildes, buf, nbyte);
-
-    if (version >= 5) {
-        cksum = crc64(cksum, buf, len);
+    rdb_reader *r = &p->reader;
+    size_t n, done = 0;
+
+    while (done < nbyte) {
+        if (rdb_unlikely(r->pos == r->end)) {
+            if (p->trial) {
+                // the buffer is the window, and it's not moved while trying
+                p->trial_window = 1;
+                rdb_fail(p, RDB_ERR_CORRUPT, "record runs out of the window");
+            }
+            if (rdb_reader_fill(p) == 0) break;
+        }
+        n = r->end - r->pos;
+        if (n > nbyte - done) n = nbyte - done;
+        memcpy((char *)buf + done, r->buf + r->pos, n);
+        r->pos += n;
+        done += n;
     }
 
-    loaded_bytes += len;
-    return len;
+    p->loaded_bytes += done;
+    return done;
 }
 
-static void
-rdb_set_int_env(lua_State *L, char *key, int value)
+// ================================== READ DATA FROOM RDB FILE. ==================================== //
+
+/* fail_msg is set, keep the error and jump back to the API call */
+static void __attribute__((noreturn))
+rdb_throw(rdb_parser *p, int error, uint64_t offset)
 {
-    lua_getglobal(L, RDB_ENV);
-    script_pushtableinteger(L, key, value);
-    lua_pop(L,-1);
+    p->error = error;
+    p->fail_offset = offset;
+    if (p->fail_jmp) longjmp(*p->fail_jmp, 1);
+    // every API call sets fail_jmp before parsing, this is a bug
+    logger(ERROR, "Exited, as %s at offset %llu out of the parser API.\n", p->fail_msg,
+            (unsigned long long)offset);
+    abort();
 }
 
-// ================================== READ DATA FROOM RDB FILE. ==================================== //
-static void 
-rdb_check_crc(int fd, uint64_t real_crc)
+/*
+ * The record can't be parsed further, as the input is corrupt or cut, or a
+ * handler or malloc failed. Nothing is freed on the way, the parser keeps
+ * its buffers in itself, so a decoder only leaks the string it holds.
+ */
+void
+rdb_fail(rdb_parser *p, int error, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(p->fail_msg, sizeof(p->fail_msg), fmt, ap);
+    va_end(ap);
+    rdb_throw(p, error, p->loaded_bytes);
+}
+
+/* a length can't be larger than the rest of a regular file */
+static void
+rdb_check_len(rdb_parser *p, uint64_t len)
+{
+    if (rdb_unlikely(p->input_size && len > p->input_size - p->loaded_bytes)) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "length %llu runs past the end of file", (unsigned long long)len);
+    }
+}
+static void
+rdb_check_crc(rdb_parser *p)
 {
-    uint64_t expected_crc = 0;
+    uint64_t real_crc, expected_crc = 0;
 
-    rdb_crc_read(fd, &expected_crc, 8);
+    rdb_update_crc(p);
+    real_crc = p->cksum;
+    rdb_crc_read(p, &expected_crc, 8);
     memrev64ifbe(expected_crc);
-    if(real_crc != expected_crc) {
-        logger(ERROR, "checksum error, expect %llu, real %llu.\n", real_crc, expected_crc);
+    // checksum is zero when rdbchecksum was disabled in redis.
+    if(expected_crc != 0 && real_crc != expected_crc && p->skipped_ranges == 0) {
+        if (!p->salvage) {
+            rdb_fail(p, RDB_ERR_CHECKSUM, "checksum error, expect %llu, real %llu",
+                    (unsigned long long)expected_crc, (unsigned long long)real_crc);
+        }
+        logger(WARN, "checksum error, expect %llu, real %llu.", (unsigned long long)expected_crc,
+                (unsigned long long)real_crc);
     }
 }
 
 static uint8_t
-rdb_read_kv_type(int fd)
+rdb_read_kv_type(rdb_parser *p)
 {
     char buf[1];
-    if(rdb_crc_read(fd, buf, 1) == 0) {
-        logger(ERROR, "Exited, as read error on load type.\n");
+    if(rdb_unlikely(rdb_crc_read(p, buf, 1) == 0)) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "read error on load type");
     }
 
     return (uint8_t) buf[0];
 }
 
-static uint32_t
-rdb_read_store_len(int fd, uint8_t *is_encoded)
+void
+rdb_read_bytes(rdb_parser *p, void *buf, size_t nbyte)
+{
+    if (rdb_unlikely(rdb_crc_read(p, buf, nbyte) != nbyte)) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "read error on load %lu bytes", (unsigned long)nbyte);
+    }
+}
+
+uint64_t
+rdb_read_store_len(rdb_parser *p, uint8_t *is_encoded)
 {
     char buf[2];
     uint8_t type;
     uint32_t len;
+    uint64_t len64 = 0;
+    uint8_t buf64[8];
+    int i;
 
    if (is_encoded) *is_encoded = 0;
-    if (rdb_crc_read(fd, buf, 1) == 0) return REDIS_RDB_LENERR;
-    type = (buf[0] & 0xc0) >> 6; 
+    if (rdb_crc_read(p, buf, 1) == 0) return REDIS_RDB_LENERR;
+    type = (buf[0] & 0xc0) >> 6;
 
     /**
      * 00xxxxxx, then the next 6 bits represent the length
      * 01xxxxxx, then the next 14 bits represent the length
-     * 10xxxxxx, then the next 6 bits is discarded, and next 4bytes represent the length 
+     * 10000000, then the next 4bytes represent the length
+     * 10000001, then the next 8bytes represent the length (since rdb version 7)
      * 11xxxxxx, The remaining 6 bits indicate the format
      */
     if (REDIS_RDB_6B == type) {
         return (uint8_t)buf[0] & 0x3f;
     } else if (REDIS_RDB_14B == type) {
-        if (rdb_crc_read(fd, buf + 1, 1) == 0) return REDIS_RDB_LENERR;
+        if (rdb_crc_read(p, buf + 1, 1) == 0) return REDIS_RDB_LENERR;
         return (((uint8_t)buf[0] & 0x3f) << 8)| (uint8_t)buf[1];
+    } else if (REDIS_RDB_64BITLEN == (uint8_t)buf[0]) {
+        if (rdb_crc_read(p, buf64, 8) != 8) return REDIS_RDB_LENERR;
+        for (i = 0; i < 8; i++) {
+            len64 = (len64 << 8) | buf64[i];
+        }
+        return len64;
     } else if (REDIS_RDB_32B == type) {
-        if (rdb_crc_read(fd, &len, 4) == 0) return REDIS_RDB_LENERR;
-        return ntohl(len); 
+        if (rdb_crc_read(p, &len, 4) != 4) return REDIS_RDB_LENERR;
+        return ntohl(len);
     } else {
         if(is_encoded) *is_encoded = 1;
         return (uint8_t)buf[0] & 0x3f;
     }
 }
 
+/* count of elements or nodes, each takes a byte at least */
+uint64_t
+rdb_read_count(rdb_parser *p)
+{
+    uint8_t is_encoded;
+    uint64_t n;
+
+    if (rdb_unlikely((n = rdb_read_store_len(p, &is_encoded)) == REDIS_RDB_LENERR || is_encoded)) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "bad count");
+    }
+    rdb_check_len(p, n);
+    return n;
+}
+
 static int32_t
-rdb_read_int(int fd, uint8_t enc)
+rdb_read_int(rdb_parser *p, uint8_t enc)
 {
     char buf[4];
 
     if (REDIS_RDB_ENC_INT8 == enc) {
-        if (rdb_crc_read(fd, buf, 1) == 0) goto READERR;
+        if (rdb_crc_read(p, buf, 1) == 0) goto READERR;
         return (int8_t)buf[0];
     } else if (REDIS_RDB_ENC_INT16 == enc) {
-        if (rdb_crc_read(fd, buf, 2) == 0) goto READERR;
+        if (rdb_crc_read(p, buf, 2) != 2) goto READERR;
         return (int16_t)((uint8_t)buf[0] | ((uint8_t)buf[1] << 8));
     } else {
-        if (rdb_crc_read(fd, buf, 4) == 0) goto READERR;
+        if (rdb_crc_read(p, buf, 4) != 4) goto READERR;
         return (int32_t)((uint8_t)buf[0] | ((uint8_t)buf[1] << 8) | ((uint8_t)buf[2] << 16) | ((uint8_t)buf[3] << 24));
     }
 
 READERR:
-    logger(ERROR, "Exited, as read error on load integer.\n");
-    exit(1);
+    rdb_fail(p, RDB_ERR_CORRUPT, "read error on load integer");
+}
+
+/*
+ * Read the compressed form of a lzf string without decoding it, the caller
+ * gets compressed bytes, and the raw length stored in the header is kept in
+ * *len, so consumers which only need the length never pay for lzf_decompress.
+ */
+char *
+rdb_read_lzf_raw(rdb_parser *p, size_t *clen, size_t *len)
+{
+    char *cstr;
+    uint64_t clen64, len64;
+
+    if((clen64 = rdb_read_store_len(p, NULL)) == REDIS_RDB_LENERR)
+        return NULL;
+    if((len64 = rdb_read_store_len(p, NULL)) == REDIS_RDB_LENERR)
+        return NULL;
+    rdb_check_len(p, clen64);
+    // redis never compresses empty strings, and the buffer is len + 1 bytes
+    if (rdb_unlikely(len64 == 0 || len64 > RDB_MAX_LZF_LEN || clen64 > RDB_MAX_LZF_LEN)) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "bad lzf string length %llu, compressed %llu",
+                (unsigned long long)len64, (unsigned long long)clen64);
+    }
+    *clen = clen64;
+    *len = len64;
+
+    cstr = malloc(*clen ? *clen : 1);
+    if (!cstr) {
+        rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at load lzf string");
+    }
+    if (rdb_crc_read(p, cstr, *clen) != *clen) {
+        free(cstr);
+        return NULL;
+    }
+
+    return cstr;
+}
+
+/*
+ * Decompress into a new NUL terminated string in *out, return RDB_ERR_CORRUPT
+ * if the data is bad, or RDB_ERR_NOMEM, the parser fails on the latter.
+ */
+int
+rdb_lzf_decode(const char *cstr, size_t clen, size_t len, char **out)
+{
+    char *str;
+
+    *out = NULL;
+    if ((str = malloc(len + 1)) == NULL) return RDB_ERR_NOMEM;
+    if (len > 0 && lzf_decompress(cstr, clen, str, len) != len) {
+        free(str);
+        return RDB_ERR_CORRUPT;
+    }
+    str[len] = '\0';
+    *out = str;
+    return RDB_OK;
 }
 
 static char *
-rdb_read_lzf_string(int fd)
+rdb_read_lzf_string(rdb_parser *p)
 {
-    int32_t clen, len;
+    size_t clen, len;
+    uint64_t start, offset = p->loaded_bytes;
     char *cstr, *str;
+    int ret;
     /*
      * 1. load compress length.
      * 2. load raw length.
      * 3. load lzf_string, and use lzf_decompress to decode.
      */
-
-    if((clen = rdb_read_store_len(fd, NULL)) == REDIS_RDB_LENERR)
-        return NULL;
-    if((len = rdb_read_store_len(fd, NULL)) == REDIS_RDB_LENERR)
-        return NULL;
-
-    cstr = malloc(clen);
-    str = malloc(len+1);
-    if (!cstr || !str) {
-        logger(ERROR, "Exited, as malloc failed at load lzf string.\n");
-        exit(1);
+    if ((cstr = rdb_read_lzf_raw(p, &clen, &len)) == NULL) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "read error on load lzf string");
+    }
+    // a bad one is read as empty, the key is dropped by the caller
+    start = rdb_phase_begin(p);
+    ret = rdb_lzf_decode(cstr, clen, len, &str);
+    rdb_phase_end(p, RDB_PHASE_LZF, start);
+    if (RDB_ERR_NOMEM == ret) {
+        free(cstr);
+        rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at load lzf string");
+    }
+    if (str == NULL) {
+        rdb_bad_value(p, offset, "lzf string", "decompress failed");
+        if ((str = calloc(1, 1)) == NULL) {
+            free(cstr);
+            rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at load lzf string");
+        }
     }
-
-    int ret;
-    if ((ret = rdb_crc_read(fd, cstr, clen)) == 0) goto err;
-    if( (ret = lzf_decompress(cstr, clen, str, len)) == 0) goto err;
-    str[len] = '\0';
 
     free(cstr);
     return str;
-
-err:
-    free(cstr);
-    free(str);
-    return NULL;
 }
 
-static char *
-rdb_read_string(int fd)
+char *
+rdb_read_string_body(rdb_parser *p, uint64_t len, uint8_t is_encoded)
 {
-    uint8_t is_encoded;
-    uint32_t len;
     char *buf;
     int32_t val;
 
-    len = rdb_read_store_len(fd, &is_encoded);
     if (is_encoded) {
         switch (len) {
 
             case REDIS_RDB_ENC_INT8:
             case REDIS_RDB_ENC_INT16:
             case REDIS_RDB_ENC_INT32:
-                val = rdb_read_int(fd, len);
-                return ll2string(val);
+                val = rdb_read_int(p, len);
+                if ((buf = malloc(LONG_STR_SIZE)) == NULL) {
+                    rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at load int string");
+                }
+                ll2str(buf, val);
+                return buf;
 
             case REDIS_RDB_ENC_LZF:
-                return rdb_read_lzf_string(fd);
+                return rdb_read_lzf_string(p);
 
              default:
-                // unkonwn error.
-                logger(ERROR, "Exited, as error on load string.\n");
+                rdb_fail(p, RDB_ERR_CORRUPT, "unknown string encoding %llu", (unsigned long long)len);
         }
     }
 
-    int i = 0, bytes;
+    rdb_check_len(p, len);
     buf = malloc(len + 1);
     if (!buf) {
-        logger(ERROR, "Exited, as malloc failed at load string.\n");
+        rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at load string");
     }
-    while ( i < len && (bytes = rdb_crc_read(fd, buf + i, len - i))) {
-        i += bytes;
+    if (rdb_unlikely(rdb_crc_read(p, buf, len) != len)) {
+        free(buf);
+        rdb_fail(p, RDB_ERR_CORRUPT, "read error on load %llu bytes", (unsigned long long)len);
     }
     buf[len] = '\0';
 
     return buf;
 }
 
-// ================================== SCRIPT PUSH UTIL. ==================================== //
+char *
+rdb_read_string(rdb_parser *p)
+{
+    uint8_t is_encoded;
+    uint64_t len;
+
+    len = rdb_read_store_len(p, &is_encoded);
+    if (REDIS_RDB_LENERR == len) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "read error on load string length");
+    }
+    return rdb_read_string_body(p, len, is_encoded);
+}
 
 static void
-rdb_push_list (lua_State *L, int fd)
+rdb_buf_reserve(rdb_parser *p, rdb_buf *b, size_t size)
 {
-    int i, len;
-    char *elem;
+    char *ptr;
 
-    len = rdb_read_store_len(fd, NULL); 
-    for (i = 0; i < len; i++) {
-        elem = rdb_read_string(fd);
-        script_push_list_elem(L, elem, i);
-        free(elem);
+    if (size <= b->cap) return;
+    if ((ptr = realloc(b->ptr, size)) == NULL) {
+        rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at rdb buffer");
     }
+    b->ptr = ptr;
+    b->cap = size;
 }
 
+/* decompress a lzf string into b, a bad one is read as empty and reported */
 static void
-rdb_push_hash (lua_State *L, int fd)
+rdb_lzf_decode_buf(rdb_parser *p, uint64_t offset, const char *cstr, size_t clen, size_t len, rdb_buf *b)
 {
-    int i, len;
-    char *key , *val;
+    uint64_t start;
+
+    rdb_buf_reserve(p, b, len + 1);
+    b->len = len;
+    start = rdb_phase_begin(p);
+    if (len > 0 && lzf_decompress(cstr, clen, b->ptr, len) != len) {
+        rdb_bad_value(p, offset, "lzf string", "decompress failed");
+        b->len = 0;
+    }
+    rdb_phase_end(p, RDB_PHASE_LZF, start);
+    b->ptr[b->len] = '\0';
+}
 
-    len = rdb_read_store_len(fd, NULL); 
-    for (i = 0; i < len; i++) {
-        key = rdb_read_string(fd);
-        val = rdb_read_string(fd);
-        script_pushtablestring(L, key, val);
-        free(key);
-        free(val);
+/* the string after its length slen was read at offset, into b */
+static void
+rdb_read_string_buf_body(rdb_parser *p, rdb_buf *b, uint64_t slen, uint8_t is_encoded, uint64_t offset)
+{
+    char *cstr;
+    size_t clen, len;
+
+    if (!is_encoded) {
+        rdb_check_len(p, slen);
+        rdb_buf_reserve(p, b, slen + 1);
+        rdb_read_bytes(p, b->ptr, slen);
+        b->len = slen;
+        b->ptr[slen] = '\0';
+        return;
+    }
+
+    switch (slen) {
+        case REDIS_RDB_ENC_INT8:
+        case REDIS_RDB_ENC_INT16:
+        case REDIS_RDB_ENC_INT32:
+            rdb_buf_reserve(p, b, LONG_STR_SIZE);
+            b->len = ll2str(b->ptr, rdb_read_int(p, slen));
+            return;
+        case REDIS_RDB_ENC_LZF:
+            if ((cstr = rdb_read_lzf_raw(p, &clen, &len)) == NULL) {
+                rdb_fail(p, RDB_ERR_CORRUPT, "read error on load lzf string");
+            }
+            rdb_lzf_decode_buf(p, offset, cstr, clen, len, b);
+            free(cstr);
+            return;
+        default:
+            rdb_fail(p, RDB_ERR_CORRUPT, "unknown string encoding %llu", (unsigned long long)slen);
     }
 }
 
-// ================================== RDB LOAD. ==================================== //
+/*
+ * Same as rdb_read_string, but into a reusable buffer and binary safe, the
+ * string is NUL terminated as well.
+ */
+void
+rdb_read_string_buf(rdb_parser *p, rdb_buf *b)
+{
+    uint8_t is_encoded;
+    uint64_t slen, offset = p->loaded_bytes;
 
-static void
-rdb_set_value_type(lua_State *L, int type)
+    slen = rdb_read_store_len(p, &is_encoded);
+    if (REDIS_RDB_LENERR == slen) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "read error on load string length");
+    }
+    rdb_read_string_buf_body(p, b, slen, is_encoded, offset);
+}
+
+/*
+ * A value of the current key is bad, but the input is still in step, as the
+ * value was read by its length. It's fatal unless validating.
+ */
+void
+rdb_bad_value(rdb_parser *p, uint64_t offset, const char *what, const char *reason)
+{
+    p->bad_value = 1;
+    p->bad_values++;
+    // elements after a bad one are not passed
+    p->emit_skip = 1;
+    if (p->trial) return;
+    if (!p->validate) {
+        snprintf(p->fail_msg, sizeof(p->fail_msg), "bad %s of key %.*s, %s", what,
+                (int)p->key_buf.len, p->key_buf.ptr ? p->key_buf.ptr : "", reason);
+        rdb_throw(p, RDB_ERR_CORRUPT, offset);
+    }
+    logger(WARN, "Bad %s of key %.*s at offset %llu, %s.\n",
+            what, (int)p->key_buf.len, p->key_buf.ptr ? p->key_buf.ptr : "",
+            (unsigned long long)offset, reason);
+}
+
+/* result of stream_walk_listpack, which fails only if malloc does */
+int64_t
+rdb_check_walk(rdb_parser *p, uint64_t offset, int64_t n)
+{
+    if (STREAM_ERR_NOMEM == n) rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at stream entries");
+    if (n < 0) rdb_bad_value(p, offset, "stream node", "entry is truncated");
+    return n < 0 ? 0 : n;
+}
+
+/*
+ * Read an encoded value into blob_buf, and check it once, so it can be
+ * decoded without checks. Return NULL if it's bad, which is reported.
+ */
+const char *
+rdb_read_blob(rdb_parser *p, int kind)
+{
+    static const char *names[] = {
+        "intset", "zipmap", "ziplist", "ziplist", "listpack", "listpack", "stream listpack"
+    };
+    rdb_buf *b = &p->blob_buf;
+    uint64_t offset = p->loaded_bytes, bad = p->bad_values;
+    const char *reason = NULL;
+    size_t off = 0;
+    char why[128];
+
+    rdb_read_string_buf(p, b);
+    if (p->bad_values != bad) return NULL;
+    switch (kind) {
+        case RDB_BLOB_INTSET: reason = intset_validate(b->ptr, b->len, &off); break;
+        case RDB_BLOB_ZIPMAP: reason = zipmap_validate(b->ptr, b->len, &off); break;
+        case RDB_BLOB_ZIPLIST: reason = ziplist_validate(b->ptr, b->len, 0, &off); break;
+        case RDB_BLOB_ZIPLIST_PAIRS: reason = ziplist_validate(b->ptr, b->len, 1, &off); break;
+        case RDB_BLOB_LISTPACK: reason = listpack_validate(b->ptr, b->len, 0, &off); break;
+        case RDB_BLOB_LISTPACK_PAIRS: reason = listpack_validate(b->ptr, b->len, 1, &off); break;
+        case RDB_BLOB_STREAM: reason = stream_validate_listpack(b->ptr, b->len, &off); break;
+    }
+    if (!reason) return b->ptr;
+
+    // offset is of the string, off is of the error in its bytes
+    snprintf(why, sizeof(why), "%s at byte %zu", reason, off);
+    rdb_bad_value(p, offset, names[kind], why);
+    return NULL;
+}
+
+/*
+ * zset score before rdb version 8 is stored as string with 1 byte length,
+ * and 253, 254, 255 are stand for nan, inf and -inf.
+ */
+char *
+rdb_read_double_str(rdb_parser *p)
+{
+    uint8_t len;
+    char *buf;
+
+    rdb_read_bytes(p, &len, 1);
+    switch (len) {
+        case 253: return strdup("nan");
+        case 254: return strdup("inf");
+        case 255: return strdup("-inf");
+    }
+
+    if ((buf = malloc(len + 1)) == NULL) {
+        rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at load double");
+    }
+    rdb_read_bytes(p, buf, len);
+    buf[len] = '\0';
+
+    return buf;
+}
+
+/* zset score since rdb version 8 is stored as 8 bytes binary double */
+int
+rdb_read_binary_double_str(rdb_parser *p, char *buf, size_t size)
+{
+    double val;
+
+    rdb_read_bytes(p, &val, 8);
+    memrev64ifbe(&val);
+    return snprintf(buf, size, "%.17g", val);
+}
+
+int64_t
+rdb_read_millisecond_time(rdb_parser *p)
+{
+    int64_t t64;
+
+    rdb_read_bytes(p, &t64, 8);
+    memrev64ifbe(&t64);
+    return t64;
+}
+
+void
+rdb_read_stream_id(rdb_parser *p, stream_id *id)
+{
+    id->ms = rdb_read_store_len(p, NULL);
+    id->seq = rdb_read_store_len(p, NULL);
+}
+
+static uint32_t
+rdb_load_expiretime(rdb_parser *p, int type)
+{
+    char buf[8];
+    uint32_t t32;
+    uint64_t t64;
+    size_t ret;
+
+    if (REDIS_EXPIRE_SEC == type) {
+        ret = rdb_crc_read(p, buf, 4) == 4;
+        memcpy(&t32, buf, 4);
+    } else {
+        ret = rdb_crc_read(p, buf, 8) == 8;
+        memcpy(&t64, buf, 8);
+        t32 = (uint32_t) (t64 / 1000);
+    }
+
+    if (!ret) rdb_fail(p, RDB_ERR_CORRUPT, "read error on load expire time");
+
+    return t32;
+}
+
+const char *
+rdb_value_type_name(int type)
 {
-    char *val_type = NULL;
+    const char *val_type = NULL;
     switch (type) {
         case REDIS_RDB_STRING:       val_type = "string"; break;
         case REDIS_RDB_INTSET:       val_type = "set";    break;
@@ -288,217 +645,1757 @@ rdb_set_value_type(lua_State *L, int type)
         case REDIS_RDB_SET:          val_type = "set";    break;
         case REDIS_RDB_HASH:         val_type = "hash";   break;
         case REDIS_RDB_ZSET:         val_type = "zset";   break;
-        default: return;
+        case REDIS_RDB_ZSET_2:       val_type = "zset";   break;
+        case REDIS_RDB_MODULE_2:     val_type = "module"; break;
+        case REDIS_RDB_LIST_QUICKLIST:   val_type = "list"; break;
+        case REDIS_RDB_LIST_QUICKLIST_2: val_type = "list"; break;
+        case REDIS_RDB_HASH_LISTPACK:    val_type = "hash"; break;
+        case REDIS_RDB_ZSET_LISTPACK:    val_type = "zset"; break;
+        case REDIS_RDB_SET_LISTPACK:     val_type = "set";  break;
+        case REDIS_RDB_STREAM_LISTPACKS:
+        case REDIS_RDB_STREAM_LISTPACKS_2:
+        case REDIS_RDB_STREAM_LISTPACKS_3: val_type = "stream"; break;
+        default: return NULL;
     }
 
-    script_pushtablestring(L, TYPE_FIELD_STR, val_type);
+    return val_type;
 }
 
-static void
-rdb_load_str_value(lua_State *L, int fd)
+/*
+ * module value can't be decoded without the module, but since module type 2
+ * every field is tagged with an opcode, so it can be skipped.
+ */
+void
+rdb_skip_module_value(rdb_parser *p)
 {
-    char *str;
-
-    str = rdb_read_string(fd);
-    script_pushtablestring(L, VAL_FIELD_STR, str);
-
-    free(str);
+    char buf[8];
+    uint64_t opcode;
+
+    while ((opcode = rdb_read_store_len(p, NULL)) != REDIS_MODULE_OPCODE_EOF) {
+        switch (opcode) {
+            case REDIS_MODULE_OPCODE_SINT:
+            case REDIS_MODULE_OPCODE_UINT: rdb_read_store_len(p, NULL); break;
+            case REDIS_MODULE_OPCODE_FLOAT: rdb_read_bytes(p, buf, 4); break;
+            case REDIS_MODULE_OPCODE_DOUBLE: rdb_read_bytes(p, buf, 8); break;
+            case REDIS_MODULE_OPCODE_STRING: rdb_read_string_buf(p, &p->blob_buf); break;
+            default: rdb_fail(p, RDB_ERR_CORRUPT, "unknown module opcode %llu", (unsigned long long)opcode);
+        }
+    }
 }
 
-static void
-rdb_load_intset_value(lua_State *L, int fd)
+void
+rdb_module_name(uint64_t module_id, char *name)
 {
     int i;
-    int64_t v64;
-    char *str, *s64; 
-
-    str = rdb_read_string(fd);
-    intset *is = (intset*) str;
+    const char *charset = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 
-    lua_pushstring(L, VAL_FIELD_STR);
-    lua_newtable(L);
-    for (i = 0; i< is->length; i++) {
-        intset_get(is, i, &v64);
-        s64 = ll2string(v64); 
-        script_push_list_elem(L, s64, i);
-        free(s64);
+    // 54 bits name(9 chars * 6 bits) and 10 bits encoding version.
+    module_id >>= 10;
+    for (i = 0; i < 9; i++) {
+        name[8 - i] = charset[module_id & 63];
+        module_id >>= 6;
     }
-    lua_settable(L,-3);
-
-    free(str);
+    name[9] = '\0';
 }
 
 static void
-rdb_load_zllist_value(lua_State *L, int fd)
+rdb_skip_module_aux(rdb_parser *p)
 {
-    char *str;
+    uint64_t when_opcode;
+
+    // module id, and when(before or after keyspace) with opcode.
+    rdb_read_store_len(p, NULL);
+    when_opcode = rdb_read_store_len(p, NULL);
+    if (REDIS_MODULE_OPCODE_UINT != when_opcode) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "bad when opcode %llu in module aux", (unsigned long long)when_opcode);
+    }
+    rdb_read_store_len(p, NULL);
+    rdb_skip_module_value(p);
+}
+
+// ================================== EMIT EVENTS. ==================================== //
 
-    str = rdb_read_string(fd);
-    lua_pushstring(L, VAL_FIELD_STR);
-    lua_newtable(L);
-    push_ziplist_list_or_set(L, str);
-    lua_settable(L,-3);
+typedef struct {
+    rdb_parser *p;
+    rdb_key_info *info;
+} rdb_stream_emit_ctx;
 
-    free(str);
+static void
+rdb_emit_check(rdb_parser *p, int ret, const char *cb, const rdb_key_info *info)
+{
+    if (ret < 0) {
+        rdb_fail(p, RDB_ERR_PLUGIN, "plugin %s failed at key %.*s", cb, (int)info->key.len, info->key.ptr);
+    }
 }
 
 static void
-rdb_load_zipmap_value (lua_State *L, int fd)
+rdb_emit_begin(rdb_parser *p, rdb_key_info *info, uint64_t size_hint)
 {
-    char *str;
+    int ret = RDB_PLUGIN_OK;
+    uint64_t start;
+
+    info->size_hint = size_hint;
+    if (p->bad_value) {
+        p->emit_element = 0;
+        p->emit_stream = 0;
+        p->emit_skip = 1;
+        return;
+    }
+    if (p->handlers.on_key_begin) {
+        start = rdb_phase_begin(p);
+        ret = p->handlers.on_key_begin(p->handlers.ud, info);
+        rdb_phase_end(p, RDB_PHASE_HANDLER, start);
+        rdb_emit_check(p, ret, "on_key_begin", info);
+    }
+    p->emit_element = RDB_PLUGIN_SKIP_KEY != ret && p->handlers.on_element;
+    p->emit_stream = RDB_PLUGIN_SKIP_KEY != ret && (p->handlers.on_stream_group
+            || p->handlers.on_stream_consumer || p->handlers.on_stream_pending);
+    // the digest needs all elements, even if the handlers skip them
+    p->emit_skip = !p->emit_element && !p->digest;
+    if (p->digest) digest_init(&p->digest_state, info->type_name);
+}
 
-    str = rdb_read_string(fd);
-    lua_pushstring(L, VAL_FIELD_STR);
-    lua_newtable(L);
-    push_zipmap(L, str);
-    lua_settable(L,-3);
+static void
+rdb_emit(rdb_parser *p, rdb_key_info *info, const char *member, size_t mlen, const char *value, size_t vlen, const char *id, size_t id_len)
+{
+    rdb_element elem;
+    uint64_t start;
+    int ret;
 
-    free(str);
+    if (p->emit_skip) return;
+    if (p->digest) digest_add(&p->digest_state, member, mlen, value, vlen, id, id_len);
+    if (!p->emit_element) return;
+    elem.member.ptr = member;
+    elem.member.len = mlen;
+    elem.value.ptr = value;
+    elem.value.len = vlen;
+    elem.id.ptr = id;
+    elem.id.len = id_len;
+    start = rdb_phase_begin(p);
+    ret = p->handlers.on_element(p->handlers.ud, info, &elem);
+    rdb_phase_end(p, RDB_PHASE_HANDLER, start);
+    rdb_emit_check(p, ret, "on_element", info);
 }
 
+/* emit a listpack or ziplist entry, integers are formatted on the stack */
 static void
-rdb_load_ziplist_value(lua_State *L, int fd)
+rdb_emit_entry(rdb_parser *p, rdb_key_info *info, lp_entry *member, lp_entry *value)
 {
-    char *str;
+    char mbuf[LONG_STR_SIZE], vbuf[LONG_STR_SIZE];
+    const char *m, *v = NULL;
+    size_t mlen, vlen = 0;
+
+    if (p->emit_skip) return;
+    m = member->sval;
+    mlen = member->slen;
+    if (!m) {
+        mlen = ll2str(mbuf, member->lval);
+        m = mbuf;
+    }
+    if (value) {
+        v = value->sval;
+        vlen = value->slen;
+        if (!v) {
+            vlen = ll2str(vbuf, value->lval);
+            v = vbuf;
+        }
+    }
+    rdb_emit(p, info, m, mlen, v, vlen, NULL, 0);
+}
 
-    str = rdb_read_string(fd);
-    lua_pushstring(L, VAL_FIELD_STR);
-    lua_newtable(L);
-    push_ziplist_hash_or_zset(L, str);
-    lua_settable(L,-3);
+static void
+rdb_emit_ziplist(rdb_parser *p, rdb_key_info *info, const char *zl, int pairs)
+{
+    const char *s = (const char *)ZL_ENTRY(zl);
+    lp_entry member, value;
 
-    free(str);
+    while ((s = ziplist_next(s, &member)) != NULL) {
+        if (pairs && (s = ziplist_next(s, &value)) == NULL) break;
+        rdb_emit_entry(p, info, &member, pairs ? &value : NULL);
+    }
 }
 
 static void
-rdb_load_list_or_set_value(lua_State *L, int fd)
+rdb_emit_listpack(rdb_parser *p, rdb_key_info *info, const char *lp, int pairs)
 {
-    lua_pushstring(L, VAL_FIELD_STR);
-    lua_newtable(L);
-    rdb_push_list(L, fd);
-    lua_settable(L,-3);
+    const char *s = listpack_first(lp);
+    lp_entry member, value;
+
+    while ((s = listpack_next(s, &member)) != NULL) {
+        if (pairs && (s = listpack_next(s, &value)) == NULL) break;
+        rdb_emit_entry(p, info, &member, pairs ? &value : NULL);
+    }
 }
 
 static void
-rdb_load_hash_or_zset_value (lua_State *L, int fd)
+rdb_emit_stream_entry(void *ud, stream_id *id, lp_entry *fields, lp_entry *values, int64_t count)
 {
-    lua_pushstring(L, VAL_FIELD_STR);
-    lua_newtable(L);
-    rdb_push_hash(L, fd);
-    lua_settable(L,-3);
+    int64_t i;
+    int len;
+    char buf[STREAM_ID_STR_SIZE], mbuf[LONG_STR_SIZE], vbuf[LONG_STR_SIZE];
+    rdb_stream_emit_ctx *ctx = ud;
+    const char *m, *v;
+    size_t mlen, vlen;
+
+    len = stream_id_format(buf, id);
+    for (i = 0; i < count; i++) {
+        m = fields[i].sval;
+        mlen = fields[i].slen;
+        if (!m) {
+            mlen = ll2str(mbuf, fields[i].lval);
+            m = mbuf;
+        }
+        v = values[i].sval;
+        vlen = values[i].slen;
+        if (!v) {
+            vlen = ll2str(vbuf, values[i].lval);
+            v = vbuf;
+        }
+        rdb_emit(ctx->p, ctx->info, m, mlen, v, vlen, buf, len);
+    }
 }
 
-void
-rdb_load_value(lua_State *L, int fd, int type)
+/* pass a stream callback, if the key is not skipped or bad */
+#define rdb_emit_stream_cb(p, info, cb, arg) do { \
+    uint64_t _start; \
+    int _ret; \
+    if ((p)->emit_stream && !(p)->bad_value && (p)->handlers.cb) { \
+        _start = rdb_phase_begin(p); \
+        _ret = (p)->handlers.cb((p)->handlers.ud, info, arg); \
+        rdb_phase_end(p, RDB_PHASE_HANDLER, _start); \
+        rdb_emit_check(p, _ret, #cb, info); \
+    } \
+} while (0)
+
+/*
+ * stream metadata, then consumer groups: name, last id, [entries read], pel
+ * and consumers. Metadata is not passed to handlers, the groups are passed
+ * to the stream callbacks. Group names are kept in member_buf and consumer
+ * names in value_buf while their pending entries are read.
+ */
+static void
+rdb_emit_stream_meta(rdb_parser *p, rdb_key_info *info, int type)
 {
-    switch (type) {
-        case       REDIS_RDB_STRING: rdb_load_str_value(L, fd); break;
-        case       REDIS_RDB_INTSET: rdb_load_intset_value(L, fd); break;
-        case REDIS_RDB_LIST_ZIPLIST: rdb_load_zllist_value(L, fd); break;
-        case       REDIS_RDB_ZIPMAP: rdb_load_zipmap_value(L, fd); break;
-        case REDIS_RDB_ZSET_ZIPLIST:
-        case REDIS_RDB_HASH_ZIPLIST: rdb_load_ziplist_value(L, fd); break;
-        case         REDIS_RDB_LIST:
-        case          REDIS_RDB_SET: rdb_load_list_or_set_value(L, fd); break;
-        case         REDIS_RDB_HASH:
-        case         REDIS_RDB_ZSET: rdb_load_hash_or_zset_value(L, fd); break;
+    char raw[STREAM_ID_SIZE], buf[STREAM_ID_STR_SIZE], pel_buf[STREAM_ID_STR_SIZE];
+    uint64_t i, j, k, ngroups, npel, nconsumers, consumer = 0;
+    rdb_stream_group group;
+    rdb_stream_consumer cons;
+    rdb_stream_pending pending;
+    stream_id id;
+
+    rdb_read_store_len(p, NULL);
+    rdb_read_stream_id(p, &id);
+    if (type >= REDIS_RDB_STREAM_LISTPACKS_2) {
+        rdb_read_stream_id(p, &id);
+        rdb_read_stream_id(p, &id);
+        rdb_read_store_len(p, NULL);
+    }
+
+    ngroups = rdb_read_count(p);
+    for (i = 0; i < ngroups; i++) {
+        rdb_read_string_buf(p, &p->member_buf);
+        group.name.ptr = p->member_buf.ptr;
+        group.name.len = p->member_buf.len;
+        rdb_read_stream_id(p, &id);
+        group.last_id.ptr = buf;
+        group.last_id.len = stream_id_format(buf, &id);
+        group.entries_read = -1;
+        if (type >= REDIS_RDB_STREAM_LISTPACKS_2) group.entries_read = rdb_read_store_len(p, NULL);
+        rdb_emit_stream_cb(p, info, on_stream_group, &group);
+
+        pending.id.ptr = pel_buf;
+        pending.group = i;
+        pending.consumer = -1;
+        npel = rdb_read_count(p);
+        for (j = 0; j < npel; j++) {
+            rdb_read_bytes(p, raw, STREAM_ID_SIZE);
+            stream_id_decode(raw, &id);
+            pending.id.len = stream_id_format(pel_buf, &id);
+            pending.delivery_time = rdb_read_millisecond_time(p);
+            pending.delivery_count = rdb_read_store_len(p, NULL);
+            rdb_emit_stream_cb(p, info, on_stream_pending, &pending);
+        }
 
-        default: logger(ERROR, "Value type error."); break;
+        nconsumers = rdb_read_count(p);
+        for (j = 0; j < nconsumers; j++, consumer++) {
+            rdb_read_string_buf(p, &p->value_buf);
+            cons.name.ptr = p->value_buf.ptr;
+            cons.name.len = p->value_buf.len;
+            cons.seen_time = rdb_read_millisecond_time(p);
+            cons.active_time = -1;
+            if (type >= REDIS_RDB_STREAM_LISTPACKS_3) cons.active_time = rdb_read_millisecond_time(p);
+            cons.group = i;
+            rdb_emit_stream_cb(p, info, on_stream_consumer, &cons);
+
+            pending.consumer = consumer;
+            pending.delivery_time = -1;
+            pending.delivery_count = 0;
+            npel = rdb_read_count(p);
+            for (k = 0; k < npel; k++) {
+                rdb_read_bytes(p, raw, STREAM_ID_SIZE);
+                stream_id_decode(raw, &id);
+                pending.id.len = stream_id_format(pel_buf, &id);
+                rdb_emit_stream_cb(p, info, on_stream_pending, &pending);
+            }
+        }
     }
 }
 
-static uint32_t
-rdb_load_expiretime(int fd, int type)
+static void
+rdb_emit_stream(rdb_parser *p, rdb_key_info *info, int type)
 {
-    char buf[8];
-    uint32_t t32;
-    uint64_t t64;
-    int ret;
-
-    if (REDIS_EXPIRE_SEC == type) {
-        ret = rdb_crc_read(fd, buf, 4);
-        memcpy(&t32, buf, 4);
-    } else {
-        ret = rdb_crc_read(fd, buf, 8);
-        memcpy(&t64, buf, 8);
-        t32 = (uint32_t) (t64 / 1000);
+    uint64_t i, nodes, offset;
+    stream_id master;
+    const char *lp;
+    rdb_stream_emit_ctx ctx = { p, info };
+
+    nodes = rdb_read_count(p);
+    rdb_emit_begin(p, info, 0);
+    for (i = 0; i < nodes; i++) {
+        offset = p->loaded_bytes;
+        rdb_read_string_buf(p, &p->member_buf);
+        if (p->member_buf.len != STREAM_ID_SIZE) {
+            rdb_bad_value(p, offset, "stream node key", "length is not 16");
+        } else {
+            stream_id_decode(p->member_buf.ptr, &master);
+        }
+        lp = rdb_read_blob(p, RDB_BLOB_STREAM);
+        if (lp && !p->emit_skip) {
+            rdb_check_walk(p, offset, stream_walk_listpack(&p->walker, lp, &master, rdb_emit_stream_entry, &ctx));
+        }
     }
-    
-    if (!ret) logger(ERROR, "Load expire time error.");
-
-    return t32;
+    rdb_emit_stream_meta(p, info, type);
 }
 
-int
-rdb_load(lua_State *L, const char *path)
+static void
+rdb_emit_quicklist(rdb_parser *p, rdb_key_info *info, int type)
 {
-    char buf[128];
-    uint8_t type;
-    int expire_time;
+    uint64_t i, len, container;
+    const char *node;
 
-    int rdb_fd = open(path, O_RDONLY);
-    // read magic string(5bytes) and version(4bytes)
-    if(rdb_crc_read(rdb_fd, buf, 9) == 0) {
-        logger(ERROR,"Exited, as read error on laod version\n");
+    len = rdb_read_count(p);
+    rdb_emit_begin(p, info, 0);
+    for (i = 0; i < len; i++) {
+        container = QUICKLIST_NODE_PACKED;
+        if (REDIS_RDB_LIST_QUICKLIST_2 == type) {
+            container = rdb_read_store_len(p, NULL);
+        }
+        if (REDIS_RDB_LIST_QUICKLIST == type) {
+            if ((node = rdb_read_blob(p, RDB_BLOB_ZIPLIST)) != NULL) rdb_emit_ziplist(p, info, node, 0);
+        } else if (QUICKLIST_NODE_PLAIN == container) {
+            rdb_read_string_buf(p, &p->blob_buf);
+            rdb_emit(p, info, p->blob_buf.ptr, p->blob_buf.len, NULL, 0, NULL, 0);
+        } else if (QUICKLIST_NODE_PACKED == container) {
+            if ((node = rdb_read_blob(p, RDB_BLOB_LISTPACK)) != NULL) rdb_emit_listpack(p, info, node, 0);
+        } else {
+            rdb_fail(p, RDB_ERR_CORRUPT, "unknown quicklist container %llu", (unsigned long long)container);
+        }
     }
-    buf[9] = '\0';
-    if(memcmp(buf, MAGIC_STR, 5) != 0) return -2;
-    version = atoi(buf + 5);
-    rdb_set_int_env(L, VERSION_STR, version);
+}
 
-    while (1) {
-        expire_time = -1;
-        type = rdb_read_kv_type(rdb_fd);
-        // load expire time if exists
-        if (REDIS_EXPIRE_SEC == type || REDIS_EXPIRE_MS == type) {
-            expire_time = rdb_load_expiretime(rdb_fd, type); 
-            type = rdb_read_kv_type(rdb_fd);
+static void
+rdb_emit_collection(rdb_parser *p, rdb_key_info *info, int type)
+{
+    uint64_t i, len;
+    int64_t v;
+    uint8_t dlen;
+    char buf[256];
+    const char *s;
+
+    len = rdb_read_count(p);
+    rdb_emit_begin(p, info, len);
+    for (i = 0; i < len; i++) {
+        rdb_read_string_buf(p, &p->member_buf);
+        if (REDIS_RDB_LIST == type || REDIS_RDB_SET == type) {
+            rdb_emit(p, info, p->member_buf.ptr, p->member_buf.len, NULL, 0, NULL, 0);
+            continue;
         }
-        // select db
-        if (REDIS_SELECT_DB == type) {
-            if (rdb_crc_read(rdb_fd, buf, 1) == 0) {
-                logger(ERROR, "Exited, as read error on laod db num.\n");
-            }
-
-            rdb_set_int_env(L, DB_NUM_STR, (uint8_t)buf[0]);
+        if (REDIS_RDB_HASH == type) {
+            rdb_read_string_buf(p, &p->value_buf);
+            rdb_emit(p, info, p->member_buf.ptr, p->member_buf.len, p->value_buf.ptr, p->value_buf.len, NULL, 0);
             continue;
         }
-
-        // end of rdb file
-        if(REDIS_EOF == type) break;
-
-        // read key
-        char *key = rdb_read_string(rdb_fd);
-        if (key) {
-            lua_getglobal(L, RDB_CB); 
-            lua_newtable(L);
-            script_pushtablestring(L, KEY_FIELD_STR, key);
-            script_pushtableinteger(L, EXP_FIELD_STR, expire_time);
-            // read value
-            rdb_load_value(L, rdb_fd, type);
-            // set value type
-            rdb_set_value_type(L, type);
-            // revoke lua callback function
-            if( lua_pcall(L, 1, 0, 0) != 0 ) {
-                logger(ERROR, "Runing handle function failed: %s", lua_tostring(L, -1));
-            }
-            script_need_gc(L);
+        if (REDIS_RDB_ZSET_2 == type) {
+            v = rdb_read_binary_double_str(p, buf, sizeof(buf));
+            rdb_emit(p, info, p->member_buf.ptr, p->member_buf.len, buf, v, NULL, 0);
+            continue;
+        }
+        rdb_read_bytes(p, &dlen, 1);
+        switch (dlen) {
+            case 253: s = "nan"; v = 3; break;
+            case 254: s = "inf"; v = 3; break;
+            case 255: s = "-inf"; v = 4; break;
+            default:
+                rdb_read_bytes(p, buf, dlen);
+                s = buf;
+                v = dlen;
         }
-        free(key);
+        rdb_emit(p, info, p->member_buf.ptr, p->member_buf.len, s, v, NULL, 0);
     }
+}
 
-    if (version >= MAGIC_VERSION) rdb_check_crc(rdb_fd, cksum);
-    
-    struct stat st;
-    if(fstat(rdb_fd, &st) != 0) {
-        logger(ERROR, "fstat error when load rdb file, as %s.", strerror(errno));
+/*
+ * A lzf string is only decompressed after on_key_begin, if its key is not
+ * skipped, or for the digest and validation, which need the bytes.
+ */
+static void
+rdb_emit_string(rdb_parser *p, rdb_key_info *info)
+{
+    char *cstr;
+    uint8_t is_encoded;
+    size_t clen, len;
+    uint64_t slen, offset = p->loaded_bytes;
+
+    slen = rdb_read_store_len(p, &is_encoded);
+    if (REDIS_RDB_LENERR == slen) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "read error on load string length");
     }
-    
-    if(st.st_size != loaded_bytes) {
-        logger(ERROR, "Load rdb file failed, Bytes is %llu, expected is %llu version %d", 
-                loaded_bytes, st.st_size, version);
+    if (!is_encoded || REDIS_RDB_ENC_LZF != slen) {
+        rdb_read_string_buf_body(p, &p->value_buf, slen, is_encoded, offset);
+        info->raw_len = p->value_buf.len;
+        rdb_emit_begin(p, info, 1);
+        rdb_emit(p, info, p->value_buf.ptr, p->value_buf.len, NULL, 0, NULL, 0);
+        return;
     }
 
-    close(rdb_fd);
-    return 0;
+    if ((cstr = rdb_read_lzf_raw(p, &clen, &len)) == NULL) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "read error on load lzf string");
+    }
+    info->raw_len = len;
+    info->compressed_len = clen;
+    rdb_emit_begin(p, info, 1);
+    if (!p->emit_skip || p->validate) rdb_lzf_decode_buf(p, offset, cstr, clen, len, &p->value_buf);
+    free(cstr);
+    if (!p->bad_value) rdb_emit(p, info, p->value_buf.ptr, p->value_buf.len, NULL, 0, NULL, 0);
+}
+
+/*
+ * Decode the value of a key into on_element calls, the element views point
+ * into the decoded buffers, nothing is copied per element.
+ */
+static void
+rdb_emit_value(rdb_parser *p, rdb_key_info *info)
+{
+    uint32_t i, j, n;
+    int64_t ints[INTSET_DECODE_BATCH];
+    char buf[LONG_STR_SIZE];
+    const char *s;
+    lp_entry field, value;
+    intset *is;
+    uint64_t start;
+    int ret, type = info->type;
+
+    switch (type) {
+        case REDIS_RDB_STRING:
+            rdb_emit_string(p, info);
+            break;
+        case REDIS_RDB_LIST:
+        case REDIS_RDB_SET:
+        case REDIS_RDB_HASH:
+        case REDIS_RDB_ZSET:
+        case REDIS_RDB_ZSET_2:
+            rdb_emit_collection(p, info, type);
+            break;
+        case REDIS_RDB_INTSET:
+            if ((is = (intset *)rdb_read_blob(p, RDB_BLOB_INTSET)) == NULL) break;
+            rdb_emit_begin(p, info, is->length);
+            for (i = 0; !p->emit_skip && (n = intset_decode(is, i, ints, INTSET_DECODE_BATCH)) > 0; i += n) {
+                for (j = 0; j < n; j++) {
+                    rdb_emit(p, info, buf, ll2str(buf, ints[j]), NULL, 0, NULL, 0);
+                }
+            }
+            break;
+        case REDIS_RDB_ZIPMAP:
+            if ((s = rdb_read_blob(p, RDB_BLOB_ZIPMAP)) == NULL) break;
+            rdb_emit_begin(p, info, ZM_LEN_HINT(s));
+            s = zipmap_first(s);
+            while (!p->emit_skip && (s = zipmap_next(s, &field, &value)) != NULL) {
+                rdb_emit(p, info, field.sval, field.slen, value.sval, value.slen, NULL, 0);
+            }
+            break;
+        case REDIS_RDB_LIST_ZIPLIST:
+            if ((s = rdb_read_blob(p, RDB_BLOB_ZIPLIST)) == NULL) break;
+            rdb_emit_begin(p, info, ZL_LEN_HINT(s));
+            rdb_emit_ziplist(p, info, s, 0);
+            break;
+        case REDIS_RDB_ZSET_ZIPLIST:
+        case REDIS_RDB_HASH_ZIPLIST:
+            if ((s = rdb_read_blob(p, RDB_BLOB_ZIPLIST_PAIRS)) == NULL) break;
+            rdb_emit_begin(p, info, ZL_LEN_HINT(s) / 2);
+            rdb_emit_ziplist(p, info, s, 1);
+            break;
+        case REDIS_RDB_SET_LISTPACK:
+            if ((s = rdb_read_blob(p, RDB_BLOB_LISTPACK)) == NULL) break;
+            rdb_emit_begin(p, info, LP_LEN_HINT(s));
+            rdb_emit_listpack(p, info, s, 0);
+            break;
+        case REDIS_RDB_HASH_LISTPACK:
+        case REDIS_RDB_ZSET_LISTPACK:
+            if ((s = rdb_read_blob(p, RDB_BLOB_LISTPACK_PAIRS)) == NULL) break;
+            rdb_emit_begin(p, info, LP_LEN_HINT(s) / 2);
+            rdb_emit_listpack(p, info, s, 1);
+            break;
+        case REDIS_RDB_LIST_QUICKLIST:
+        case REDIS_RDB_LIST_QUICKLIST_2:
+            rdb_emit_quicklist(p, info, type);
+            break;
+        case REDIS_RDB_MODULE_2:
+            rdb_read_store_len(p, NULL);
+            rdb_emit_begin(p, info, 0);
+            rdb_skip_module_value(p);
+            break;
+        case REDIS_RDB_STREAM_LISTPACKS:
+        case REDIS_RDB_STREAM_LISTPACKS_2:
+        case REDIS_RDB_STREAM_LISTPACKS_3:
+            rdb_emit_stream(p, info, type);
+            break;
+        case REDIS_RDB_MODULE:
+            rdb_fail(p, RDB_ERR_UNSUPPORTED, "module type 1 is not supported, it can't be parsed without the module");
+            break;
+        default: rdb_fail(p, RDB_ERR_CORRUPT, "unknown value type %d", type); break;
+    }
+
+    // a bad key is dropped, its handlers never see it complete
+    if (p->bad_value) return;
+    if (p->digest) {
+        digest_final(&p->digest_state, &p->digest_out);
+        info->digest = &p->digest_out.h1;
+    }
+    if (p->handlers.on_key_end) {
+        start = rdb_phase_begin(p);
+        ret = p->handlers.on_key_end(p->handlers.ud, info);
+        rdb_phase_end(p, RDB_PHASE_HANDLER, start);
+        rdb_emit_check(p, ret, "on_key_end", info);
+    }
+}
+
+// ================================== PULL EVENTS. ==================================== //
+
+/*
+ * Slices are kept as offset + 1 into the arena while a key is collected,
+ * as the arena may move when it grows, and turned into pointers at the end.
+ */
+static const char *
+rdb_arena_push(rdb_parser *p, const char *ptr, size_t len)
+{
+    size_t off = p->arena.len;
+
+    if (!ptr) return NULL;
+    rdb_buf_reserve(p, &p->arena, off + len + 1);
+    memcpy(p->arena.ptr + off, ptr, len);
+    p->arena.ptr[off + len] = '\0';
+    p->arena.len += len + 1;
+    return (const char *)(uintptr_t)(off + 1);
+}
+
+static void
+rdb_arena_fix(rdb_parser *p, rdb_slice *s)
+{
+    if (s->ptr) s->ptr = p->arena.ptr + ((uintptr_t)s->ptr - 1);
+}
+
+/* grow an array of the pull api to hold n + 1 items */
+static void *
+rdb_pull_grow(rdb_parser *p, void *arr, size_t n, size_t *cap, size_t size)
+{
+    if (n < *cap) return arr;
+    *cap = *cap ? *cap * 2 : 16;
+    if ((arr = realloc(arr, *cap * size)) == NULL) {
+        rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at pull events");
+    }
+    return arr;
+}
+
+static void
+rdb_pull_ready(rdb_parser *p, rdb_event_type type)
+{
+    p->event->type = type;
+    p->event_ready = 1;
+}
+
+static int
+rdb_pull_db(void *ud, int db_num)
+{
+    rdb_parser *p = ud;
+
+    p->event->db_num = db_num;
+    rdb_pull_ready(p, RDB_EVENT_DB);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_pull_aux(void *ud, const rdb_slice *key, const rdb_slice *value)
+{
+    rdb_parser *p = ud;
+
+    p->arena.len = 0;
+    p->event->aux_key.ptr = rdb_arena_push(p, key->ptr, key->len);
+    p->event->aux_key.len = key->len;
+    p->event->aux_value.ptr = rdb_arena_push(p, value->ptr, value->len);
+    p->event->aux_value.len = value->len;
+    rdb_arena_fix(p, &p->event->aux_key);
+    rdb_arena_fix(p, &p->event->aux_value);
+    rdb_pull_ready(p, RDB_EVENT_AUX);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_pull_resizedb(void *ud, uint64_t db_size, uint64_t expires_size)
+{
+    rdb_parser *p = ud;
+
+    p->event->db_size = db_size;
+    p->event->expires_size = expires_size;
+    rdb_pull_ready(p, RDB_EVENT_RESIZEDB);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_pull_key_begin(void *ud, const rdb_key_info *key)
+{
+    rdb_parser *p = ud;
+
+    p->arena.len = 0;
+    p->nelems = 0;
+    p->ngroups = 0;
+    p->nconsumers = 0;
+    p->npending = 0;
+    p->event_key = *key;
+    p->event_key.key.ptr = rdb_arena_push(p, key->key.ptr, key->key.len);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_pull_element(void *ud, const rdb_key_info *key, const rdb_element *elem)
+{
+    rdb_parser *p = ud;
+    rdb_element *e;
+
+    p->elems = rdb_pull_grow(p, p->elems, p->nelems, &p->elems_cap, sizeof(rdb_element));
+    e = &p->elems[p->nelems++];
+    *e = *elem;
+    e->member.ptr = rdb_arena_push(p, elem->member.ptr, elem->member.len);
+    e->value.ptr = rdb_arena_push(p, elem->value.ptr, elem->value.len);
+    e->id.ptr = rdb_arena_push(p, elem->id.ptr, elem->id.len);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_pull_stream_group(void *ud, const rdb_key_info *key, const rdb_stream_group *group)
+{
+    rdb_parser *p = ud;
+    rdb_stream_group *g;
+
+    p->groups = rdb_pull_grow(p, p->groups, p->ngroups, &p->groups_cap, sizeof(rdb_stream_group));
+    g = &p->groups[p->ngroups++];
+    *g = *group;
+    g->name.ptr = rdb_arena_push(p, group->name.ptr, group->name.len);
+    g->last_id.ptr = rdb_arena_push(p, group->last_id.ptr, group->last_id.len);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_pull_stream_consumer(void *ud, const rdb_key_info *key, const rdb_stream_consumer *consumer)
+{
+    rdb_parser *p = ud;
+    rdb_stream_consumer *c;
+
+    p->consumers = rdb_pull_grow(p, p->consumers, p->nconsumers, &p->consumers_cap, sizeof(rdb_stream_consumer));
+    c = &p->consumers[p->nconsumers++];
+    *c = *consumer;
+    c->name.ptr = rdb_arena_push(p, consumer->name.ptr, consumer->name.len);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_pull_stream_pending(void *ud, const rdb_key_info *key, const rdb_stream_pending *pending)
+{
+    rdb_parser *p = ud;
+    rdb_stream_pending *e;
+
+    p->pending = rdb_pull_grow(p, p->pending, p->npending, &p->pending_cap, sizeof(rdb_stream_pending));
+    e = &p->pending[p->npending++];
+    *e = *pending;
+    e->id.ptr = rdb_arena_push(p, pending->id.ptr, pending->id.len);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_pull_key_end(void *ud, const rdb_key_info *key)
+{
+    rdb_parser *p = ud;
+    size_t i;
+
+    rdb_arena_fix(p, &p->event_key.key);
+    for (i = 0; i < p->nelems; i++) {
+        rdb_arena_fix(p, &p->elems[i].member);
+        rdb_arena_fix(p, &p->elems[i].value);
+        rdb_arena_fix(p, &p->elems[i].id);
+    }
+    for (i = 0; i < p->ngroups; i++) {
+        rdb_arena_fix(p, &p->groups[i].name);
+        rdb_arena_fix(p, &p->groups[i].last_id);
+    }
+    for (i = 0; i < p->nconsumers; i++) rdb_arena_fix(p, &p->consumers[i].name);
+    for (i = 0; i < p->npending; i++) rdb_arena_fix(p, &p->pending[i].id);
+    p->event->key = &p->event_key;
+    p->event->elements = p->elems;
+    p->event->nelements = p->nelems;
+    p->event->groups = p->groups;
+    p->event->ngroups = p->ngroups;
+    p->event->consumers = p->consumers;
+    p->event->nconsumers = p->nconsumers;
+    p->event->pending = p->pending;
+    p->event->npending = p->npending;
+    rdb_pull_ready(p, RDB_EVENT_KEY);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_pull_eof(void *ud)
+{
+    rdb_pull_ready(ud, RDB_EVENT_EOF);
+    return RDB_PLUGIN_OK;
+}
+
+// ================================== STATS. ==================================== //
+
+uint64_t
+rdb_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Time the key, the gap to the next sampled one is random, so keys which
+ * come at a fixed cadence (like flushes of a batch) are not always timed.
+ */
+static uint64_t
+rdb_sample_begin(rdb_parser *p)
+{
+    // xorshift64
+    p->sample_seed ^= p->sample_seed << 13;
+    p->sample_seed ^= p->sample_seed >> 7;
+    p->sample_seed ^= p->sample_seed << 17;
+    p->sample_next += 1 + p->sample_seed % (2 * RDB_SAMPLE_GAP - 1);
+    p->sampled = 1;
+    return rdb_clock_ns();
+}
+
+static void
+rdb_sample_end(rdb_parser *p, uint64_t start)
+{
+    p->sample_ns[RDB_PHASE_KEY] += rdb_clock_ns() - start;
+    p->sampled_keys++;
+    p->sampled = 0;
+}
+
+/* RDB_PROGRESS_STEP bytes were parsed since the last check */
+static void
+rdb_progress_check(rdb_parser *p)
+{
+    rdb_stats stats;
+    uint64_t now;
+
+    if (p->trial) return;
+    p->progress_next = p->loaded_bytes + RDB_PROGRESS_STEP;
+    now = rdb_clock_ns();
+    if (now - p->progress_last < p->progress_interval_ns) return;
+    p->progress_last = now;
+    rdb_parser_stats(p, &stats);
+    p->progress(p->progress_ud, &stats);
+}
+
+// ================================== RDB LOAD. ==================================== //
+
+static void
+rdb_parse_key(rdb_parser *p, int type)
+{
+    rdb_key_info info;
+    uint64_t start = 0;
+
+    // before the key, which a stray byte would read as a length
+    if (!rdb_value_type_name(type) && type != REDIS_RDB_MODULE && type != REDIS_RDB_MODULE_2) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "unknown value type %d", type);
+    }
+    p->bad_value = 0;
+    p->key_buf.len = 0;
+    rdb_read_string_buf(p, &p->key_buf);
+    info.key.ptr = p->key_buf.ptr;
+    info.key.len = p->key_buf.len;
+    info.type = type;
+    info.type_name = rdb_value_type_name(type);
+    info.db_num = p->db_num;
+    info.expire_time = p->expire_time;
+    info.size_hint = 0;
+    info.lru_idle = p->lru_idle;
+    info.lfu_freq = p->lfu_freq;
+    info.digest = NULL;
+    info.raw_len = info.compressed_len = 0;
+
+    if (rdb_unlikely(++p->keys == p->sample_next)) start = rdb_sample_begin(p);
+    if (p->loader) {
+        p->loader(p->loader_ud, p, &info);
+    } else {
+        rdb_emit_value(p, &info);
+    }
+    if (rdb_unlikely(p->sampled)) rdb_sample_end(p, start);
+}
+
+static void
+rdb_parse_end(rdb_parser *p)
+{
+    struct stat st;
+
+    if (p->handlers.on_eof && p->handlers.on_eof(p->handlers.ud) < 0) {
+        rdb_fail(p, RDB_ERR_PLUGIN, "plugin on_eof failed");
+    }
+    if (p->version >= MAGIC_VERSION) rdb_check_crc(p);
+    // fed input has no file to check the size.
+    if (p->reader.fd < 0) {
+        p->done = 1;
+        return;
+    }
+
+    if(fstat(p->reader.fd, &st) != 0) {
+        rdb_fail(p, RDB_ERR_IO, "fstat rdb file failed, %s", strerror(errno));
+    }
+    // size of pipes, fifos and compressed files is unknown, the checksum still covers them.
+    if(S_ISREG(st.st_mode) && !p->codec && st.st_size != p->loaded_bytes) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "EOF record before the end, file size is %llu version %d",
+                (unsigned long long)st.st_size, p->version);
+    }
+    p->done = 1;
+}
+
+/* parse the next opcode, and the key after it if any */
+static void
+rdb_parse_step(rdb_parser *p)
+{
+    char buf[1];
+    uint8_t type;
+    uint64_t db_size, expires_size;
+    rdb_slice key, val;
+
+    if (rdb_unlikely(p->loaded_bytes >= p->progress_next)) rdb_progress_check(p);
+    p->record_offset = p->loaded_bytes;
+    type = rdb_read_kv_type(p);
+    switch (type) {
+        // load expire time if exists
+        case REDIS_EXPIRE_SEC:
+        case REDIS_EXPIRE_MS:
+            p->expire_time = rdb_load_expiretime(p, type);
+            return;
+        // lru idle and lfu frequency of the next key
+        case REDIS_IDLE:
+            p->lru_idle = rdb_read_store_len(p, NULL);
+            return;
+        case REDIS_FREQ:
+            rdb_read_bytes(p, buf, 1);
+            p->lfu_freq = (uint8_t)buf[0];
+            return;
+        case REDIS_SELECT_DB:
+            p->db_num = rdb_read_store_len(p, NULL);
+            if (p->handlers.on_db && p->handlers.on_db(p->handlers.ud, p->db_num) < 0) {
+                rdb_fail(p, RDB_ERR_PLUGIN, "plugin on_db failed at db %d", p->db_num);
+            }
+            return;
+        // aux fields, like redis-ver, used-mem
+        case REDIS_AUX:
+            rdb_read_string_buf(p, &p->member_buf);
+            rdb_read_string_buf(p, &p->value_buf);
+            key.ptr = p->member_buf.ptr;
+            key.len = p->member_buf.len;
+            val.ptr = p->value_buf.ptr;
+            val.len = p->value_buf.len;
+            if (p->handlers.on_aux && p->handlers.on_aux(p->handlers.ud, &key, &val) < 0) {
+                rdb_fail(p, RDB_ERR_PLUGIN, "plugin on_aux failed");
+            }
+            return;
+        // db size and expires size, handlers can use it to pre-size tables.
+        case REDIS_RESIZEDB:
+            db_size = rdb_read_store_len(p, NULL);
+            expires_size = rdb_read_store_len(p, NULL);
+            if (p->handlers.on_resizedb && p->handlers.on_resizedb(p->handlers.ud, db_size, expires_size) < 0) {
+                rdb_fail(p, RDB_ERR_PLUGIN, "plugin on_resizedb failed");
+            }
+            return;
+        case REDIS_MODULE_AUX:
+            rdb_skip_module_aux(p);
+            return;
+        // function library code
+        case REDIS_FUNCTION2:
+            rdb_read_string_buf(p, &p->blob_buf);
+            return;
+        case REDIS_FUNCTION_PRE_GA:
+            rdb_fail(p, RDB_ERR_UNSUPPORTED, "pre-GA function format is not supported");
+            return;
+        // end of rdb file
+        case REDIS_EOF:
+            rdb_parse_end(p);
+            return;
+    }
+
+    rdb_parse_key(p, type);
+    p->expire_time = -1;
+    p->lru_idle = p->lfu_freq = -1;
+}
+
+// ================================== SALVAGE. ==================================== //
+
+/* opcodes and value types which a record can begin with */
+static int
+rdb_salvage_type(int type)
+{
+    switch (type) {
+        case REDIS_EXPIRE_SEC:
+        case REDIS_EXPIRE_MS:
+        case REDIS_IDLE:
+        case REDIS_FREQ:
+        case REDIS_SELECT_DB:
+        case REDIS_AUX:
+        case REDIS_RESIZEDB:
+        case REDIS_MODULE_AUX:
+        case REDIS_FUNCTION2:
+            return 1;
+    }
+    return rdb_value_type_name(type) != NULL;
+}
+
+/*
+ * Parse the records from reader pos without handlers, it's a resync point
+ * if the next key records parse with good values, or the window (with more
+ * input after it) or the rdb ends after one of them. The parser is put back
+ * as it was.
+ */
+static int
+rdb_salvage_try(rdb_parser *p, int more)
+{
+    rdb_reader *r = &p->reader;
+    rdb_plugin handlers = p->handlers;
+    rdb_value_loader loader = p->loader;
+    jmp_buf jb, *fail_jmp = p->fail_jmp;
+    uint64_t loaded_bytes = p->loaded_bytes, bad_values = p->bad_values, nkeys = p->keys;
+    size_t pos = r->pos;
+    int digest = p->digest, db_num = p->db_num, type;
+    volatile int keys = 0, steps = 0, end = 0;
+
+    memset(&p->handlers, 0, sizeof(p->handlers));
+    p->loader = NULL;
+    p->digest = 0;
+    p->trial = 1;
+    p->trial_window = 0;
+    p->fail_jmp = &jb;
+    if (setjmp(jb) == 0) {
+        while (keys < RDB_SALVAGE_CHAIN && steps++ < RDB_SALVAGE_CHAIN * 4) {
+            if (r->pos == r->end) {
+                p->trial_window = 1;
+                break;
+            }
+            type = (uint8_t)r->buf[r->pos];
+            if (REDIS_EOF == type) {
+                end = !more && r->pos + 1 + (p->version >= MAGIC_VERSION ? 8 : 0) == r->end;
+                break;
+            }
+            if (!rdb_salvage_type(type)) break;
+            rdb_parse_step(p);
+            if (!rdb_value_type_name(type)) continue;
+            // zeros parse as strings of empty keys, which are rare in real dumps
+            if (p->bad_value || p->key_buf.len == 0) break;
+            keys++;
+        }
+    }
+
+    p->handlers = handlers;
+    p->loader = loader;
+    p->digest = digest;
+    p->db_num = db_num;
+    p->expire_time = -1;
+    p->lru_idle = p->lfu_freq = -1;
+    p->trial = 0;
+    p->fail_jmp = fail_jmp;
+    p->bad_value = 0;
+    p->bad_values = bad_values;
+    p->loaded_bytes = loaded_bytes;
+    p->keys = nkeys;
+    p->sampled = 0;
+    r->pos = pos;
+    return keys == RDB_SALVAGE_CHAIN || (keys > 0 && (end || (more && p->trial_window)));
+}
+
+/* read until the window is full, return 0 if the input ends */
+static int
+rdb_salvage_fill(rdb_parser *p)
+{
+    rdb_reader *r = &p->reader;
+    ssize_t n;
+
+    rdb_reader_compact(p);
+    while (r->end < r->cap) {
+        if ((n = r->fill(r->ud, r->buf + r->end, r->cap - r->end)) < 0) rdb_fail_read(p);
+        if (n == 0) return 0;
+        r->end += n;
+    }
+    return 1;
+}
+
+static void
+rdb_salvage_skipped(rdb_parser *p, uint64_t from, uint64_t to, const char *reason)
+{
+    p->skipped_bytes += to - from;
+    p->skipped_ranges++;
+    logger(WARN, "Skipped bytes %llu to %llu, %s.", (unsigned long long)from, (unsigned long long)to, reason);
+}
+
+/*
+ * The record at record_offset is corrupt, scan from its second byte for the
+ * next record which parses, and skip the bytes before it. A regular file is
+ * rewound to the record, other input is scanned from where it failed.
+ */
+static void
+rdb_salvage(rdb_parser *p)
+{
+    rdb_reader *r = &p->reader;
+    uint64_t base, from = p->record_offset;
+    char *buf;
+    size_t i, last;
+    int more, crc_len = p->version >= MAGIC_VERSION ? 8 : 0;
+    char reason[sizeof(p->fail_msg)];
+
+    // the trials overwrite them
+    memcpy(reason, p->fail_msg, sizeof(reason));
+    p->error = RDB_OK;
+    p->sampled = 0;
+    if (p->loader_reset) p->loader_reset(p->loader_ud);
+    if (p->input_size && lseek(r->fd, from + 1, SEEK_SET) >= 0) {
+        r->pos = r->end = r->crc_pos = 0;
+        p->loaded_bytes = from + 1;
+    }
+    if (r->cap < RDB_SALVAGE_WINDOW) {
+        rdb_reader_compact(p);
+        if ((buf = realloc(r->buf, RDB_SALVAGE_WINDOW)) == NULL) {
+            rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at salvage");
+        }
+        r->buf = buf;
+        r->cap = RDB_SALVAGE_WINDOW;
+    }
+
+    for (;;) {
+        more = rdb_salvage_fill(p);
+        base = p->loaded_bytes;
+        // a candidate has half of the window ahead, unless the input ends
+        last = more ? r->end - r->cap / 2 : r->end;
+        for (i = 0; i < last; i++) {
+            r->pos = i;
+            p->loaded_bytes = base + i;
+            if ((REDIS_EOF == (uint8_t)r->buf[i] && !more && i + 1 + crc_len == r->end)
+                    || (rdb_salvage_type((uint8_t)r->buf[i]) && rdb_salvage_try(p, more))) {
+                rdb_salvage_skipped(p, from, p->loaded_bytes, reason);
+                return;
+            }
+        }
+        r->pos = last;
+        p->loaded_bytes = base + last;
+        if (!more) break;
+    }
+
+    rdb_salvage_skipped(p, from, p->loaded_bytes, reason);
+    logger(WARN, "rdb input ends before the EOF record.");
+    if (p->handlers.on_eof && p->handlers.on_eof(p->handlers.ud) < 0) {
+        rdb_fail(p, RDB_ERR_PLUGIN, "plugin on_eof failed");
+    }
+    p->done = 1;
+}
+
+// ================================== PARSER API. ==================================== //
+
+/* return NULL if malloc failed */
+rdb_parser *
+rdb_parser_create(const rdb_plugin *handlers)
+{
+    rdb_parser *p;
+
+    if ((p = calloc(1, sizeof(rdb_parser))) == NULL) return NULL;
+    if (handlers) p->handlers = *handlers;
+    // NOTE: trick here, version set 5 as we want to calc crc where read version field.
+    p->version = MAGIC_VERSION;
+    p->expire_time = p->lru_idle = p->lfu_freq = -1;
+    p->reader.fd = -1;
+    p->start_ns = rdb_clock_ns();
+    p->sample_next = 1;
+    p->sample_seed = p->start_ns | 1;
+    p->progress_next = UINT64_MAX;
+    return p;
+}
+
+void
+rdb_parser_free(rdb_parser *p)
+{
+    if (!p) return;
+    codec_stop(p->codec);
+    if (p->reader.fd >= 0) close(p->reader.fd);
+    free(p->reader.buf);
+    free(p->key_buf.ptr);
+    free(p->member_buf.ptr);
+    free(p->value_buf.ptr);
+    free(p->blob_buf.ptr);
+    free(p->arena.ptr);
+    free(p->elems);
+    free(p->groups);
+    free(p->consumers);
+    free(p->pending);
+    stream_walker_free(&p->walker);
+    free(p);
+}
+
+void
+rdb_parser_set_loader(rdb_parser *p, rdb_value_loader loader, rdb_value_reset reset, void *ud)
+{
+    p->loader = loader;
+    p->loader_reset = reset;
+    p->loader_ud = ud;
+}
+
+/*
+ * Compressed input is detected by magic bytes, and decompressed by a codec
+ * thread which fills the reader, or the bytes are kept in the buffer.
+ */
+static void
+rdb_open_codec(rdb_parser *p)
+{
+    rdb_reader *r = &p->reader;
+    ssize_t n;
+    int type;
+
+    while (r->end < CODEC_MAGIC_SIZE) {
+        if ((n = rdb_fd_fill(r, r->buf + r->end, CODEC_MAGIC_SIZE - r->end)) < 0) rdb_fail_read(p);
+        if (n == 0) break;
+        r->end += n;
+    }
+    if ((type = codec_detect((unsigned char *)r->buf, r->end)) == CODEC_NONE) return;
+
+    if (!codec_supported(type)) {
+        rdb_fail(p, RDB_ERR_UNSUPPORTED, "rdbtools is built without %s, rebuild with make %s=1",
+                codec_name(type), CODEC_ZSTD == type ? "ZSTD" : "LZ4");
+    }
+    if ((p->codec = codec_start(type, r->fd, r->buf, r->end)) == NULL) {
+        rdb_fail(p, RDB_ERR_NOMEM, "start %s codec failed", codec_name(type));
+    }
+    r->fill = codec_read;
+    r->ud = p->codec;
+    r->end = 0;
+}
+
+/* check magic string(5bytes) and version(4bytes) in buf */
+static int
+rdb_parse_header(rdb_parser *p, char *buf)
+{
+    buf[9] = '\0';
+    if(memcmp(buf, MAGIC_STR, 5) != 0) {
+        snprintf(p->fail_msg, sizeof(p->fail_msg), "no magic string, not a rdb file");
+        return p->error = RDB_ERR_FORMAT;
+    }
+    p->version = atoi(buf + 5);
+    if (p->version > MAX_VERSION) {
+        logger(WARN, "rdb version %d is newer than %d, unknown types would fail.", p->version, MAX_VERSION);
+    }
+    p->header_done = 1;
+    if (p->handlers.on_header && p->handlers.on_header(p->handlers.ud, p->version) < 0) {
+        rdb_fail(p, RDB_ERR_PLUGIN, "plugin on_header failed");
+    }
+    return 0;
+}
+
+/*
+ * rdb_fail jumped back to the API call, the parser can't go on. Handlers
+ * may have been stopped in the middle of a key.
+ */
+static int
+rdb_caught(rdb_parser *p)
+{
+    p->fail_jmp = NULL;
+    if (p->loader_reset) p->loader_reset(p->loader_ud);
+    return p->error;
+}
+
+/* a corrupt record can be skipped, but not a failed handler, read or malloc */
+static int
+rdb_salvageable(rdb_parser *p)
+{
+    return p->salvage && (RDB_ERR_CORRUPT == p->error || RDB_ERR_UNSUPPORTED == p->error);
+}
+
+/*
+ * Open the rdb file and read magic string(5bytes) and version(4bytes),
+ * path "-" is stdin. Return RDB_ERR_IO if the file can't be read, or
+ * RDB_ERR_FORMAT if it's not a rdb file.
+ */
+int
+rdb_parser_open(rdb_parser *p, const char *path)
+{
+    char buf[10];
+    struct stat st;
+    jmp_buf jb;
+    int ret;
+
+    if (strcmp(path, "-") == 0) {
+        p->reader.fd = dup(STDIN_FILENO);
+    } else {
+        p->reader.fd = open(path, O_RDONLY);
+    }
+    if (p->reader.fd < 0) {
+        snprintf(p->fail_msg, sizeof(p->fail_msg), "open %s failed, %s", path, strerror(errno));
+        return p->error = RDB_ERR_IO;
+    }
+    p->fail_jmp = &jb;
+    if (setjmp(jb) != 0) return rdb_caught(p);
+    p->reader.cap = RDB_READ_BUF_SIZE;
+    if ((p->reader.buf = malloc(p->reader.cap)) == NULL) {
+        rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at open parser");
+    }
+    p->reader.fill = rdb_fd_fill;
+    p->reader.ud = &p->reader;
+    rdb_open_codec(p);
+    // lengths are checked against the size, and salvage can seek back
+    if (fstat(p->reader.fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        p->file_size = st.st_size;
+        if (!p->codec) p->input_size = st.st_size;
+    }
+
+    if(rdb_crc_read(p, buf, 9) != 9) {
+        rdb_fail(p, RDB_ERR_FORMAT, "read error on load version");
+    }
+    ret = rdb_parse_header(p, buf);
+    p->fail_jmp = NULL;
+    return ret;
+}
+
+int
+rdb_parser_version(const rdb_parser *p)
+{
+    return p->version;
+}
+
+const char *
+rdb_parser_error(const rdb_parser *p, uint64_t *offset)
+{
+    if (!p->error) return NULL;
+    if (offset) *offset = p->fail_offset;
+    return p->fail_msg;
+}
+
+void
+rdb_parser_set_digest(rdb_parser *p, int enable)
+{
+    p->digest = enable;
+}
+
+void
+rdb_parser_set_validate(rdb_parser *p, int enable)
+{
+    p->validate = enable;
+}
+
+uint64_t
+rdb_parser_bad_values(const rdb_parser *p)
+{
+    return p->bad_values;
+}
+
+void
+rdb_parser_set_salvage(rdb_parser *p, int enable)
+{
+    p->salvage = enable;
+    if (enable) p->validate = 1;
+}
+
+uint64_t
+rdb_parser_skipped_bytes(const rdb_parser *p, uint64_t *ranges)
+{
+    if (ranges) *ranges = p->skipped_ranges;
+    return p->skipped_bytes;
+}
+
+void
+rdb_parser_stats(const rdb_parser *p, rdb_stats *stats)
+{
+    double scale = p->sampled_keys ? (double)p->keys / p->sampled_keys / 1000 : 0;
+    uint64_t key_us;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->loaded_bytes = p->loaded_bytes;
+    stats->input_bytes = p->codec ? codec_input_bytes(p->codec, p->loaded_bytes) : p->loaded_bytes;
+    stats->input_size = p->file_size;
+    stats->keys = p->keys;
+    stats->elapsed_us = (rdb_clock_ns() - p->start_ns) / 1000;
+    key_us = p->sample_ns[RDB_PHASE_KEY] * scale;
+    stats->lzf_us = p->sample_ns[RDB_PHASE_LZF] * scale;
+    stats->handler_us = p->sample_ns[RDB_PHASE_HANDLER] * scale;
+    if (key_us > stats->lzf_us + stats->handler_us) {
+        stats->decode_us = key_us - stats->lzf_us - stats->handler_us;
+    }
+    if (p->codec) stats->decompress_us = codec_cpu_ns(p->codec) / 1000;
+}
+
+void
+rdb_parser_set_progress(rdb_parser *p, rdb_progress_fn fn, void *ud, int interval_ms)
+{
+    p->progress = fn;
+    p->progress_ud = ud;
+    p->progress_interval_ns = (uint64_t)interval_ms * 1000000;
+    p->progress_last = rdb_clock_ns();
+    p->progress_next = fn ? p->loaded_bytes + RDB_PROGRESS_STEP : UINT64_MAX;
+}
+
+/* parse the whole file, and pass events to the handlers */
+int
+rdb_parser_run(rdb_parser *p)
+{
+    jmp_buf jb;
+
+    if (p->error) return p->error;
+    p->fail_jmp = &jb;
+    // rdb_fail jumps back here, a corrupt record is skipped in salvage mode
+    if (setjmp(jb) != 0) {
+        if (!rdb_salvageable(p)) return rdb_caught(p);
+        rdb_salvage(p);
+    }
+    while (!p->done) {
+        rdb_parse_step(p);
+    }
+    p->fail_jmp = NULL;
+    return RDB_OK;
+}
+
+/*
+ * Return 1 with the next event in ev, 0 after the EOF event, or an error.
+ * Handlers of the parser are replaced by the ones collecting events.
+ */
+int
+rdb_parser_next(rdb_parser *p, rdb_event *ev)
+{
+    jmp_buf jb;
+
+    if (p->error) return p->error;
+    if (p->done) return 0;
+
+    if (p->handlers.ud != p) {
+        memset(&p->handlers, 0, sizeof(p->handlers));
+        p->handlers.abi_version = RDB_PLUGIN_ABI_VERSION;
+        p->handlers.ud = p;
+        p->handlers.on_db = rdb_pull_db;
+        p->handlers.on_aux = rdb_pull_aux;
+        p->handlers.on_resizedb = rdb_pull_resizedb;
+        p->handlers.on_key_begin = rdb_pull_key_begin;
+        p->handlers.on_element = rdb_pull_element;
+        p->handlers.on_key_end = rdb_pull_key_end;
+        p->handlers.on_eof = rdb_pull_eof;
+        p->handlers.on_stream_group = rdb_pull_stream_group;
+        p->handlers.on_stream_consumer = rdb_pull_stream_consumer;
+        p->handlers.on_stream_pending = rdb_pull_stream_pending;
+    }
+
+    memset(ev, 0, sizeof(*ev));
+    p->event = ev;
+    p->event_ready = 0;
+    p->fail_jmp = &jb;
+    if (setjmp(jb) != 0) {
+        if (!rdb_salvageable(p)) {
+            p->event = NULL;
+            return rdb_caught(p);
+        }
+        rdb_salvage(p);
+    }
+    while (!p->event_ready && !p->done) {
+        rdb_parse_step(p);
+    }
+    p->fail_jmp = NULL;
+    p->event = NULL;
+    return p->event_ready;
+}
+
+// ================================== FEED. ==================================== //
+
+enum {
+    SCAN_TYPE = 0,
+    SCAN_RUN,
+    SCAN_VALUE,
+    SCAN_COUNTED,
+    SCAN_MODULE,
+    SCAN_MODULE_OP,
+    SCAN_STREAM_NODES,
+    SCAN_STREAM_META,
+    SCAN_GROUPS,
+    SCAN_GROUP,
+    SCAN_GROUP_PEL,
+    SCAN_CONSUMERS_LEN,
+    SCAN_CONSUMERS,
+    SCAN_CONSUMER,
+    SCAN_CONSUMER_PEL,
+    SCAN_DONE
+};
+
+/* scan a length at *off, return 0 if it's not complete in avail bytes */
+static int
+rdb_scan_len(const uint8_t *s, size_t avail, size_t *off, uint64_t *val, int *is_encoded)
+{
+    size_t o = *off;
+    uint8_t type;
+    int i;
+
+    if (o >= avail) return 0;
+    *is_encoded = 0;
+    type = (s[o] & 0xc0) >> 6;
+    if (REDIS_RDB_6B == type) {
+        *val = s[o] & 0x3f;
+        *off = o + 1;
+    } else if (REDIS_RDB_14B == type) {
+        if (avail - o < 2) return 0;
+        *val = ((s[o] & 0x3f) << 8) | s[o + 1];
+        *off = o + 2;
+    } else if (REDIS_RDB_64BITLEN == s[o]) {
+        if (avail - o < 9) return 0;
+        for (*val = 0, i = 1; i <= 8; i++) *val = (*val << 8) | s[o + i];
+        *off = o + 9;
+    } else if (REDIS_RDB_32B == type) {
+        if (avail - o < 5) return 0;
+        *val = ((uint64_t)s[o + 1] << 24) | (s[o + 2] << 16) | (s[o + 3] << 8) | s[o + 4];
+        *off = o + 5;
+    } else {
+        *is_encoded = 1;
+        *val = s[o] & 0x3f;
+        *off = o + 1;
+    }
+    return 1;
+}
+
+static int
+rdb_scan_bytes(size_t avail, size_t *off, uint64_t n)
+{
+    if (n > avail - *off) return 0;
+    *off += n;
+    return 1;
+}
+
+static int
+rdb_scan_string(const uint8_t *s, size_t avail, size_t *off)
+{
+    uint64_t len, clen;
+    int is_encoded;
+
+    if (!rdb_scan_len(s, avail, off, &len, &is_encoded)) return 0;
+    if (!is_encoded) return rdb_scan_bytes(avail, off, len);
+    switch (len) {
+        case REDIS_RDB_ENC_INT8: return rdb_scan_bytes(avail, off, 1);
+        case REDIS_RDB_ENC_INT16: return rdb_scan_bytes(avail, off, 2);
+        case REDIS_RDB_ENC_INT32: return rdb_scan_bytes(avail, off, 4);
+        case REDIS_RDB_ENC_LZF:
+            if (!rdb_scan_len(s, avail, off, &clen, &is_encoded)) return 0;
+            if (!rdb_scan_len(s, avail, off, &len, &is_encoded)) return 0;
+            return rdb_scan_bytes(avail, off, clen);
+    }
+    // bad encoding, let the decoder report it
+    return 1;
+}
+
+/*
+ * Scan the items of the run, item codes are: s string, l length, d double
+ * string(1 byte length), b 1 byte, 4 and 8 bytes, i raw stream id.
+ */
+static int
+rdb_scan_run(rdb_scan *sc, const uint8_t *s, size_t avail)
+{
+    size_t off;
+    uint8_t dlen;
+    int ok, is_encoded;
+
+    while (sc->left > 0) {
+        off = sc->off;
+        switch (sc->pat[sc->pat_i]) {
+            case 's': ok = rdb_scan_string(s, avail, &off); break;
+            case 'l': ok = rdb_scan_len(s, avail, &off, &sc->last_len, &is_encoded); break;
+            case 'b': ok = rdb_scan_bytes(avail, &off, 1); break;
+            case '4': ok = rdb_scan_bytes(avail, &off, 4); break;
+            case '8': ok = rdb_scan_bytes(avail, &off, 8); break;
+            case 'i': ok = rdb_scan_bytes(avail, &off, STREAM_ID_SIZE); break;
+            case 'd':
+                if ((ok = rdb_scan_bytes(avail, &off, 1)) != 0) {
+                    dlen = s[off - 1];
+                    ok = dlen >= 253 || rdb_scan_bytes(avail, &off, dlen);
+                }
+                break;
+            default: ok = 1;
+        }
+        if (!ok) return 0;
+        sc->off = off;
+        if (sc->pat[++sc->pat_i] == '\0') {
+            sc->pat_i = 0;
+            sc->left--;
+        }
+    }
+    return 1;
+}
+
+static void
+rdb_scan_then(rdb_scan *sc, const char *pat, uint64_t times, int next)
+{
+    sc->pat = pat;
+    sc->pat_i = 0;
+    sc->left = pat[0] ? times : 0;
+    sc->stage = SCAN_RUN;
+    sc->next = next;
+}
+
+static void
+rdb_scan_opcode(rdb_parser *p, rdb_scan *sc)
+{
+    switch (sc->type) {
+        case REDIS_EXPIRE_SEC: rdb_scan_then(sc, "4", 1, SCAN_DONE); break;
+        case REDIS_EXPIRE_MS: rdb_scan_then(sc, "8", 1, SCAN_DONE); break;
+        case REDIS_IDLE: rdb_scan_then(sc, "l", 1, SCAN_DONE); break;
+        case REDIS_FREQ: rdb_scan_then(sc, "b", 1, SCAN_DONE); break;
+        case REDIS_SELECT_DB: rdb_scan_then(sc, "l", 1, SCAN_DONE); break;
+        case REDIS_AUX: rdb_scan_then(sc, "ss", 1, SCAN_DONE); break;
+        case REDIS_RESIZEDB: rdb_scan_then(sc, "ll", 1, SCAN_DONE); break;
+        case REDIS_MODULE_AUX: rdb_scan_then(sc, "lll", 1, SCAN_MODULE); break;
+        case REDIS_FUNCTION2: rdb_scan_then(sc, "s", 1, SCAN_DONE); break;
+        case REDIS_FUNCTION_PRE_GA: sc->stage = SCAN_DONE; break;
+        case REDIS_EOF: rdb_scan_then(sc, p->version >= MAGIC_VERSION ? "8" : "", 1, SCAN_DONE); break;
+        // key and then the value
+        default: rdb_scan_then(sc, "s", 1, SCAN_VALUE);
+    }
+}
+
+static void
+rdb_scan_value(rdb_scan *sc)
+{
+    switch (sc->type) {
+        // length and then the elements
+        case REDIS_RDB_LIST:
+        case REDIS_RDB_SET:
+        case REDIS_RDB_LIST_QUICKLIST: sc->counted = "s"; break;
+        case REDIS_RDB_HASH: sc->counted = "ss"; break;
+        case REDIS_RDB_ZSET: sc->counted = "sd"; break;
+        case REDIS_RDB_ZSET_2: sc->counted = "s8"; break;
+        case REDIS_RDB_LIST_QUICKLIST_2: sc->counted = "ls"; break;
+        case REDIS_RDB_MODULE_2: rdb_scan_then(sc, "l", 1, SCAN_MODULE); return;
+        case REDIS_RDB_STREAM_LISTPACKS:
+        case REDIS_RDB_STREAM_LISTPACKS_2:
+        case REDIS_RDB_STREAM_LISTPACKS_3: rdb_scan_then(sc, "l", 1, SCAN_STREAM_NODES); return;
+        case REDIS_RDB_STRING:
+        case REDIS_RDB_ZIPMAP:
+        case REDIS_RDB_LIST_ZIPLIST:
+        case REDIS_RDB_INTSET:
+        case REDIS_RDB_ZSET_ZIPLIST:
+        case REDIS_RDB_HASH_ZIPLIST:
+        case REDIS_RDB_HASH_LISTPACK:
+        case REDIS_RDB_ZSET_LISTPACK:
+        case REDIS_RDB_SET_LISTPACK: rdb_scan_then(sc, "s", 1, SCAN_DONE); return;
+        // unknown types, let the decoder report it
+        default: sc->stage = SCAN_DONE; return;
+    }
+    rdb_scan_then(sc, "l", 1, SCAN_COUNTED);
+}
+
+/*
+ * Resume the scan of the next record, return 1 if the record is complete
+ * in the buffer, or 0 if more input is needed.
+ */
+static int
+rdb_scan_record(rdb_parser *p)
+{
+    rdb_scan *sc = &p->scan;
+    rdb_reader *r = &p->reader;
+    const uint8_t *s = (const uint8_t *)r->buf + r->pos;
+    size_t avail = r->end - r->pos;
+    int v2, v3;
+
+    for (;;) {
+        v2 = sc->type >= REDIS_RDB_STREAM_LISTPACKS_2;
+        v3 = sc->type >= REDIS_RDB_STREAM_LISTPACKS_3;
+        switch (sc->stage) {
+            case SCAN_TYPE:
+                if (avail == 0) return 0;
+                sc->type = s[0];
+                sc->off = 1;
+                rdb_scan_opcode(p, sc);
+                break;
+            case SCAN_RUN:
+                if (!rdb_scan_run(sc, s, avail)) return 0;
+                sc->stage = sc->next;
+                break;
+            case SCAN_VALUE:
+                rdb_scan_value(sc);
+                break;
+            case SCAN_COUNTED:
+                rdb_scan_then(sc, sc->counted, sc->last_len, SCAN_DONE);
+                break;
+            case SCAN_MODULE:
+                rdb_scan_then(sc, "l", 1, SCAN_MODULE_OP);
+                break;
+            case SCAN_MODULE_OP:
+                switch (sc->last_len) {
+                    case REDIS_MODULE_OPCODE_EOF: sc->stage = SCAN_DONE; break;
+                    case REDIS_MODULE_OPCODE_SINT:
+                    case REDIS_MODULE_OPCODE_UINT: rdb_scan_then(sc, "l", 1, SCAN_MODULE); break;
+                    case REDIS_MODULE_OPCODE_FLOAT: rdb_scan_then(sc, "4", 1, SCAN_MODULE); break;
+                    case REDIS_MODULE_OPCODE_DOUBLE: rdb_scan_then(sc, "8", 1, SCAN_MODULE); break;
+                    case REDIS_MODULE_OPCODE_STRING: rdb_scan_then(sc, "s", 1, SCAN_MODULE); break;
+                    default: sc->stage = SCAN_DONE;
+                }
+                break;
+            // nodes, length, last id, [first id, max deleted id, entries added] and groups
+            case SCAN_STREAM_NODES:
+                rdb_scan_then(sc, "ss", sc->last_len, SCAN_STREAM_META);
+                break;
+            case SCAN_STREAM_META:
+                rdb_scan_then(sc, v2 ? "lllllllll" : "llll", 1, SCAN_GROUPS);
+                break;
+            case SCAN_GROUPS:
+                sc->groups = sc->last_len;
+                sc->stage = SCAN_GROUP;
+                break;
+            case SCAN_GROUP:
+                if (sc->groups == 0) {
+                    sc->stage = SCAN_DONE;
+                    break;
+                }
+                sc->groups--;
+                rdb_scan_then(sc, v2 ? "sllll" : "slll", 1, SCAN_GROUP_PEL);
+                break;
+            case SCAN_GROUP_PEL:
+                rdb_scan_then(sc, "i8l", sc->last_len, SCAN_CONSUMERS_LEN);
+                break;
+            case SCAN_CONSUMERS_LEN:
+                rdb_scan_then(sc, "l", 1, SCAN_CONSUMERS);
+                break;
+            case SCAN_CONSUMERS:
+                sc->consumers = sc->last_len;
+                sc->stage = SCAN_CONSUMER;
+                break;
+            case SCAN_CONSUMER:
+                if (sc->consumers == 0) {
+                    sc->stage = SCAN_GROUP;
+                    break;
+                }
+                sc->consumers--;
+                rdb_scan_then(sc, v3 ? "s88l" : "s8l", 1, SCAN_CONSUMER_PEL);
+                break;
+            case SCAN_CONSUMER_PEL:
+                rdb_scan_then(sc, "i", sc->last_len, SCAN_CONSUMER);
+                break;
+            case SCAN_DONE:
+                return 1;
+        }
+    }
+}
+
+static ssize_t
+rdb_feed_fill(void *ud, char *buf, size_t n)
+{
+    // records are decoded once complete in the buffer, nothing to read here.
+    return 0;
+}
+
+/* decode the records which are complete in the buffer */
+static int
+rdb_feed_records(rdb_parser *p)
+{
+    rdb_reader *r = &p->reader;
+    char buf[10];
+    int ret;
+
+    if (!p->header_done) {
+        if (r->end - r->pos < 9) return 0;
+        rdb_read_bytes(p, buf, 9);
+        if ((ret = rdb_parse_header(p, buf)) != 0) return ret;
+    }
+    while (!p->done && rdb_scan_record(p)) {
+        rdb_parse_step(p);
+        memset(&p->scan, 0, sizeof(p->scan));
+    }
+    return 0;
+}
+
+void
+rdb_parser_set_max_buffer(rdb_parser *p, size_t size)
+{
+    p->max_buffer = size;
+}
+
+static int
+rdb_feed(rdb_parser *p, const char *data, size_t len)
+{
+    rdb_reader *r = &p->reader;
+    size_t n, cap;
+    char *buf;
+    int ret;
+
+    if (!r->buf) {
+        if (!p->max_buffer) p->max_buffer = RDB_FEED_MAX_BUFFER;
+        r->cap = RDB_READ_BUF_SIZE < p->max_buffer ? RDB_READ_BUF_SIZE : p->max_buffer;
+        if ((r->buf = malloc(r->cap)) == NULL) {
+            rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at feed parser");
+        }
+        r->fill = rdb_feed_fill;
+        r->ud = r;
+    }
+
+    while (len > 0 && !p->done) {
+        rdb_reader_compact(p);
+        if (r->end == r->cap) {
+            // the partial record fills the buffer
+            if (r->cap >= p->max_buffer) {
+                rdb_fail(p, RDB_ERR_BUFFER, "record is larger than max buffer %lu bytes",
+                        (unsigned long)p->max_buffer);
+            }
+            cap = r->cap * 2 < p->max_buffer ? r->cap * 2 : p->max_buffer;
+            if ((buf = realloc(r->buf, cap)) == NULL) {
+                rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at feed parser");
+            }
+            r->buf = buf;
+            r->cap = cap;
+        }
+        n = r->cap - r->end < len ? r->cap - r->end : len;
+        memcpy(r->buf + r->end, data, n);
+        r->end += n;
+        data += n;
+        len -= n;
+        if ((ret = rdb_feed_records(p)) != 0) return ret;
+    }
+    return RDB_OK;
+}
+
+/*
+ * Append a chunk of input and pass events of the complete records to the
+ * handlers, a partial record is kept until the rest is fed. The buffer only
+ * grows to hold the largest record, up to the max buffer size. Return 0,
+ * or an error, e.g. RDB_ERR_BUFFER if a record is larger than max buffer.
+ */
+int
+rdb_parser_feed(rdb_parser *p, const char *data, size_t len)
+{
+    jmp_buf jb;
+    int ret;
+
+    if (p->error) return p->error;
+    p->fail_jmp = &jb;
+    if (setjmp(jb) != 0) return rdb_caught(p);
+    ret = rdb_feed(p, data, len);
+    p->fail_jmp = NULL;
+    return ret;
+}
+
+/* end of fed input, return 0 if the EOF record was parsed, or RDB_ERR_CORRUPT */
+int
+rdb_parser_finish(rdb_parser *p)
+{
+    if (p->error) return p->error;
+    if (p->done) return RDB_OK;
+    snprintf(p->fail_msg, sizeof(p->fail_msg), "rdb input ends before the EOF record");
+    p->fail_offset = p->loaded_bytes + p->reader.end - p->reader.pos;
+    return p->error = RDB_ERR_CORRUPT;
 }
@@ -1,6 +1,114 @@
+/*
+ * rdb parser library, each parser keeps its state in rdb_parser, so several
+ * parsers can run at the same time, e.g. in different threads.
+ *
+ * push: events are passed to the handlers (see rdb_plugin.h) by
+ *       rdb_parser_run, element views are valid during the callback.
+ * pull: rdb_parser_next returns one event at a time, a key comes with all
+ *       of its elements, which are valid until the next call.
+ * feed: instead of rdb_parser_open, input is passed in chunks of any size by
+ *       rdb_parser_feed, events of a record are passed to the handlers once
+ *       the record is complete, so data can be parsed as it arrives.
+ *
+ * The parser never exits, errors are returned as RDB_ERR_* by the API, and
+ * rdb_parser_error tells what and where. The parser can't go on after one,
+ * except a corrupt record in salvage mode, which is skipped.
+ */
 #ifndef _RDB_H_
 #define _RDB_H_
+#include <stddef.h>
+#include <stdint.h>
+#include "rdb_plugin.h"
 
-#include "script.h"
-int rdb_load(lua_State *L, const char *path);
+typedef struct rdb_parser rdb_parser;
+
+#define RDB_OK 0
+#define RDB_ERR_IO -1           /* the input can't be opened or read */
+#define RDB_ERR_FORMAT -2       /* not a rdb file */
+#define RDB_ERR_BUFFER -3       /* a fed record is larger than max buffer */
+#define RDB_ERR_CORRUPT -4      /* a record or value can't be parsed, or the input is cut */
+#define RDB_ERR_UNSUPPORTED -5  /* module type 1, or pre-GA functions */
+#define RDB_ERR_PLUGIN -6       /* a handler returned an error */
+#define RDB_ERR_CHECKSUM -7
+#define RDB_ERR_NOMEM -8
+
+typedef enum {
+    RDB_EVENT_DB = 1,
+    RDB_EVENT_AUX,
+    RDB_EVENT_RESIZEDB,
+    RDB_EVENT_KEY,
+    RDB_EVENT_EOF
+} rdb_event_type;
+
+typedef struct {
+    rdb_event_type type;
+    int db_num;                   /* RDB_EVENT_DB */
+    rdb_slice aux_key;            /* RDB_EVENT_AUX */
+    rdb_slice aux_value;
+    uint64_t db_size;             /* RDB_EVENT_RESIZEDB */
+    uint64_t expires_size;
+    const rdb_key_info *key;      /* RDB_EVENT_KEY */
+    const rdb_element *elements;
+    size_t nelements;
+    const rdb_stream_group *groups;         /* consumer groups if the key is a stream */
+    size_t ngroups;
+    const rdb_stream_consumer *consumers;
+    size_t nconsumers;
+    const rdb_stream_pending *pending;
+    size_t npending;
+} rdb_event;
+
+/*
+ * Counters of a parser, taken at any time by rdb_parser_stats. The split of
+ * the time is measured on keys sampled at random and scaled to all of them.
+ */
+typedef struct {
+    uint64_t loaded_bytes;  /* bytes of rdb parsed */
+    uint64_t input_bytes;   /* bytes read from the file, before decompression */
+    uint64_t input_size;    /* size of the file, 0 if it's not a regular file */
+    uint64_t keys;
+    uint64_t elapsed_us;    /* since the parser was created */
+    uint64_t decode_us;     /* keys, except the parts below */
+    uint64_t lzf_us;        /* lzf strings */
+    uint64_t handler_us;    /* handlers, or the loader of a binding */
+    uint64_t decompress_us; /* cpu of the thread decompressing gzip, zstd or lz4 input */
+} rdb_stats;
+
+typedef void (*rdb_progress_fn)(void *ud, const rdb_stats *stats);
+
+rdb_parser *rdb_parser_create(const rdb_plugin *handlers);
+void rdb_parser_free(rdb_parser *p);
+int rdb_parser_open(rdb_parser *p, const char *path);
+int rdb_parser_run(rdb_parser *p);
+int rdb_parser_next(rdb_parser *p, rdb_event *ev);
+int rdb_parser_version(const rdb_parser *p);
+/* message of the last error, and the input offset where it happened, or NULL */
+const char *rdb_parser_error(const rdb_parser *p, uint64_t *offset);
+int rdb_parser_feed(rdb_parser *p, const char *data, size_t len);
+int rdb_parser_finish(rdb_parser *p);
+void rdb_parser_set_max_buffer(rdb_parser *p, size_t size);
+/* fill digest of rdb_key_info at on_key_end, see digest.h */
+void rdb_parser_set_digest(rdb_parser *p, int enable);
+/*
+ * Encoded values are always checked before they're decoded, a bad one is
+ * fatal, or with validate it's reported and the key is skipped (on_key_end
+ * is not called for it), and parsing goes on with the next key.
+ */
+void rdb_parser_set_validate(rdb_parser *p, int enable);
+uint64_t rdb_parser_bad_values(const rdb_parser *p);
+/*
+ * Salvage damaged files: a record which can't be parsed (a bad type, length
+ * or encoding, or a cut) is skipped, and parsing resumes at the next offset
+ * where a known type begins records which parse. Skipped ranges are logged,
+ * and bad values are skipped as with validate. Not for fed input.
+ */
+void rdb_parser_set_salvage(rdb_parser *p, int enable);
+/* bytes skipped by salvage, and the count of ranges in *ranges */
+uint64_t rdb_parser_skipped_bytes(const rdb_parser *p, uint64_t *ranges);
+void rdb_parser_stats(const rdb_parser *p, rdb_stats *stats);
+/*
+ * Call fn with the stats every interval_ms while parsing, between records.
+ * The clock is only read once 256kb were parsed, fn NULL turns it off.
+ */
+void rdb_parser_set_progress(rdb_parser *p, rdb_progress_fn fn, void *ud, int interval_ms);
 #endif
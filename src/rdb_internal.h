@@ -0,0 +1,266 @@
+/*
+ * Internals of the rdb parser, shared by the library and bindings which
+ * decode values themselves (like lua), not a part of the public api.
+ */
+#ifndef _RDB_INTERNAL_H_
+#define _RDB_INTERNAL_H_
+#include <stdint.h>
+#include <setjmp.h>
+#include <sys/types.h>
+
+#include "rdb.h"
+#include "stream.h"
+#include "codec.h"
+#include "digest.h"
+
+#define MAGIC_STR "REDIS"
+#define REDIS_FUNCTION2 0xf5
+#define REDIS_FUNCTION_PRE_GA 0xf6
+#define REDIS_MODULE_AUX 0xf7
+#define REDIS_IDLE 0xf8
+#define REDIS_FREQ 0xf9
+#define REDIS_AUX 0xfa
+#define REDIS_RESIZEDB 0xfb
+#define REDIS_EXPIRE_SEC 0xfd
+#define REDIS_EXPIRE_MS 0xfc
+#define REDIS_SELECT_DB 0xfe
+#define REDIS_EOF 0xff
+
+#define REDIS_RDB_STRING  0
+#define REDIS_RDB_LIST    1
+#define REDIS_RDB_SET     2
+#define REDIS_RDB_ZSET    3
+#define REDIS_RDB_HASH    4
+#define REDIS_RDB_ZSET_2  5
+#define REDIS_RDB_MODULE  6
+#define REDIS_RDB_MODULE_2 7
+
+#define REDIS_RDB_ZIPMAP  9
+#define REDIS_RDB_LIST_ZIPLIST 10
+#define REDIS_RDB_INTSET  11
+#define REDIS_RDB_ZSET_ZIPLIST 12
+#define REDIS_RDB_HASH_ZIPLIST 13
+#define REDIS_RDB_LIST_QUICKLIST 14
+#define REDIS_RDB_STREAM_LISTPACKS 15
+#define REDIS_RDB_HASH_LISTPACK 16
+#define REDIS_RDB_ZSET_LISTPACK 17
+#define REDIS_RDB_LIST_QUICKLIST_2 18
+#define REDIS_RDB_STREAM_LISTPACKS_2 19
+#define REDIS_RDB_SET_LISTPACK 20
+#define REDIS_RDB_STREAM_LISTPACKS_3 21
+
+#define QUICKLIST_NODE_PLAIN 1
+#define QUICKLIST_NODE_PACKED 2
+
+#define REDIS_MODULE_OPCODE_EOF 0
+#define REDIS_MODULE_OPCODE_SINT 1
+#define REDIS_MODULE_OPCODE_UINT 2
+#define REDIS_MODULE_OPCODE_FLOAT 3
+#define REDIS_MODULE_OPCODE_DOUBLE 4
+#define REDIS_MODULE_OPCODE_STRING 5
+
+#define REDIS_RDB_6B 0
+#define REDIS_RDB_14B 1
+#define REDIS_RDB_32B 2
+#define REDIS_RDB_ENCV 3
+#define REDIS_RDB_32BITLEN 0x80
+#define REDIS_RDB_64BITLEN 0x81
+#define REDIS_RDB_LENERR UINT64_MAX
+
+#define REDIS_RDB_ENC_INT8 0
+#define REDIS_RDB_ENC_INT16 1
+#define REDIS_RDB_ENC_INT32 2
+#define REDIS_RDB_ENC_LZF 3
+
+#define MAGIC_VERSION 5
+#define MAX_VERSION 11
+
+#define RDB_READ_BUF_SIZE (64 * 1024)
+
+// encoded values read by rdb_read_blob, each is checked once before it's decoded
+#define RDB_BLOB_INTSET 0
+#define RDB_BLOB_ZIPMAP 1
+#define RDB_BLOB_ZIPLIST 2
+#define RDB_BLOB_ZIPLIST_PAIRS 3
+#define RDB_BLOB_LISTPACK 4
+#define RDB_BLOB_LISTPACK_PAIRS 5
+#define RDB_BLOB_STREAM 6
+
+typedef struct {
+    char *ptr;
+    size_t len;
+    size_t cap;
+} rdb_buf;
+
+/*
+ * Input is read through a buffer, fill reads up to n bytes from the source
+ * and returns 0 at the end of input, or -1 on error.
+ */
+typedef ssize_t (*rdb_fill_fn)(void *ud, char *buf, size_t n);
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t pos;      /* next byte to consume */
+    size_t end;      /* end of valid bytes */
+    size_t crc_pos;  /* bytes before it are added into cksum */
+    rdb_fill_fn fill;
+    void *ud;
+    int fd;
+} rdb_reader;
+
+#define RDB_FEED_MAX_BUFFER (1024 * 1024 * 1024)
+// checks of the decoders, which only fail on bad input
+#define rdb_unlikely(x) __builtin_expect(!!(x), 0)
+// bytes ahead of a resync point, records which don't fit can't be resumed at
+#define RDB_SALVAGE_WINDOW (4 * 1024 * 1024)
+// raw length of a lzf string, as proto-max-bulk-len of redis
+#define RDB_MAX_LZF_LEN (512 * 1024 * 1024)
+// key records after a resync point which must parse, unless the window ends
+#define RDB_SALVAGE_CHAIN 3
+// one in this many keys is timed on average, picked at random gaps
+#define RDB_SAMPLE_GAP 64
+// bytes parsed between checks of the progress interval
+#define RDB_PROGRESS_STEP (256 * 1024)
+
+// phases timed on the sampled keys, the whole key and the parts of it
+enum {
+    RDB_PHASE_KEY = 0,
+    RDB_PHASE_LZF,
+    RDB_PHASE_HANDLER,
+    RDB_PHASES
+};
+
+#define rdb_phase_begin(p) (rdb_unlikely((p)->sampled) ? rdb_clock_ns() : 0)
+#define rdb_phase_end(p, phase, start) do { \
+    if (rdb_unlikely((p)->sampled)) (p)->sample_ns[phase] += rdb_clock_ns() - (start); \
+} while (0)
+
+/*
+ * Span of the next record in the buffered input, scanned without decoding
+ * while chunks are fed. Items (a length, a string, n raw bytes) are atomic,
+ * the scan resumes from the last complete item when more bytes arrive.
+ */
+typedef struct {
+    size_t off;          /* bytes of the record scanned, from reader pos */
+    int stage;
+    int next;            /* stage after the run */
+    int type;
+    const char *pat;     /* items of the run, repeated left times */
+    const char *counted; /* items repeated by the length of collections */
+    int pat_i;
+    uint64_t left;
+    uint64_t last_len;   /* value of the last length item */
+    uint64_t groups, consumers;
+} rdb_scan;
+
+/* decode the value of a key by the binding, instead of on_element events */
+typedef void (*rdb_value_loader)(void *ud, rdb_parser *p, const rdb_key_info *info);
+/* drop what the loader built, as a corrupt record stopped it halfway */
+typedef void (*rdb_value_reset)(void *ud);
+
+struct rdb_parser {
+    rdb_reader reader;
+    codec *codec;           /* decompress the input if it's compressed */
+    int version;
+    uint64_t cksum;
+    uint64_t loaded_bytes;
+
+    // state of the next key, set by the opcodes before it.
+    int db_num;
+    int64_t expire_time;
+    int64_t lru_idle;
+    int64_t lfu_freq;
+
+    rdb_plugin handlers;
+    rdb_value_loader loader;
+    rdb_value_reset loader_reset;
+    void *loader_ud;
+
+    // reused between keys, elements point into them while the callback runs.
+    rdb_buf key_buf, member_buf, value_buf, blob_buf;
+    stream_walker walker;
+    int emit_skip;          /* elements of the key are not decoded */
+    int emit_element;       /* elements are passed to on_element */
+    int emit_stream;        /* consumer groups are passed to the stream callbacks */
+
+    // bad values are reported and skipped if validate is set, or fatal.
+    int validate;
+    int bad_value;          /* the value of the current key is bad */
+    uint64_t bad_values;
+
+    // rdb_fail keeps the error here, and jumps to fail_jmp of the API call.
+    jmp_buf *fail_jmp;
+    int error;
+    char fail_msg[256];
+    uint64_t fail_offset;
+    uint64_t input_size;    /* size of a regular file, 0 if unknown */
+    uint64_t record_offset; /* where the record being parsed begins */
+
+    // salvage, a corrupt record is skipped to the next one which parses.
+    int salvage;
+    int trial;              /* parsing ahead to check a resync point */
+    int trial_window;       /* the trial ran out of the window */
+    uint64_t skipped_bytes, skipped_ranges;
+
+    // stats, the time split is measured on sampled keys and scaled up.
+    uint64_t keys;
+    uint64_t file_size;     /* size of a regular file, compressed or not */
+    uint64_t start_ns;
+    int sampled;            /* the current key is timed */
+    uint64_t sample_next, sample_seed, sampled_keys;
+    uint64_t sample_ns[RDB_PHASES];
+    rdb_progress_fn progress;
+    void *progress_ud;
+    uint64_t progress_next; /* loaded_bytes of the next check */
+    uint64_t progress_last, progress_interval_ns;
+
+    // digest of the value at on_key_end, if enabled.
+    int digest;
+    digest_state digest_state;
+    digest128 digest_out;
+
+    // pull api, events are collected into these by the built-in handlers.
+    rdb_event *event;
+    int event_ready;
+    rdb_key_info event_key;
+    rdb_element *elems;
+    size_t nelems, elems_cap;
+    rdb_stream_group *groups;
+    size_t ngroups, groups_cap;
+    rdb_stream_consumer *consumers;
+    size_t nconsumers, consumers_cap;
+    rdb_stream_pending *pending;
+    size_t npending, pending_cap;
+    rdb_buf arena;
+    int done;
+
+    // push parser, input is fed in chunks by rdb_parser_feed.
+    int header_done;
+    size_t max_buffer;
+    rdb_scan scan;
+};
+
+void rdb_parser_set_loader(rdb_parser *p, rdb_value_loader loader, rdb_value_reset reset, void *ud);
+uint64_t rdb_clock_ns(void);
+void rdb_fail(rdb_parser *p, int error, const char *fmt, ...) __attribute__((noreturn, format(printf, 3, 4)));
+
+void rdb_read_bytes(rdb_parser *p, void *buf, size_t nbyte);
+uint64_t rdb_read_store_len(rdb_parser *p, uint8_t *is_encoded);
+uint64_t rdb_read_count(rdb_parser *p);
+int64_t rdb_check_walk(rdb_parser *p, uint64_t offset, int64_t n);
+char *rdb_read_lzf_raw(rdb_parser *p, size_t *clen, size_t *len);
+int rdb_lzf_decode(const char *cstr, size_t clen, size_t len, char **out);
+char *rdb_read_string_body(rdb_parser *p, uint64_t len, uint8_t is_encoded);
+char *rdb_read_string(rdb_parser *p);
+void rdb_read_string_buf(rdb_parser *p, rdb_buf *b);
+const char *rdb_read_blob(rdb_parser *p, int kind);
+void rdb_bad_value(rdb_parser *p, uint64_t offset, const char *what, const char *reason);
+char *rdb_read_double_str(rdb_parser *p);
+int rdb_read_binary_double_str(rdb_parser *p, char *buf, size_t size);
+int64_t rdb_read_millisecond_time(rdb_parser *p);
+void rdb_read_stream_id(rdb_parser *p, stream_id *id);
+void rdb_skip_module_value(rdb_parser *p);
+void rdb_module_name(uint64_t module_id, char *name);
+const char *rdb_value_type_name(int type);
+#endif
@@ -0,0 +1,1120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rdb_lua.h"
+#include "rdb_internal.h"
+#include "util.h"
+#include "lzf.h"
+#include "intset.h"
+#include "ziplist.h"
+#include "zipmap.h"
+#include "listpack.h"
+#include "stream.h"
+#include "log.h"
+
+#define IDLE_FIELD_STR "lru_idle"
+#define FREQ_FIELD_STR "lfu_freq"
+#define MODULE_FIELD_STR "module"
+#define AUX_STR "aux"
+#define STREAM_LEN_FIELD_STR "length"
+#define STREAM_LAST_ID_FIELD_STR "last_id"
+#define STREAM_FIRST_ID_FIELD_STR "first_id"
+#define STREAM_MAX_DELETED_ID_FIELD_STR "max_deleted_id"
+#define STREAM_ENTRIES_ADDED_FIELD_STR "entries_added"
+#define STREAM_GROUPS_FIELD_STR "groups"
+#define DB_NUM_STR "db_num"
+#define DB_SIZE_STR "db_size"
+#define EXPIRES_SIZE_STR "expires_size"
+#define VERSION_STR "version"
+#define SOURCE_STR "source"
+#define DIGEST_FIELD_STR "digest"
+// redis holds at most 2^32 keys, a bigger db size hint is corrupt
+#define RDB_MAX_DB_SIZE_HINT (1ULL << 32)
+
+/* options of the binding and the stack top between keys, one per lua_State */
+typedef struct {
+    lua_State *L;
+    int lazy_lzf;
+    int digest;
+    int int_values;
+    int load_top;
+} rdb_lua_ctx;
+
+// the address is the key of the ctx in the registry
+static const char rdb_lua_ctx_key = 0;
+
+#define rdb_lua_ctx_of(p) ((rdb_lua_ctx *)(p)->loader_ud)
+
+/* the ctx of L, kept as a userdata in the registry, created at the first use */
+static rdb_lua_ctx *
+rdb_lua_get_ctx(lua_State *L)
+{
+    rdb_lua_ctx *ctx;
+
+    lua_pushlightuserdata(L, (void *)&rdb_lua_ctx_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (ctx) return ctx;
+
+    lua_pushlightuserdata(L, (void *)&rdb_lua_ctx_key);
+    ctx = lua_newuserdata(L, sizeof(rdb_lua_ctx));
+    memset(ctx, 0, sizeof(rdb_lua_ctx));
+    ctx->L = L;
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    return ctx;
+}
+
+void
+rdb_lua_set_lazy_lzf(lua_State *L, int enable)
+{
+    rdb_lua_get_ctx(L)->lazy_lzf = enable;
+}
+
+void
+rdb_lua_set_int_values(lua_State *L, int enable)
+{
+    rdb_lua_get_ctx(L)->int_values = enable;
+}
+
+void
+rdb_lua_set_digest(lua_State *L, int enable)
+{
+    rdb_lua_get_ctx(L)->digest = enable;
+}
+
+/* a fresh env for each rdb, env.source is the path of it */
+void
+rdb_lua_set_source(lua_State *L, const char *source)
+{
+    lua_newtable(L);
+    lua_pushstring(L, source);
+    lua_setfield(L, -2, SOURCE_STR);
+    lua_setglobal(L, RDB_ENV);
+}
+
+static void
+rdb_set_int_env(lua_State *L, char *key, int64_t value)
+{
+    lua_getglobal(L, RDB_ENV);
+    script_pushtableinteger(L, key, value);
+    lua_pop(L, 1);
+}
+
+static void
+rdb_unset_env(lua_State *L, char *key)
+{
+    lua_getglobal(L, RDB_ENV);
+    lua_pushnil(L);
+    lua_setfield(L, -2, key);
+    lua_pop(L, 1);
+}
+
+static void
+rdb_set_aux_env(lua_State *L, char *key, char *value)
+{
+    lua_getglobal(L, RDB_ENV);
+    lua_getfield(L, -1, AUX_STR);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, AUX_STR);
+    }
+    script_pushtablestring(L, key, value);
+    lua_pop(L, 2);
+}
+
+// ================================== DECODED VALUE PUSH. ==================================== //
+
+static void
+listpack_push_entry(lua_State *L, lp_entry *entry)
+{
+    int len;
+    char buf[LONG_STR_SIZE];
+
+    if (entry->sval) {
+        lua_pushlstring(L, entry->sval, entry->slen);
+    } else {
+        len = ll2str(buf, entry->lval);
+        lua_pushlstring(L, buf, len);
+    }
+}
+
+// integers beyond 2^53 don't fit in lua numbers, they're kept as strings
+#define LUA_SAFE_INT(v) ((v) >= -(1LL << 53) && (v) <= (1LL << 53))
+
+static void
+rdb_push_int(lua_State *L, int64_t v, int int_values)
+{
+    int len;
+    char buf[LONG_STR_SIZE];
+
+    if (int_values && LUA_SAFE_INT(v)) {
+        lua_pushinteger(L, v);
+    } else {
+        len = ll2str(buf, v);
+        lua_pushlstring(L, buf, len);
+    }
+}
+
+/* values may be pushed as numbers, unlike fields which are keys of the table */
+static void
+listpack_push_value(lua_State *L, lp_entry *entry, int int_values)
+{
+    if (entry->sval) {
+        lua_pushlstring(L, entry->sval, entry->slen);
+    } else {
+        rdb_push_int(L, entry->lval, int_values);
+    }
+}
+
+static int64_t
+push_listpack_list_or_set(lua_State *L, int int_values, const char *lp, int64_t start)
+{
+    int64_t i = start;
+    lp_entry entry;
+    const char *p;
+
+    p = listpack_first(lp);
+    while ((p = listpack_next(p, &entry)) != NULL) {
+        listpack_push_value(L, &entry, int_values);
+        lua_rawseti(L, -2, ++i);
+    }
+
+    return i - start;
+}
+
+static void
+push_listpack_hash_or_zset(lua_State *L, int int_values, const char *lp)
+{
+    lp_entry field, value;
+    const char *p;
+
+    p = listpack_first(lp);
+    while ((p = listpack_next(p, &field)) != NULL
+            && (p = listpack_next(p, &value)) != NULL) {
+        listpack_push_entry(L, &field);
+        listpack_push_value(L, &value, int_values);
+        lua_settable(L, -3);
+    }
+}
+
+static int64_t
+push_ziplist_list_or_set(lua_State *L, int int_values, const char *zl, int64_t start)
+{
+    int64_t i = start;
+    lp_entry entry;
+    const char *p = (const char *)ZL_ENTRY(zl);
+
+    while ((p = ziplist_next(p, &entry)) != NULL) {
+        listpack_push_value(L, &entry, int_values);
+        lua_rawseti(L, -2, ++i);
+    }
+
+    return i - start;
+}
+
+static void
+push_ziplist_hash_or_zset(lua_State *L, int int_values, const char *zl)
+{
+    lp_entry field, value;
+    const char *p = (const char *)ZL_ENTRY(zl);
+
+    while ((p = ziplist_next(p, &field)) != NULL
+            && (p = ziplist_next(p, &value)) != NULL) {
+        listpack_push_entry(L, &field);
+        listpack_push_value(L, &value, int_values);
+        lua_settable(L, -3);
+    }
+}
+
+static void
+push_zipmap(lua_State *L, const char *zm)
+{
+    lp_entry field, value;
+    const char *p = zipmap_first(zm);
+
+    while ((p = zipmap_next(p, &field, &value)) != NULL) {
+        listpack_push_entry(L, &field);
+        listpack_push_entry(L, &value);
+        lua_settable(L, -3);
+    }
+}
+
+
+typedef struct {
+    lua_State *L;
+    rdb_parser *p;
+    const char *key;
+    int use_cb;
+    int64_t n;
+} stream_push_ctx;
+
+static void
+stream_push_entry(void *ud, stream_id *id, lp_entry *fields, lp_entry *values, int64_t count)
+{
+    int64_t i;
+    char id_str[STREAM_ID_STR_SIZE];
+    stream_push_ctx *ctx = ud;
+    lua_State *L = ctx->L;
+    uint64_t start;
+    int ret;
+
+    if (ctx->use_cb) {
+        lua_getglobal(L, RDB_STREAM_CB);
+        lua_pushstring(L, ctx->key);
+    }
+    lua_createtable(L, 0, 2);
+    stream_id_format(id_str, id);
+    script_pushtablestring(L, "id", id_str);
+    lua_pushstring(L, "fields");
+    lua_createtable(L, 0, count);
+    for (i = 0; i < count; i++) {
+        listpack_push_entry(L, &fields[i]);
+        listpack_push_value(L, &values[i], rdb_lua_ctx_of(ctx->p)->int_values);
+        lua_settable(L, -3);
+    }
+    lua_settable(L, -3);
+
+    if (ctx->use_cb) {
+        start = rdb_phase_begin(ctx->p);
+        ret = lua_pcall(L, 2, 0, 0);
+        rdb_phase_end(ctx->p, RDB_PHASE_HANDLER, start);
+        if (ret != 0) {
+            rdb_fail(ctx->p, RDB_ERR_PLUGIN, "%s function failed, %s", RDB_STREAM_CB, lua_tostring(L, -1));
+        }
+    } else {
+        lua_rawseti(L, -2, ++ctx->n);
+    }
+}
+
+/*
+ * Push {id = "ms-seq", fields = {...}} into the table at the top of stack,
+ * or call handle_stream_entry(key, entry) with the same table if use_cb is set.
+ */
+static int64_t
+push_stream_listpack(lua_State *L, rdb_parser *p, uint64_t offset, const char *lp, stream_id *master, int64_t start,
+        const char *key, int use_cb)
+{
+    stream_push_ctx ctx = { L, p, key, use_cb, start };
+
+    return rdb_check_walk(p, offset, stream_walk_listpack(&p->walker, lp, master, stream_push_entry, &ctx));
+}
+
+// ================================== SCRIPT PUSH UTIL. ==================================== //
+
+static void
+rdb_push_list (lua_State *L, rdb_parser *p, uint64_t len)
+{
+    uint64_t i;
+
+    for (i = 0; i < len; i++) {
+        rdb_read_string_buf(p, &p->blob_buf);
+        script_push_list_elem(L, p->blob_buf.ptr, p->blob_buf.len, i);
+    }
+}
+
+static void
+rdb_push_hash (lua_State *L, rdb_parser *p, uint64_t len)
+{
+    uint64_t i;
+    char *key , *val;
+
+    for (i = 0; i < len; i++) {
+        key = rdb_read_string(p);
+        val = rdb_read_string(p);
+        script_pushtablestring(L, key, val);
+        free(key);
+        free(val);
+    }
+}
+
+static void
+rdb_push_zset (lua_State *L, rdb_parser *p, int type, uint64_t len)
+{
+    uint64_t i;
+    char *member, *score;
+    char buf[128];
+
+    for (i = 0; i < len; i++) {
+        member = rdb_read_string(p);
+        if (REDIS_RDB_ZSET_2 == type) {
+            rdb_read_binary_double_str(p, buf, sizeof(buf));
+            script_pushtablestring(L, member, buf);
+        } else {
+            score = rdb_read_double_str(p);
+            script_pushtablestring(L, member, score);
+            free(score);
+        }
+        free(member);
+    }
+}
+
+// ================================== RDB LOAD. ==================================== //
+
+static void
+rdb_set_value_type(lua_State *L, int type)
+{
+    const char *val_type = rdb_value_type_name(type);
+
+    if (val_type) script_pushfieldstring(L, FIELD_TYPE, (char *)val_type);
+}
+
+// ================================== VALUE DIGEST. ==================================== //
+
+/* integer values are numbers with --int-values, format them as the rdb does */
+static const char *
+rdb_digest_str(lua_State *L, int idx, char *buf, size_t *len)
+{
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        *len = ll2str(buf, (long long)lua_tonumber(L, idx));
+        return buf;
+    }
+    return lua_type(L, idx) == LUA_TSTRING ? lua_tolstring(L, idx, len) : NULL;
+}
+
+/* add the values at idx and vidx (0 if none) */
+static void
+rdb_digest_add(lua_State *L, digest_state *d, int idx, int vidx, const char *id, size_t id_len)
+{
+    char mbuf[LONG_STR_SIZE], vbuf[LONG_STR_SIZE];
+    const char *m, *v = NULL;
+    size_t mlen, vlen = 0;
+
+    m = rdb_digest_str(L, idx, mbuf, &mlen);
+    if (vidx) v = rdb_digest_str(L, vidx, vbuf, &vlen);
+    if (m && (!vidx || v)) digest_add(d, m, mlen, v, vlen, id, id_len);
+}
+
+/* add pairs of the table at idx, in any order */
+static void
+rdb_digest_add_pairs(lua_State *L, digest_state *d, int idx, const char *id, size_t id_len)
+{
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        rdb_digest_add(L, d, lua_gettop(L) - 1, lua_gettop(L), id, id_len);
+        lua_pop(L, 1);
+    }
+}
+
+/*
+ * Set item.digest by the decoded value, the same as the digest of on_key_end
+ * with the elements of native handlers. The item is at the top of stack.
+ */
+static void
+rdb_set_digest(lua_State *L, const char *type_name)
+{
+    digest_state d;
+    digest128 out;
+    char hex[DIGEST_HEX_SIZE];
+    const char *id;
+    size_t i, n, id_len;
+    int item = lua_gettop(L), value, entry;
+
+    digest_init(&d, type_name);
+    // lazy lzf string is decompressed by __index here
+    script_pushfield(L, FIELD_VALUE);
+    lua_gettable(L, item);
+    value = lua_gettop(L);
+    if (strcmp(type_name, "module") == 0) {
+        // module values are not decoded, neither by native handlers
+    } else if (lua_isstring(L, value)) {
+        rdb_digest_add(L, &d, value, 0, NULL, 0);
+    } else if (!lua_istable(L, value)) {
+        // stream entries are passed to handle_stream_entry
+        lua_pop(L, 1);
+        return;
+    } else if (strcmp(type_name, "list") == 0 || strcmp(type_name, "set") == 0) {
+        n = lua_rawlen(L, value);
+        for (i = 1; i <= n; i++) {
+            lua_rawgeti(L, value, i);
+            rdb_digest_add(L, &d, lua_gettop(L), 0, NULL, 0);
+            lua_pop(L, 1);
+        }
+    } else if (strcmp(type_name, "stream") == 0) {
+        n = lua_rawlen(L, value);
+        for (i = 1; i <= n; i++) {
+            lua_rawgeti(L, value, i);
+            entry = lua_gettop(L);
+            lua_getfield(L, entry, "id");
+            id = lua_tolstring(L, -1, &id_len);
+            lua_getfield(L, entry, "fields");
+            if (id && lua_istable(L, -1)) rdb_digest_add_pairs(L, &d, lua_gettop(L), id, id_len);
+            lua_pop(L, 3);
+        }
+    } else {
+        rdb_digest_add_pairs(L, &d, value, NULL, 0);
+    }
+    lua_pop(L, 1);
+
+    digest_final(&d, &out);
+    digest_hex(&out, hex);
+    script_pushtablestring(L, DIGEST_FIELD_STR, hex);
+}
+
+typedef struct {
+    size_t clen;
+    size_t len;
+    char data[0];
+} lzf_blob;
+
+/*
+ * __index of lazy string value, decompress the lzf blob at the first time
+ * item.value is accessed, and cache the result into the item table.
+ */
+static int
+rdb_lazy_value_index(lua_State *L)
+{
+    char *str;
+#ifndef USE_LUAJIT
+    luaL_Buffer b;
+#endif
+    lzf_blob *blob;
+
+    script_pushfield(L, FIELD_VALUE);
+    if (!lua_rawequal(L, 2, -1)) {
+        return 0;
+    }
+    lua_pop(L, 1);
+
+    blob = lua_touserdata(L, lua_upvalueindex(1));
+#ifdef USE_LUAJIT
+    // no luaL_buffinitsize in the 5.1 api, decompress into a heap buffer.
+    if (rdb_lzf_decode(blob->data, blob->clen, blob->len, &str) != RDB_OK) {
+        return luaL_error(L, "lzf decompress failed on lazy value.");
+    }
+    lua_pushlstring(L, str, blob->len);
+    free(str);
+#else
+    str = luaL_buffinitsize(L, &b, blob->len);
+    if (blob->len > 0 && lzf_decompress(blob->data, blob->clen, str, blob->len) != blob->len) {
+        return luaL_error(L, "lzf decompress failed on lazy value.");
+    }
+    luaL_pushresultsize(&b, blob->len);
+#endif
+
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 1);
+    return 1;
+}
+
+static void
+rdb_push_lazy_value(lua_State *L, const char *cstr, size_t clen, size_t len)
+{
+    lzf_blob *blob;
+
+    lua_newtable(L);
+    blob = lua_newuserdata(L, sizeof(lzf_blob) + clen);
+    blob->clen = clen;
+    blob->len = len;
+    memcpy(blob->data, cstr, clen);
+    lua_pushcclosure(L, rdb_lazy_value_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+}
+
+static void
+rdb_load_str_value(lua_State *L, rdb_parser *p)
+{
+    char *str, *cstr;
+    uint8_t is_encoded;
+    size_t len, clen;
+    uint64_t start, slen, offset = p->loaded_bytes;
+    int ret;
+
+    if ((slen = rdb_read_store_len(p, &is_encoded)) == REDIS_RDB_LENERR) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "read error on load string length");
+    }
+    if (!is_encoded || REDIS_RDB_ENC_LZF != slen) {
+        str = rdb_read_string_body(p, slen, is_encoded);
+        if (is_encoded) slen = strlen(str);
+        script_pushfieldinteger(L, FIELD_RAW_LEN, slen);
+        if (is_encoded && rdb_lua_ctx_of(p)->int_values) {
+            // int8, int16 or int32 encoded
+            script_pushfieldinteger(L, FIELD_VALUE, strtoll(str, NULL, 10));
+        } else {
+            script_pushfieldlstring(L, FIELD_VALUE, str, slen);
+        }
+        free(str);
+        return;
+    }
+
+    if ((cstr = rdb_read_lzf_raw(p, &clen, &len)) == NULL) {
+        rdb_fail(p, RDB_ERR_CORRUPT, "read error on load lzf string");
+    }
+    script_pushfieldinteger(L, FIELD_RAW_LEN, len);
+    script_pushfieldinteger(L, FIELD_COMPRESSED_LEN, clen);
+    if (rdb_lua_ctx_of(p)->lazy_lzf) {
+        // value would be decompressed when script access it.
+        rdb_push_lazy_value(L, cstr, clen, len);
+    } else {
+        start = rdb_phase_begin(p);
+        ret = rdb_lzf_decode(cstr, clen, len, &str);
+        rdb_phase_end(p, RDB_PHASE_LZF, start);
+        if (RDB_ERR_NOMEM == ret) {
+            free(cstr);
+            rdb_fail(p, RDB_ERR_NOMEM, "malloc failed at load lzf string");
+        }
+        if (str == NULL) {
+            rdb_bad_value(p, offset, "lzf string", "decompress failed");
+        } else {
+            script_pushfieldlstring(L, FIELD_VALUE, str, len);
+            free(str);
+        }
+    }
+
+    free(cstr);
+}
+
+/* push value field and a table pre-sized by the length prefix */
+static void
+rdb_push_value_table(lua_State *L, uint64_t narr, uint64_t nrec)
+{
+    script_pushfield(L, FIELD_VALUE);
+    script_new_value_table(L, narr, nrec);
+}
+
+static void
+rdb_load_intset_value(lua_State *L, rdb_parser *p)
+{
+    uint32_t i, j, n;
+    int64_t ints[INTSET_DECODE_BATCH];
+    const intset *is;
+
+    if ((is = (const intset *)rdb_read_blob(p, RDB_BLOB_INTSET)) == NULL) return;
+    rdb_push_value_table(L, is->length, 0);
+    for (i = 0; (n = intset_decode(is, i, ints, INTSET_DECODE_BATCH)) > 0; i += n) {
+        for (j = 0; j < n; j++) {
+            rdb_push_int(L, ints[j], rdb_lua_ctx_of(p)->int_values);
+            lua_rawseti(L, -2, i + j + 1);
+        }
+    }
+    lua_settable(L,-3);
+}
+
+static void
+rdb_load_zllist_value(lua_State *L, rdb_parser *p)
+{
+    const char *str;
+
+    if ((str = rdb_read_blob(p, RDB_BLOB_ZIPLIST)) == NULL) return;
+    rdb_push_value_table(L, ZL_LEN_HINT(str), 0);
+    push_ziplist_list_or_set(L, rdb_lua_ctx_of(p)->int_values, str, 0);
+    lua_settable(L,-3);
+}
+
+static void
+rdb_load_zipmap_value (lua_State *L, rdb_parser *p)
+{
+    const char *str;
+
+    if ((str = rdb_read_blob(p, RDB_BLOB_ZIPMAP)) == NULL) return;
+    rdb_push_value_table(L, 0, ZM_LEN_HINT(str));
+    push_zipmap(L, str);
+    lua_settable(L,-3);
+}
+
+static void
+rdb_load_ziplist_value(lua_State *L, rdb_parser *p)
+{
+    const char *str;
+
+    if ((str = rdb_read_blob(p, RDB_BLOB_ZIPLIST_PAIRS)) == NULL) return;
+    rdb_push_value_table(L, 0, ZL_LEN_HINT(str) / 2);
+    push_ziplist_hash_or_zset(L, rdb_lua_ctx_of(p)->int_values, str);
+    lua_settable(L,-3);
+}
+
+static void
+rdb_load_list_or_set_value(lua_State *L, rdb_parser *p)
+{
+    uint64_t len;
+
+    len = rdb_read_count(p);
+    rdb_push_value_table(L, len, 0);
+    rdb_push_list(L, p, len);
+    lua_settable(L,-3);
+}
+
+static void
+rdb_load_hash_or_zset_value (lua_State *L, rdb_parser *p)
+{
+    uint64_t len;
+
+    len = rdb_read_count(p);
+    rdb_push_value_table(L, 0, len);
+    rdb_push_hash(L, p, len);
+    lua_settable(L,-3);
+}
+
+static void
+rdb_load_zset_value (lua_State *L, rdb_parser *p, int type)
+{
+    uint64_t len;
+
+    len = rdb_read_count(p);
+    rdb_push_value_table(L, 0, len);
+    rdb_push_zset(L, p, type, len);
+    lua_settable(L,-3);
+}
+
+/*
+ * quicklist is a list of ziplist, and quicklist 2 (since rdb version 10) is
+ * a list of nodes, each node is a plain string or a listpack.
+ */
+static void
+rdb_load_quicklist_value(lua_State *L, rdb_parser *p, int type)
+{
+    uint64_t i, len, container;
+    int64_t n = 0;
+    const char *str;
+
+    len = rdb_read_count(p);
+    // the count of nodes is the only hint before nodes are read
+    rdb_push_value_table(L, len, 0);
+    for (i = 0; i < len; i++) {
+        container = QUICKLIST_NODE_PACKED;
+        if (REDIS_RDB_LIST_QUICKLIST_2 == type) {
+            container = rdb_read_store_len(p, NULL);
+        }
+        if (REDIS_RDB_LIST_QUICKLIST == type) {
+            if ((str = rdb_read_blob(p, RDB_BLOB_ZIPLIST)) != NULL) n += push_ziplist_list_or_set(L, rdb_lua_ctx_of(p)->int_values, str, n);
+        } else if (QUICKLIST_NODE_PLAIN == container) {
+            rdb_read_string_buf(p, &p->blob_buf);
+            script_push_list_elem(L, p->blob_buf.ptr, p->blob_buf.len, n++);
+        } else if (QUICKLIST_NODE_PACKED == container) {
+            if ((str = rdb_read_blob(p, RDB_BLOB_LISTPACK)) != NULL) n += push_listpack_list_or_set(L, rdb_lua_ctx_of(p)->int_values, str, n);
+        } else {
+            rdb_fail(p, RDB_ERR_CORRUPT, "unknown quicklist container %llu", (unsigned long long)container);
+        }
+    }
+    lua_settable(L,-3);
+}
+
+static void
+rdb_load_listpack_value(lua_State *L, rdb_parser *p, int type)
+{
+    const char *str;
+
+    str = rdb_read_blob(p, REDIS_RDB_SET_LISTPACK == type ? RDB_BLOB_LISTPACK : RDB_BLOB_LISTPACK_PAIRS);
+    if (!str) return;
+    if (REDIS_RDB_SET_LISTPACK == type) {
+        rdb_push_value_table(L, LP_LEN_HINT(str), 0);
+        push_listpack_list_or_set(L, rdb_lua_ctx_of(p)->int_values, str, 0);
+    } else {
+        rdb_push_value_table(L, 0, LP_LEN_HINT(str) / 2);
+        push_listpack_hash_or_zset(L, rdb_lua_ctx_of(p)->int_values, str);
+    }
+    lua_settable(L,-3);
+}
+
+static void
+rdb_load_module_value(lua_State *L, rdb_parser *p)
+{
+    char name[10];
+
+    rdb_module_name(rdb_read_store_len(p, NULL), name);
+    script_pushtablestring(L, MODULE_FIELD_STR, name);
+    rdb_skip_module_value(p);
+}
+
+static void
+rdb_push_stream_id(lua_State *L, char *field, stream_id *id)
+{
+    char buf[STREAM_ID_STR_SIZE];
+
+    stream_id_format(buf, id);
+    script_pushtablestring(L, field, buf);
+}
+
+static void
+rdb_push_raw_stream_id(lua_State *L, rdb_parser *p, int64_t ind)
+{
+    char raw[STREAM_ID_SIZE], buf[STREAM_ID_STR_SIZE];
+    stream_id id;
+
+    rdb_read_bytes(p, raw, STREAM_ID_SIZE);
+    stream_id_decode(raw, &id);
+    stream_id_format(buf, &id);
+    script_push_list_elem(L, buf, strlen(buf), ind);
+}
+
+/*
+ * consumer groups: name, last id, [entries read], pel and consumers, each
+ * pel entry is raw id, delivery time and delivery count, and the consumer
+ * pel only keeps raw ids which refer to the group pel.
+ */
+static void
+rdb_push_stream_groups(lua_State *L, rdb_parser *p, int type)
+{
+    uint64_t i, j, k, ngroups, npel, nconsumers;
+    char raw[STREAM_ID_SIZE], *name;
+    stream_id id;
+
+    ngroups = rdb_read_count(p);
+    lua_pushstring(L, STREAM_GROUPS_FIELD_STR);
+    lua_createtable(L, ngroups, 0);
+    for (i = 0; i < ngroups; i++) {
+        lua_createtable(L, 0, 5);
+        name = rdb_read_string(p);
+        script_pushtablestring(L, "name", name);
+        free(name);
+        rdb_read_stream_id(p, &id);
+        rdb_push_stream_id(L, STREAM_LAST_ID_FIELD_STR, &id);
+        if (type >= REDIS_RDB_STREAM_LISTPACKS_2) {
+            script_pushtableinteger(L, "entries_read", rdb_read_store_len(p, NULL));
+        }
+
+        npel = rdb_read_count(p);
+        lua_pushstring(L, "pending");
+        lua_createtable(L, npel, 0);
+        for (j = 0; j < npel; j++) {
+            lua_createtable(L, 0, 3);
+            rdb_read_bytes(p, raw, STREAM_ID_SIZE);
+            stream_id_decode(raw, &id);
+            rdb_push_stream_id(L, "id", &id);
+            script_pushtableinteger(L, "delivery_time", rdb_read_millisecond_time(p));
+            script_pushtableinteger(L, "delivery_count", rdb_read_store_len(p, NULL));
+            lua_rawseti(L, -2, j + 1);
+        }
+        lua_settable(L, -3);
+
+        nconsumers = rdb_read_count(p);
+        lua_pushstring(L, "consumers");
+        lua_createtable(L, nconsumers, 0);
+        for (j = 0; j < nconsumers; j++) {
+            lua_createtable(L, 0, 4);
+            name = rdb_read_string(p);
+            script_pushtablestring(L, "name", name);
+            free(name);
+            script_pushtableinteger(L, "seen_time", rdb_read_millisecond_time(p));
+            if (type >= REDIS_RDB_STREAM_LISTPACKS_3) {
+                script_pushtableinteger(L, "active_time", rdb_read_millisecond_time(p));
+            }
+            npel = rdb_read_count(p);
+            lua_pushstring(L, "pending");
+            lua_createtable(L, npel, 0);
+            for (k = 0; k < npel; k++) {
+                rdb_push_raw_stream_id(L, p, k);
+            }
+            lua_settable(L, -3);
+            lua_rawseti(L, -2, j + 1);
+        }
+        lua_settable(L, -3);
+
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_settable(L, -3);
+}
+
+/*
+ * stream is stored as a rax of listpacks, each node is the master id (as key)
+ * and a listpack, nodes are walked one by one and entries are pushed at once,
+ * so the rax is never built in memory. Entries are passed to the
+ * handle_stream_entry(key, entry) if script defines it, instead of item.value.
+ */
+static void
+rdb_load_stream_value(lua_State *L, rdb_parser *p, int type, const char *key)
+{
+    uint64_t i, nodes, offset;
+    int64_t n = 0;
+    int use_cb;
+    const char *lp;
+    stream_id id;
+
+    use_cb = script_check_func_exists(L, RDB_STREAM_CB);
+    nodes = rdb_read_count(p);
+    if (!use_cb) {
+        rdb_push_value_table(L, nodes, 0);
+    }
+    for (i = 0; i < nodes; i++) {
+        offset = p->loaded_bytes;
+        rdb_read_string_buf(p, &p->member_buf);
+        if (p->member_buf.len != STREAM_ID_SIZE) {
+            rdb_bad_value(p, offset, "stream node key", "length is not 16");
+        } else {
+            stream_id_decode(p->member_buf.ptr, &id);
+        }
+        lp = rdb_read_blob(p, RDB_BLOB_STREAM);
+        // a bad node is not passed to handle_stream_entry either
+        if (lp && !p->bad_value) n += push_stream_listpack(L, p, offset, lp, &id, n, key, use_cb);
+    }
+    if (!use_cb) {
+        lua_settable(L, -3);
+    }
+
+    script_pushtableinteger(L, STREAM_LEN_FIELD_STR, rdb_read_store_len(p, NULL));
+    rdb_read_stream_id(p, &id);
+    rdb_push_stream_id(L, STREAM_LAST_ID_FIELD_STR, &id);
+    if (type >= REDIS_RDB_STREAM_LISTPACKS_2) {
+        rdb_read_stream_id(p, &id);
+        rdb_push_stream_id(L, STREAM_FIRST_ID_FIELD_STR, &id);
+        rdb_read_stream_id(p, &id);
+        rdb_push_stream_id(L, STREAM_MAX_DELETED_ID_FIELD_STR, &id);
+        script_pushtableinteger(L, STREAM_ENTRIES_ADDED_FIELD_STR, rdb_read_store_len(p, NULL));
+    }
+    rdb_push_stream_groups(L, p, type);
+}
+
+static void
+rdb_load_value(lua_State *L, rdb_parser *p, int type, const char *key)
+{
+    switch (type) {
+        case       REDIS_RDB_STRING: rdb_load_str_value(L, p); break;
+        case       REDIS_RDB_INTSET: rdb_load_intset_value(L, p); break;
+        case REDIS_RDB_LIST_ZIPLIST: rdb_load_zllist_value(L, p); break;
+        case       REDIS_RDB_ZIPMAP: rdb_load_zipmap_value(L, p); break;
+        case REDIS_RDB_ZSET_ZIPLIST:
+        case REDIS_RDB_HASH_ZIPLIST: rdb_load_ziplist_value(L, p); break;
+        case         REDIS_RDB_LIST:
+        case          REDIS_RDB_SET: rdb_load_list_or_set_value(L, p); break;
+        case         REDIS_RDB_HASH: rdb_load_hash_or_zset_value(L, p); break;
+        case         REDIS_RDB_ZSET:
+        case       REDIS_RDB_ZSET_2: rdb_load_zset_value(L, p, type); break;
+        case     REDIS_RDB_MODULE_2: rdb_load_module_value(L, p); break;
+        case REDIS_RDB_LIST_QUICKLIST:
+        case REDIS_RDB_LIST_QUICKLIST_2: rdb_load_quicklist_value(L, p, type); break;
+        case REDIS_RDB_HASH_LISTPACK:
+        case REDIS_RDB_ZSET_LISTPACK:
+        case REDIS_RDB_SET_LISTPACK: rdb_load_listpack_value(L, p, type); break;
+        case     REDIS_RDB_MODULE:
+            rdb_fail(p, RDB_ERR_UNSUPPORTED, "module type 1 is not supported, it can't be parsed without the module");
+            break;
+        case REDIS_RDB_STREAM_LISTPACKS:
+        case REDIS_RDB_STREAM_LISTPACKS_2:
+        case REDIS_RDB_STREAM_LISTPACKS_3: rdb_load_stream_value(L, p, type, key); break;
+
+        default: rdb_fail(p, RDB_ERR_CORRUPT, "unknown value type %d", type); break;
+    }
+}
+
+#ifdef USE_LUAJIT
+/*
+ * Hand the record to handle_view(view, item), string values are read into
+ * the view without creating lua strings, other types are decoded into item.
+ */
+static void
+rdb_load_view(lua_State *L, rdb_parser *p, const rdb_key_info *info)
+{
+    rdb_record_view view;
+    char *str = NULL, *cstr;
+    uint8_t is_encoded;
+    size_t clen, rlen;
+    uint64_t len, start;
+    int ret, type = info->type, has_item = 0;
+    char *key = (char *)info->key.ptr;
+
+    // keys may hold NUL, the length is the one of the decoded key
+    view.key = key;
+    view.key_len = info->key.len;
+    view.value = NULL;
+    view.value_len = 0;
+    view.expire_time = info->expire_time;
+    view.type = type;
+    view.type_name = info->type_name;
+
+    if (REDIS_RDB_STRING == type) {
+        len = rdb_read_store_len(p, &is_encoded);
+        if (REDIS_RDB_LENERR == len) {
+            rdb_fail(p, RDB_ERR_CORRUPT, "read error on load string length");
+        }
+        if (is_encoded && REDIS_RDB_ENC_LZF == len) {
+            if ((cstr = rdb_read_lzf_raw(p, &clen, &rlen)) == NULL) {
+                rdb_fail(p, RDB_ERR_CORRUPT, "read error on load lzf string");
+            }
+            start = rdb_phase_begin(p);
+            ret = rdb_lzf_decode(cstr, clen, rlen, &str);
+            rdb_phase_end(p, RDB_PHASE_LZF, start);
+            if (ret != RDB_OK) {
+                free(cstr);
+                rdb_fail(p, ret, "%s on load string", RDB_ERR_NOMEM == ret ? "malloc failed" : "lzf decompress failed");
+            }
+            free(cstr);
+            len = rlen;
+        } else {
+            str = rdb_read_string_body(p, len, is_encoded);
+            if (is_encoded) len = strlen(str);
+        }
+        view.value = str;
+        view.value_len = len;
+    } else {
+        script_push_item(L);
+        script_pushfieldlstring(L, FIELD_KEY, key, info->key.len);
+        script_pushfieldinteger(L, FIELD_EXPIRE_TIME, info->expire_time);
+        rdb_load_value(L, p, type, key);
+        if (p->bad_value) {
+            script_drop_item(L);
+            return;
+        }
+        rdb_set_value_type(L, type);
+        has_item = 1;
+    }
+
+    start = rdb_phase_begin(p);
+    ret = script_handle_view(L, &view, has_item);
+    rdb_phase_end(p, RDB_PHASE_HANDLER, start);
+    if (ret != 0) {
+        free(str);
+        rdb_fail(p, RDB_ERR_PLUGIN, "handle_view function failed, %s", lua_tostring(L, -1));
+    }
+    free(str);
+}
+#endif
+
+static int
+rdb_lua_on_header(void *ud, int version)
+{
+    rdb_lua_ctx *ctx = ud;
+
+    rdb_set_int_env(ctx->L, VERSION_STR, version);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_lua_on_db(void *ud, int db_num)
+{
+    lua_State *L = ((rdb_lua_ctx *)ud)->L;
+
+    rdb_set_int_env(L, DB_NUM_STR, db_num);
+    // size hints belong to the previous db
+    rdb_unset_env(L, DB_SIZE_STR);
+    rdb_unset_env(L, EXPIRES_SIZE_STR);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_lua_on_aux(void *ud, const rdb_slice *key, const rdb_slice *value)
+{
+    rdb_lua_ctx *ctx = ud;
+
+    rdb_set_aux_env(ctx->L, (char *)key->ptr, (char *)value->ptr);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_lua_on_resizedb(void *ud, uint64_t db_size, uint64_t expires_size)
+{
+    rdb_lua_ctx *ctx = ud;
+
+    // a corrupt hint is left unset, expires are a subset of the keys
+    if (db_size > RDB_MAX_DB_SIZE_HINT || expires_size > db_size) {
+        logger(WARN, "Ignored resizedb hint, db_size %llu and expires_size %llu.",
+                (unsigned long long)db_size, (unsigned long long)expires_size);
+        return RDB_PLUGIN_OK;
+    }
+    rdb_set_int_env(ctx->L, DB_SIZE_STR, db_size);
+    rdb_set_int_env(ctx->L, EXPIRES_SIZE_STR, expires_size);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+rdb_lua_on_eof(void *ud)
+{
+    lua_State *L = ((rdb_lua_ctx *)ud)->L;
+
+    // the parser fails on it with a general message
+    if (script_flush_batch(L) != 0) {
+        logger(WARN, "Runing handle_batch function failed: %s", lua_tostring(L, -1));
+        return -1;
+    }
+    return RDB_PLUGIN_OK;
+}
+
+/* build the item of a key, and pass it to handle or handle_batch */
+static void
+rdb_lua_load_key(void *ud, rdb_parser *p, const rdb_key_info *info)
+{
+    rdb_lua_ctx *ctx = ud;
+    lua_State *L = ctx->L;
+    char *key = (char *)info->key.ptr;
+    uint64_t start;
+
+#ifdef USE_LUAJIT
+    if (script_view_enabled(L)) {
+        rdb_load_view(L, p, info);
+        start = rdb_phase_begin(p);
+        script_need_gc(L);
+        rdb_phase_end(p, RDB_PHASE_HANDLER, start);
+        return;
+    }
+#endif
+    script_push_item(L);
+    script_pushfieldlstring(L, FIELD_KEY, key, info->key.len);
+    script_pushfieldinteger(L, FIELD_EXPIRE_TIME, info->expire_time);
+    if (info->lru_idle >= 0) script_pushtableinteger(L, IDLE_FIELD_STR, info->lru_idle);
+    if (info->lfu_freq >= 0) script_pushtableinteger(L, FREQ_FIELD_STR, info->lfu_freq);
+    // read value
+    rdb_load_value(L, p, info->type, key);
+    // the key or value is bad, which was reported
+    if (p->bad_value) {
+        script_drop_item(L);
+        return;
+    }
+    // set value type
+    rdb_set_value_type(L, info->type);
+    if (ctx->digest && info->type_name) rdb_set_digest(L, info->type_name);
+    // revoke lua callback function, or collect it into batch, the gc is lua time too
+    start = rdb_phase_begin(p);
+    if( script_handle_item(L) != 0 ) {
+        rdb_fail(p, RDB_ERR_PLUGIN, "handle function failed, %s", lua_tostring(L, -1));
+    }
+    script_need_gc(L);
+    rdb_phase_end(p, RDB_PHASE_HANDLER, start);
+}
+
+/* a record failed in the middle of a key, drop its item for salvage */
+static void
+rdb_lua_load_reset(void *ud)
+{
+    rdb_lua_ctx *ctx = ud;
+    lua_State *L = ctx->L;
+
+    if (lua_gettop(L) <= ctx->load_top) return;
+    // the item, unless a handle function failed with it
+    lua_settop(L, ctx->load_top + 1);
+    if (lua_istable(L, -1)) {
+        script_drop_item(L);
+    } else {
+        lua_pop(L, 1);
+    }
+}
+
+/* parser which passes items to the handle functions of the script */
+rdb_parser *
+rdb_lua_parser_create(lua_State *L)
+{
+    rdb_parser *p;
+    rdb_plugin handlers;
+    rdb_lua_ctx *ctx = rdb_lua_get_ctx(L);
+
+    memset(&handlers, 0, sizeof(handlers));
+    handlers.abi_version = RDB_PLUGIN_ABI_VERSION;
+    handlers.ud = ctx;
+    handlers.on_header = rdb_lua_on_header;
+    handlers.on_db = rdb_lua_on_db;
+    handlers.on_aux = rdb_lua_on_aux;
+    handlers.on_resizedb = rdb_lua_on_resizedb;
+    handlers.on_eof = rdb_lua_on_eof;
+
+    if ((p = rdb_parser_create(&handlers)) == NULL) return NULL;
+    rdb_parser_set_loader(p, rdb_lua_load_key, rdb_lua_load_reset, ctx);
+    ctx->load_top = lua_gettop(L);
+    return p;
+}
+
+int
+rdb_lua_load(lua_State *L, const char *path)
+{
+    int ret;
+    rdb_parser *p;
+
+    if ((p = rdb_lua_parser_create(L)) == NULL) return RDB_ERR_NOMEM;
+    if ((ret = rdb_parser_open(p, path)) == 0) {
+        ret = rdb_parser_run(p);
+    }
+    rdb_parser_free(p);
+    return ret;
+}
@@ -0,0 +1,15 @@
+#ifndef _RDB_LUA_H_
+#define _RDB_LUA_H_
+#include "script.h"
+#include "rdb.h"
+
+#define RDB_STREAM_CB "handle_stream_entry"
+
+/* parse the rdb file and pass items to the handle functions of the script */
+int rdb_lua_load(lua_State *L, const char *path);
+rdb_parser *rdb_lua_parser_create(lua_State *L);
+void rdb_lua_set_lazy_lzf(lua_State *L, int enable);
+void rdb_lua_set_digest(lua_State *L, int enable);
+void rdb_lua_set_int_values(lua_State *L, int enable);
+void rdb_lua_set_source(lua_State *L, const char *source);
+#endif
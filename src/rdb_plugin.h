@@ -0,0 +1,114 @@
+/*
+ * Native plugin api of rdbtools, an alternative to lua handle functions.
+ *
+ * A plugin is a shared object which exports rdb_plugin_init, it's loaded by
+ * `rdbtools --plugin path.so`. rdb_plugin_init is called with abi_version
+ * set, it fills the callbacks it wants and returns 0. Callbacks may be NULL.
+ *
+ * Keys and elements are passed as (ptr, len) views straight out of the
+ * decoders, they're not NUL terminated and only valid during the callback,
+ * copy them if they are kept.
+ *
+ * Callbacks return RDB_PLUGIN_OK to go on, on_key_begin may return
+ * RDB_PLUGIN_SKIP_KEY to skip on_element and the stream callbacks of the
+ * key, any negative value stops the load with an error.
+ */
+#ifndef _RDB_PLUGIN_H_
+#define _RDB_PLUGIN_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#define RDB_PLUGIN_ABI_VERSION 1
+#define RDB_PLUGIN_INIT_SYMBOL "rdb_plugin_init"
+
+#define RDB_PLUGIN_OK 0
+#define RDB_PLUGIN_SKIP_KEY 1
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} rdb_slice;
+
+typedef struct {
+    rdb_slice key;
+    const char *type_name;  /* string, list, set, zset, hash, module, stream */
+    int type;               /* rdb object type */
+    int db_num;
+    int64_t expire_time;    /* unix time in seconds, -1 if the key has no expire */
+    uint64_t size_hint;     /* count of elements if known before decoding, or 0 */
+    int64_t lru_idle;       /* -1 if not stored */
+    int64_t lfu_freq;       /* -1 if not stored */
+    const uint64_t *digest; /* 128-bit value fingerprint at on_key_end if enabled, or NULL */
+    uint64_t raw_len;       /* length of a string value, 0 for other types */
+    uint64_t compressed_len; /* lzf compressed length of a string value, 0 if not compressed */
+} rdb_key_info;
+
+/*
+ * member is the string value, list or set element, hash field, zset member
+ * or stream field. value is the hash value, zset score or stream value, and
+ * id is the stream entry id, ptr of them is NULL if not used by the type.
+ */
+typedef struct {
+    rdb_slice member;
+    rdb_slice value;
+    rdb_slice id;
+} rdb_element;
+
+/*
+ * Consumer groups of a stream, passed after its entries and before
+ * on_key_end. Ids are formatted as "ms-seq", times are unix time in ms.
+ * group and consumer are indexes from 0 among the groups and consumers of
+ * the key, the pending entries of a group come before its consumers.
+ */
+typedef struct {
+    rdb_slice name;
+    rdb_slice last_id;
+    int64_t entries_read;   /* -1 if not stored, before rdb 10 */
+} rdb_stream_group;
+
+typedef struct {
+    rdb_slice name;
+    int64_t seen_time;
+    int64_t active_time;    /* -1 if not stored, before rdb 11 */
+    uint64_t group;
+} rdb_stream_consumer;
+
+/* an entry of the pel of a group, or of a consumer, which only has the id */
+typedef struct {
+    rdb_slice id;
+    int64_t delivery_time;      /* -1 in the pel of a consumer */
+    uint64_t delivery_count;    /* 0 in the pel of a consumer */
+    uint64_t group;
+    int64_t consumer;           /* -1 in the pel of a group */
+} rdb_stream_pending;
+
+typedef struct rdb_plugin {
+    int abi_version;
+    void *ud;   /* passed to callbacks as is */
+
+    int (*on_db)(void *ud, int db_num);
+    int (*on_key_begin)(void *ud, const rdb_key_info *key);
+    int (*on_element)(void *ud, const rdb_key_info *key, const rdb_element *elem);
+    int (*on_key_end)(void *ud, const rdb_key_info *key);
+    int (*on_eof)(void *ud);
+    void (*release)(void *ud);
+    int (*on_aux)(void *ud, const rdb_slice *key, const rdb_slice *value);
+    int (*on_resizedb)(void *ud, uint64_t db_size, uint64_t expires_size);
+    int (*on_header)(void *ud, int version);    /* rdb version, before other events */
+    /*
+     * With many rdb files, on_source is called with the path before each of
+     * them. Files are parsed by forked workers, finish returns the result of
+     * a worker as malloc'd bytes after its last file, and reduce is called
+     * with the results of all workers by the main process.
+     */
+    int (*on_source)(void *ud, const char *path);
+    void *(*finish)(void *ud, size_t *len);
+    int (*reduce)(void *ud, const rdb_slice *results, int n);
+    int (*on_stream_group)(void *ud, const rdb_key_info *key, const rdb_stream_group *group);
+    int (*on_stream_consumer)(void *ud, const rdb_key_info *key, const rdb_stream_consumer *consumer);
+    int (*on_stream_pending)(void *ud, const rdb_key_info *key, const rdb_stream_pending *pending);
+} rdb_plugin;
+
+typedef int (*rdb_plugin_init_fn)(rdb_plugin *plugin);
+
+#endif
@@ -5,6 +5,66 @@
 
 LUALIB_API int (luaopen_cjson) (lua_State *L); 
 
+static const char *field_names[FIELD_MAX] = {
+    "key", "value", "type", "expire_time", "raw_len", "compressed_len"
+};
+
+/* state of the script, kept as a userdata in the registry of its lua_State */
+typedef struct {
+    int field_refs[FIELD_MAX];
+
+    // item and value tables are recycled when script doesn't retain items.
+    int recycle_items;
+    int item_ref;
+    int pool_ref;
+    int pool_count;
+
+    // handle_batch(items), batch_size is 0 when handle(item) is used.
+    int batch_size;
+    int batch_count;
+    int batch_ref;
+
+#ifdef USE_LUAJIT
+    // handle_view(view, item) is preferred over handle and handle_batch.
+    int view_enabled;
+#endif
+
+    script_gc_policy gc_policy;
+    int gc_last_kb;
+} script_state;
+
+// the address is the key of the state in the registry
+static const char script_state_key = 0;
+
+static script_state *
+script_get_state(lua_State *L)
+{
+    script_state *st;
+
+    lua_pushlightuserdata(L, (void *)&script_state_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    st = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return st;
+}
+
+static script_state *
+script_new_state(lua_State *L)
+{
+    script_state *st;
+    script_gc_policy gc_policy = { SCRIPT_GC_INC, 0, 0, 4096 };
+
+    lua_pushlightuserdata(L, (void *)&script_state_key);
+    st = lua_newuserdata(L, sizeof(script_state));
+    memset(st, 0, sizeof(script_state));
+    st->item_ref = LUA_NOREF;
+    st->pool_ref = LUA_NOREF;
+    st->batch_ref = LUA_NOREF;
+    st->gc_policy = gc_policy;
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    return st;
+}
+
 void
 lua_loadlib(lua_State *L, const char *libname, lua_CFunction luafunc) {
     lua_pushcfunction(L, luafunc);
@@ -12,12 +72,52 @@ lua_loadlib(lua_State *L, const char *libname, lua_CFunction luafunc) {
     lua_call(L, 1, 0); 
 }
 
+/*
+ * table.new(narr, nrec), same as luajit's table.new, create a table with
+ * pre-allocated array and hash part, e.g. by env.db_size.
+ */
+static int
+script_table_new(lua_State *L)
+{
+    lua_Integer narr, nrec;
+
+    narr = luaL_optinteger(L, 1, 0);
+    nrec = luaL_optinteger(L, 2, 0);
+    script_createtable(L, narr > 0 ? narr : 0, nrec > 0 ? nrec : 0);
+    return 1;
+}
+
+static void
+script_intern_fields(lua_State *L, script_state *st)
+{
+    int i;
+
+    for (i = 0; i < FIELD_MAX; i++) {
+        lua_pushstring(L, field_names[i]);
+        st->field_refs[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
 lua_State *
 script_init(const char *filename)
 {
     lua_State *L = luaL_newstate();
+    script_state *st;
+
     luaL_openlibs(L);
     lua_loadlib(L, "cjson", luaopen_cjson);
+    lua_getglobal(L, "table");
+    lua_pushcfunction(L, script_table_new);
+    lua_setfield(L, -2, "new");
+    lua_pop(L, 1);
+    st = script_new_state(L);
+    script_intern_fields(L, st);
+#ifdef USE_LUAJIT
+    // declare the record view, so scripts can ffi.cast it without a cdef.
+    if (luaL_dostring(L, "require('ffi').cdef[[" RDB_VIEW_CDEF "]]")) {
+        logger(ERROR, "%s", lua_tostring(L, -1));
+    }
+#endif
     if (luaL_dofile(L, filename)) {
         logger(ERROR,"%s", lua_tostring(L, -1));
     }
@@ -25,8 +125,20 @@ script_init(const char *filename)
     lua_newtable(L);
     lua_setglobal(L, RDB_ENV);
 
-    if (!script_check_func_exists(L, RDB_CB)) {
-        logger(ERROR, "function %s is reqired in %s.\n", RDB_CB, filename);
+    lua_getglobal(L, RDB_RETAIN_ITEMS);
+    st->recycle_items = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (st->recycle_items) {
+        lua_createtable(L, SCRIPT_POOL_SIZE, 0);
+        st->pool_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+#ifdef USE_LUAJIT
+    st->view_enabled = script_check_func_exists(L, RDB_VIEW_CB);
+    if (st->view_enabled) return L;
+#endif
+    if (!script_check_func_exists(L, RDB_CB) && !script_check_func_exists(L, RDB_BATCH_CB)) {
+        logger(ERROR, "function %s or %s is reqired in %s.\n", RDB_CB, RDB_BATCH_CB, filename);
     }
     return L;
 }
@@ -43,7 +155,7 @@ script_check_func_exists(lua_State * L, const char *func_name) {
 
     lua_getglobal(L, func_name);
     ret = lua_isfunction(L,lua_gettop(L));
-    lua_pop(L,-1);
+    lua_pop(L, 1);
 
     return ret;
 }
@@ -57,7 +169,7 @@ script_pushtableunsigned(lua_State* L , char* key, unsigned value)
 }
 
 void
-script_pushtableinteger(lua_State* L , char* key , int value)
+script_pushtableinteger(lua_State* L , char* key , long long value)
 {
     lua_pushstring(L, key);
     lua_pushinteger(L, value);
@@ -73,21 +185,354 @@ script_pushtablestring(lua_State* L , char* key , char* value)
 }
 
 void
-script_push_list_elem(lua_State* L , char* key, int ind)
+script_push_list_elem(lua_State* L, const char *elem, size_t len, uint64_t ind)
 {
-    lua_pushstring(L, key);
-    lua_rawseti(L,-2,ind + 1);
+    lua_pushlstring(L, elem, len);
+    lua_rawseti(L, -2, ind + 1);
+}
+
+void
+script_set_gc_policy(lua_State *L, script_gc_policy *policy)
+{
+    script_state *st = script_get_state(L);
+
+    st->gc_policy = *policy;
+#ifdef LUA_GCGEN
+    lua_gc(L, policy->mode == SCRIPT_GC_GEN ? LUA_GCGEN : LUA_GCINC, 0);
+#else
+    // luajit has only the incremental collector.
+    if (policy->mode == SCRIPT_GC_GEN) {
+        logger(WARN, "generational gc is not supported, incremental is used.");
+    }
+#endif
+    if (policy->pause > 0) lua_gc(L, LUA_GCSETPAUSE, policy->pause);
+    if (policy->stepmul > 0) lua_gc(L, LUA_GCSETSTEPMUL, policy->stepmul);
+    st->gc_last_kb = lua_gc(L, LUA_GCCOUNT, 0);
 }
 
+/*
+ * Run a gc step when the heap grew step_kb since the last step, instead of
+ * a fixed cadence of keys, so scripts which recycle items or keep nothing
+ * don't pay for the gc, and the ones that allocate a lot get it sooner.
+ */
 void
 script_need_gc(lua_State* L)
 {
-#define LUA_GC_CYCLE_PERIOD 500
-    static long gc_count = 0; 
+    script_state *st = script_get_state(L);
+    int kb;
+
+    if (st->gc_policy.step_kb <= 0) return;
+
+    kb = lua_gc(L, LUA_GCCOUNT, 0);
+    if (kb - st->gc_last_kb >= st->gc_policy.step_kb) {
+        lua_gc(L, LUA_GCSTEP, st->gc_policy.step_kb);
+        st->gc_last_kb = lua_gc(L, LUA_GCCOUNT, 0);
+    } else if (kb < st->gc_last_kb) {
+        st->gc_last_kb = kb;
+    }
+}
+
+static void
+script_clear_table(lua_State *L, int idx)
+{
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, idx);
+    }
+}
+
+/* clear the item at idx, and keep its value table in the pool */
+static void
+script_clear_item(lua_State *L, script_state *st, int item)
+{
+    int value;
+
+    lua_pushnil(L);
+    lua_setmetatable(L, item);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->field_refs[FIELD_VALUE]);
+    lua_rawget(L, item);
+    value = lua_gettop(L);
+    if (lua_type(L, value) == LUA_TTABLE && lua_getmetatable(L, value)) {
+        // never recycle tables which the script has attached a metatable.
+        lua_pop(L, 2);
+        lua_pushnil(L);
+    }
+    if (st->pool_count < SCRIPT_POOL_SIZE && lua_type(L, value) == LUA_TTABLE
+            && lua_rawlen(L, value) <= SCRIPT_POOL_MAX_ARRAY) {
+        script_clear_table(L, value);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, st->pool_ref);
+        lua_pushvalue(L, value);
+        lua_rawseti(L, -2, ++st->pool_count);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    script_clear_table(L, item);
+}
+
+/*
+ * handle_batch(items) is used instead of handle(item) if the script defines
+ * it, items are collected into a batch table which is pre-sized by the batch
+ * size. If the script doesn't retain items, the batch table and its items
+ * are cleared after the call and filled again by the next batch.
+ */
+void
+script_set_batch_size(lua_State *L, int size)
+{
+    script_state *st = script_get_state(L);
+
+    if (!script_check_func_exists(L, RDB_BATCH_CB)) return;
+#ifdef USE_LUAJIT
+    if (st->view_enabled) return;
+#endif
+    st->batch_size = size > 0 ? size : SCRIPT_DEFAULT_BATCH_SIZE;
+}
+
+void
+script_push_item(lua_State *L)
+{
+    script_state *st = script_get_state(L);
+
+    if (st->batch_size > 0 && st->batch_ref != LUA_NOREF) {
+        // recycled item from the last batch
+        lua_rawgeti(L, LUA_REGISTRYINDEX, st->batch_ref);
+        lua_rawgeti(L, -1, st->batch_count + 1);
+        lua_remove(L, -2);
+        if (lua_istable(L, -1)) return;
+        lua_pop(L, 1);
+    } else if (st->batch_size == 0 && st->item_ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, st->item_ref);
+        return;
+    }
+    lua_createtable(L, 0, 4);
+}
+
+/* pop the item at the top of stack without handling it, like a bad key */
+void
+script_drop_item(lua_State *L)
+{
+    script_state *st = script_get_state(L);
+
+    if (st->recycle_items) script_clear_item(L, st, lua_gettop(L));
+    lua_pop(L, 1);
+}
+
+int
+script_flush_batch(lua_State *L)
+{
+    script_state *st = script_get_state(L);
+    int i, batch, ret;
+
+    if (st->batch_count == 0) return 0;
+
+    lua_getglobal(L, RDB_BATCH_CB);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->batch_ref);
+    batch = lua_gettop(L);
+    // drop recycled items after the last one of a partial batch.
+    for (i = st->batch_count + 1; i <= st->batch_size; i++) {
+        lua_pushnil(L);
+        lua_rawseti(L, batch, i);
+    }
+    if (st->recycle_items) {
+        lua_pushvalue(L, batch);
+        lua_insert(L, -3);
+        batch = lua_gettop(L) - 2;
+    }
+    if ((ret = lua_pcall(L, 1, 0, 0)) != 0) {
+        if (st->recycle_items) lua_remove(L, -2);
+        return ret;
+    }
+
+    if (st->recycle_items) {
+        for (i = 1; i <= st->batch_count; i++) {
+            lua_rawgeti(L, batch, i);
+            script_clear_item(L, st, lua_gettop(L));
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    } else {
+        // the script may keep the batch, start a new one.
+        luaL_unref(L, LUA_REGISTRYINDEX, st->batch_ref);
+        st->batch_ref = LUA_NOREF;
+    }
+    st->batch_count = 0;
+    return 0;
+}
+
+/* call handle(item) or collect it into batch, with the item at the top of stack */
+int
+script_handle_item(lua_State *L)
+{
+    script_state *st = script_get_state(L);
+    int ret;
+
+    if (st->batch_size > 0) {
+        if (st->batch_ref == LUA_NOREF) {
+            script_createtable(L, st->batch_size, 0);
+            st->batch_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, st->batch_ref);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, ++st->batch_count);
+        lua_pop(L, 1);
+        return st->batch_count == st->batch_size ? script_flush_batch(L) : 0;
+    }
+
+    lua_getglobal(L, RDB_CB);
+    lua_insert(L, -2);
+    if (!st->recycle_items) {
+        return lua_pcall(L, 1, 0, 0);
+    }
+
+    lua_pushvalue(L, -1);
+    lua_insert(L, -3);
+    if ((ret = lua_pcall(L, 1, 0, 0)) != 0) {
+        lua_remove(L, -2);
+        return ret;
+    }
+    script_clear_item(L, st, lua_gettop(L));
+    if (st->item_ref == LUA_NOREF) {
+        st->item_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+void
+script_new_value_table(lua_State *L, uint64_t narr, uint64_t nrec)
+{
+    script_state *st = script_get_state(L);
+
+    if (st->pool_count > 0) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, st->pool_ref);
+        lua_rawgeti(L, -1, st->pool_count);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, st->pool_count--);
+        lua_remove(L, -2);
+        return;
+    }
+    script_createtable(L, narr, nrec);
+}
+
+void
+script_createtable(lua_State *L, uint64_t narr, uint64_t nrec)
+{
+    if (narr > SCRIPT_TABLE_HINT_MAX) narr = SCRIPT_TABLE_HINT_MAX;
+    if (nrec > SCRIPT_TABLE_HINT_MAX) nrec = SCRIPT_TABLE_HINT_MAX;
+    lua_createtable(L, (int)narr, (int)nrec);
+}
+
+void
+script_pushfield(lua_State *L, enum script_field field)
+{
+    script_state *st = script_get_state(L);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->field_refs[field]);
+}
+
+void
+script_pushfieldstring(lua_State *L, enum script_field field, char *value)
+{
+    script_pushfield(L, field);
+    lua_pushstring(L, value);
+    lua_rawset(L, -3);
+}
+
+/* binary safe, value may hold NUL */
+void
+script_pushfieldlstring(lua_State *L, enum script_field field, const char *value, size_t len)
+{
+    script_pushfield(L, field);
+    lua_pushlstring(L, value, len);
+    lua_rawset(L, -3);
+}
+
+void
+script_pushfieldinteger(lua_State *L, enum script_field field, long long value)
+{
+    script_pushfield(L, field);
+    lua_pushinteger(L, value);
+    lua_rawset(L, -3);
+}
 
-    gc_count++;
-    if (gc_count == LUA_GC_CYCLE_PERIOD) {
-        lua_gc(L, LUA_GCSTEP, LUA_GC_CYCLE_PERIOD);
-        gc_count = 0; 
-    }  
+/* call finish() of the script, return its result as json, NULL if there's none */
+char *
+script_finish(lua_State *L, size_t *len)
+{
+    const char *json;
+    char *result = NULL;
+
+    if (!script_check_func_exists(L, RDB_FINISH_CB)) return NULL;
+    lua_getglobal(L, "cjson");
+    lua_getfield(L, -1, "encode");
+    lua_getglobal(L, RDB_FINISH_CB);
+    if (lua_pcall(L, 0, 1, 0) != 0) {
+        logger(ERROR, "Runing finish function failed: %s", lua_tostring(L, -1));
+    }
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 3);
+        return NULL;
+    }
+    if (lua_pcall(L, 1, 1, 0) != 0) {
+        logger(ERROR, "Encode result of finish failed: %s", lua_tostring(L, -1));
+    }
+    json = lua_tolstring(L, -1, len);
+    if ((result = malloc(*len)) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at finish.\n");
+    }
+    memcpy(result, json, *len);
+    lua_pop(L, 2);
+    return result;
+}
+
+/* decode the results of finish(), and pass them to reduce(results) at once */
+void
+script_reduce(lua_State *L, char **results, size_t *lens, int n)
+{
+    int i, count = 0;
+
+    if (!script_check_func_exists(L, RDB_REDUCE_CB)) return;
+    lua_getglobal(L, RDB_REDUCE_CB);
+    lua_createtable(L, n, 0);
+    lua_getglobal(L, "cjson");
+    for (i = 0; i < n; i++) {
+        if (!results[i]) continue;
+        lua_getfield(L, -1, "decode");
+        lua_pushlstring(L, results[i], lens[i]);
+        if (lua_pcall(L, 1, 1, 0) != 0) {
+            logger(ERROR, "Decode result of finish failed: %s", lua_tostring(L, -1));
+        }
+        lua_rawseti(L, -3, ++count);
+    }
+    lua_pop(L, 1);
+    if (lua_pcall(L, 1, 0, 0) != 0) {
+        logger(ERROR, "Runing reduce function failed: %s", lua_tostring(L, -1));
+    }
+}
+
+#ifdef USE_LUAJIT
+int
+script_view_enabled(lua_State *L)
+{
+    return script_get_state(L)->view_enabled;
+}
+
+/* call handle_view(view, item), the item is at the top of stack if has_item */
+int
+script_handle_view(lua_State *L, rdb_record_view *view, int has_item)
+{
+    lua_getglobal(L, RDB_VIEW_CB);
+    lua_pushlightuserdata(L, view);
+    if (has_item) {
+        lua_pushvalue(L, -3);
+        lua_remove(L, -4);
+    } else {
+        lua_pushnil(L);
+    }
+    return lua_pcall(L, 2, 0, 0);
 }
+#endif
@@ -3,16 +3,104 @@
 #include <lua.h>                                                            
 #include <lauxlib.h>                                                        
 #include <lualib.h>                                                         
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef USE_LUAJIT
+// luajit speaks the lua 5.1 api, map the 5.2 calls used by rdbtools.
+#define lua_pushunsigned(L, n) lua_pushnumber(L, (lua_Number)(n))
+#define lua_rawlen(L, idx) lua_objlen(L, idx)
+#endif
 
 #define RDB_ENV "env"
 #define RDB_CB "handle"
+#define RDB_BATCH_CB "handle_batch"
+// finish() returns the result of a worker, which are passed to reduce(results)
+#define RDB_FINISH_CB "finish"
+#define RDB_REDUCE_CB "reduce"
+#define SCRIPT_DEFAULT_BATCH_SIZE 128
+// scripts set it to false to declare items are not kept after handle returns
+#define RDB_RETAIN_ITEMS "retain_items"
+
+// table size hints from the rdb file are capped, in case of corrupt length.
+#define SCRIPT_TABLE_HINT_MAX (1 << 26)
+
+#define SCRIPT_POOL_SIZE 16
+// value tables with bigger array part are not recycled, to bound the memory.
+#define SCRIPT_POOL_MAX_ARRAY 4096
+
+#define SCRIPT_GC_INC 0
+#define SCRIPT_GC_GEN 1
+
+typedef struct {
+    int mode;      /* SCRIPT_GC_INC or SCRIPT_GC_GEN */
+    int pause;     /* LUA_GCSETPAUSE, 0 keeps lua default */
+    int stepmul;   /* LUA_GCSETSTEPMUL, 0 keeps lua default */
+    int step_kb;   /* run a gc step once heap grew step_kb, 0 leaves it to lua */
+} script_gc_policy;
+
+#ifdef USE_LUAJIT
+#define RDB_VIEW_CB "handle_view"
+
+/*
+ * Record view passed to handle_view(view, item) as lightuserdata, scripts
+ * cast it with ffi.cast("const rdb_record_view *", view). The pointers are
+ * only valid during the call. value is NULL for non string types, whose
+ * decoded item is passed as the second argument, nil for strings.
+ */
+typedef struct {
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+    int64_t expire_time;
+    int type;
+    const char *type_name;
+} rdb_record_view;
+
+#define RDB_VIEW_CDEF \
+    "typedef struct {" \
+    "  const char *key; size_t key_len;" \
+    "  const char *value; size_t value_len;" \
+    "  int64_t expire_time; int type; const char *type_name;" \
+    "} rdb_record_view;"
+#endif
+
+// item fields, their names are interned in registry at script_init.
+enum script_field {
+    FIELD_KEY = 0,
+    FIELD_VALUE,
+    FIELD_TYPE,
+    FIELD_EXPIRE_TIME,
+    FIELD_RAW_LEN,
+    FIELD_COMPRESSED_LEN,
+    FIELD_MAX
+};
 
 lua_State *script_init(const char *filename);                               
 void script_release(lua_State *L);                                          
 int script_check_func_exists(lua_State * L, const char *func_name);         
 void script_pushtablestring(lua_State* L , char* key , char* value);
-void script_pushtableinteger(lua_State* L , char* key , int value);
+void script_pushtableinteger(lua_State* L , char* key , long long value);
 void script_pushtableunsigned(lua_State* L , char* key , unsigned value);
-void script_push_list_elem(lua_State* L, char* key, int ind);
+void script_push_list_elem(lua_State* L, const char *elem, size_t len, uint64_t ind);
 void script_need_gc(lua_State* L);
+void script_set_gc_policy(lua_State *L, script_gc_policy *policy);
+void script_set_batch_size(lua_State *L, int size);
+void script_push_item(lua_State *L);
+int script_handle_item(lua_State *L);
+void script_drop_item(lua_State *L);
+int script_flush_batch(lua_State *L);
+void script_new_value_table(lua_State *L, uint64_t narr, uint64_t nrec);
+void script_createtable(lua_State *L, uint64_t narr, uint64_t nrec);
+void script_pushfield(lua_State *L, enum script_field field);
+void script_pushfieldstring(lua_State *L, enum script_field field, char *value);
+void script_pushfieldlstring(lua_State *L, enum script_field field, const char *value, size_t len);
+void script_pushfieldinteger(lua_State *L, enum script_field field, long long value);
+char *script_finish(lua_State *L, size_t *len);
+void script_reduce(lua_State *L, char **results, size_t *lens, int n);
+#ifdef USE_LUAJIT
+int script_view_enabled(lua_State *L);
+int script_handle_view(lua_State *L, rdb_record_view *view, int has_item);
+#endif
 #endif
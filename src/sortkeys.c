@@ -0,0 +1,424 @@
+#include "sortkeys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "rdb_internal.h"
+#include "extsort.h"
+#include "progress.h"
+#include "util.h"
+#include "log.h"
+
+// the db is prepended to the key, big endian so it sorts first
+#define SORTKEYS_DB_SIZE 4
+// type, expire time, lru idle, lfu freq, size hint, raw and compressed len and digest before the elements
+#define SORTKEYS_HEAD_SIZE (4 + 8 * 6 + 4 + 16)
+#define SORTKEYS_DIGEST_OFF (4 + 8 * 6)
+#define SORTKEYS_NULL_SLICE 0xffffffff
+// tag of each item after the head
+#define SORTKEYS_ELEMENT 'e'
+#define SORTKEYS_GROUP 'g'
+#define SORTKEYS_CONSUMER 'c'
+#define SORTKEYS_PENDING 'p'
+
+typedef struct {
+    uint64_t db_size;
+    uint64_t expires_size;
+    int db;
+} sortkeys_resize;
+
+typedef struct {
+    const rdb_plugin *out;
+    extsort *sorter;
+    rdb_buf key;
+    rdb_buf rec;        /* head and elements of the current key */
+    sortkeys_resize *resizes;
+    int nresizes;
+    int cur_db;
+    int digest;
+} sortkeys_ctx;
+
+static void
+sortkeys_append(rdb_buf *b, const void *ptr, size_t len)
+{
+    char *buf;
+    size_t cap;
+
+    if (b->len + len > b->cap) {
+        cap = b->cap ? b->cap : 256;
+        while (cap < b->len + len) cap *= 2;
+        if ((buf = realloc(b->ptr, cap)) == NULL) {
+            logger(ERROR, "Exited, as malloc failed at sort keys.\n");
+        }
+        b->ptr = buf;
+        b->cap = cap;
+    }
+    memcpy(b->ptr + b->len, ptr, len);
+    b->len += len;
+}
+
+static void
+sortkeys_append_slice(rdb_buf *b, const rdb_slice *s)
+{
+    uint32_t len = s->ptr ? (uint32_t)s->len : SORTKEYS_NULL_SLICE;
+
+    sortkeys_append(b, &len, 4);
+    if (s->ptr) sortkeys_append(b, s->ptr, s->len);
+}
+
+static void
+sortkeys_append_tag(rdb_buf *b, char tag)
+{
+    sortkeys_append(b, &tag, 1);
+}
+
+static int
+sortkeys_on_header(void *ud, int version)
+{
+    sortkeys_ctx *ctx = ud;
+    return ctx->out->on_header ? ctx->out->on_header(ctx->out->ud, version) : RDB_PLUGIN_OK;
+}
+
+static int
+sortkeys_on_aux(void *ud, const rdb_slice *key, const rdb_slice *value)
+{
+    sortkeys_ctx *ctx = ud;
+    return ctx->out->on_aux ? ctx->out->on_aux(ctx->out->ud, key, value) : RDB_PLUGIN_OK;
+}
+
+/* size hints are passed after on_db of the sorted keys */
+static int
+sortkeys_on_resizedb(void *ud, uint64_t db_size, uint64_t expires_size)
+{
+    sortkeys_ctx *ctx = ud;
+    sortkeys_resize *resizes;
+
+    if ((resizes = realloc(ctx->resizes, sizeof(sortkeys_resize) * (ctx->nresizes + 1))) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at sort keys.\n");
+    }
+    ctx->resizes = resizes;
+    resizes[ctx->nresizes].db = ctx->cur_db;
+    resizes[ctx->nresizes].db_size = db_size;
+    resizes[ctx->nresizes].expires_size = expires_size;
+    ctx->nresizes++;
+    return RDB_PLUGIN_OK;
+}
+
+static int
+sortkeys_on_db(void *ud, int db_num)
+{
+    sortkeys_ctx *ctx = ud;
+
+    ctx->cur_db = db_num;
+    return RDB_PLUGIN_OK;
+}
+
+static int
+sortkeys_on_key_begin(void *ud, const rdb_key_info *key)
+{
+    sortkeys_ctx *ctx = ud;
+    int32_t type = key->type;
+    static const char zero[20];
+
+    ctx->rec.len = 0;
+    sortkeys_append(&ctx->rec, &type, 4);
+    sortkeys_append(&ctx->rec, &key->expire_time, 8);
+    sortkeys_append(&ctx->rec, &key->lru_idle, 8);
+    sortkeys_append(&ctx->rec, &key->lfu_freq, 8);
+    sortkeys_append(&ctx->rec, &key->size_hint, 8);
+    sortkeys_append(&ctx->rec, &key->raw_len, 8);
+    sortkeys_append(&ctx->rec, &key->compressed_len, 8);
+    // the digest is filled by on_key_end
+    sortkeys_append(&ctx->rec, zero, 20);
+    // elements are not kept if the output doesn't want them
+    return ctx->out->on_element || ctx->out->on_stream_group || ctx->out->on_stream_consumer
+        || ctx->out->on_stream_pending ? RDB_PLUGIN_OK : RDB_PLUGIN_SKIP_KEY;
+}
+
+static int
+sortkeys_on_element(void *ud, const rdb_key_info *key, const rdb_element *elem)
+{
+    sortkeys_ctx *ctx = ud;
+
+    if (!ctx->out->on_element) return RDB_PLUGIN_OK;
+    sortkeys_append_tag(&ctx->rec, SORTKEYS_ELEMENT);
+    sortkeys_append_slice(&ctx->rec, &elem->member);
+    sortkeys_append_slice(&ctx->rec, &elem->value);
+    sortkeys_append_slice(&ctx->rec, &elem->id);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+sortkeys_on_stream_group(void *ud, const rdb_key_info *key, const rdb_stream_group *group)
+{
+    sortkeys_ctx *ctx = ud;
+
+    sortkeys_append_tag(&ctx->rec, SORTKEYS_GROUP);
+    sortkeys_append_slice(&ctx->rec, &group->name);
+    sortkeys_append_slice(&ctx->rec, &group->last_id);
+    sortkeys_append(&ctx->rec, &group->entries_read, 8);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+sortkeys_on_stream_consumer(void *ud, const rdb_key_info *key, const rdb_stream_consumer *consumer)
+{
+    sortkeys_ctx *ctx = ud;
+
+    sortkeys_append_tag(&ctx->rec, SORTKEYS_CONSUMER);
+    sortkeys_append_slice(&ctx->rec, &consumer->name);
+    sortkeys_append(&ctx->rec, &consumer->seen_time, 8);
+    sortkeys_append(&ctx->rec, &consumer->active_time, 8);
+    sortkeys_append(&ctx->rec, &consumer->group, 8);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+sortkeys_on_stream_pending(void *ud, const rdb_key_info *key, const rdb_stream_pending *pending)
+{
+    sortkeys_ctx *ctx = ud;
+
+    sortkeys_append_tag(&ctx->rec, SORTKEYS_PENDING);
+    sortkeys_append_slice(&ctx->rec, &pending->id);
+    sortkeys_append(&ctx->rec, &pending->delivery_time, 8);
+    sortkeys_append(&ctx->rec, &pending->delivery_count, 8);
+    sortkeys_append(&ctx->rec, &pending->group, 8);
+    sortkeys_append(&ctx->rec, &pending->consumer, 8);
+    return RDB_PLUGIN_OK;
+}
+
+static int
+sortkeys_on_key_end(void *ud, const rdb_key_info *key)
+{
+    sortkeys_ctx *ctx = ud;
+    unsigned char db[SORTKEYS_DB_SIZE];
+    int32_t has_digest = key->digest != NULL;
+
+    memcpy(ctx->rec.ptr + SORTKEYS_DIGEST_OFF, &has_digest, 4);
+    if (has_digest) memcpy(ctx->rec.ptr + SORTKEYS_DIGEST_OFF + 4, key->digest, 16);
+    db[0] = (uint32_t)key->db_num >> 24;
+    db[1] = (uint32_t)key->db_num >> 16;
+    db[2] = (uint32_t)key->db_num >> 8;
+    db[3] = (uint32_t)key->db_num;
+    ctx->key.len = 0;
+    sortkeys_append(&ctx->key, db, SORTKEYS_DB_SIZE);
+    sortkeys_append(&ctx->key, key->key.ptr, key->key.len);
+    extsort_add(ctx->sorter, ctx->key.ptr, ctx->key.len, ctx->rec.ptr, ctx->rec.len);
+    return RDB_PLUGIN_OK;
+}
+
+static const char *
+sortkeys_read_slice(const char *p, rdb_slice *s)
+{
+    uint32_t len;
+
+    memcpy(&len, p, 4);
+    p += 4;
+    if (len == SORTKEYS_NULL_SLICE) {
+        s->ptr = NULL;
+        s->len = 0;
+        return p;
+    }
+    s->ptr = p;
+    s->len = len;
+    return p + len;
+}
+
+static const char *
+sortkeys_read_u64(const char *p, void *v)
+{
+    memcpy(v, p, 8);
+    return p + 8;
+}
+
+static void
+sortkeys_check(int ret, const char *cb, const rdb_key_info *info)
+{
+    if (ret < 0) {
+        logger(ERROR, "Exited, as plugin %s failed at key %.*s.\n", cb, (int)info->key.len, info->key.ptr);
+    }
+}
+
+static void
+sortkeys_replay_db(sortkeys_ctx *ctx, int db)
+{
+    const rdb_plugin *out = ctx->out;
+    int i;
+
+    if (out->on_db && out->on_db(out->ud, db) < 0) {
+        logger(ERROR, "Exited, as plugin on_db failed at db %d.\n", db);
+    }
+    for (i = 0; i < ctx->nresizes && out->on_resizedb; i++) {
+        if (ctx->resizes[i].db != db) continue;
+        if (out->on_resizedb(out->ud, ctx->resizes[i].db_size, ctx->resizes[i].expires_size) < 0) {
+            logger(ERROR, "Exited, as plugin on_resizedb failed at db %d.\n", db);
+        }
+    }
+}
+
+/* pass a sorted key with its elements to the output */
+static void
+sortkeys_replay_key(sortkeys_ctx *ctx, const rdb_slice *key, const rdb_slice *val)
+{
+    const rdb_plugin *out = ctx->out;
+    const unsigned char *k = (const unsigned char *)key->ptr;
+    const char *p = val->ptr, *end = val->ptr + val->len;
+    rdb_key_info info;
+    rdb_element elem;
+    rdb_stream_group group;
+    rdb_stream_consumer consumer;
+    rdb_stream_pending pending;
+    int32_t type, has_digest;
+    uint64_t digest[2];
+    int ret = RDB_PLUGIN_OK;
+
+    info.db_num = (int)(((uint32_t)k[0] << 24) | ((uint32_t)k[1] << 16) | ((uint32_t)k[2] << 8) | k[3]);
+    if (info.db_num != ctx->cur_db) {
+        ctx->cur_db = info.db_num;
+        sortkeys_replay_db(ctx, info.db_num);
+    }
+    info.key.ptr = key->ptr + SORTKEYS_DB_SIZE;
+    info.key.len = key->len - SORTKEYS_DB_SIZE;
+    memcpy(&type, p, 4);
+    memcpy(&info.expire_time, p + 4, 8);
+    memcpy(&info.lru_idle, p + 12, 8);
+    memcpy(&info.lfu_freq, p + 20, 8);
+    memcpy(&info.size_hint, p + 28, 8);
+    memcpy(&info.raw_len, p + 36, 8);
+    memcpy(&info.compressed_len, p + 44, 8);
+    memcpy(&has_digest, p + SORTKEYS_DIGEST_OFF, 4);
+    memcpy(digest, p + SORTKEYS_DIGEST_OFF + 4, 16);
+    info.digest = has_digest ? digest : NULL;
+    p += SORTKEYS_HEAD_SIZE;
+    info.type = type;
+    info.type_name = rdb_value_type_name(type);
+
+    if (out->on_key_begin) {
+        ret = out->on_key_begin(out->ud, &info);
+        sortkeys_check(ret, "on_key_begin", &info);
+    }
+    // items are only kept if the output has their callback
+    while (ret != RDB_PLUGIN_SKIP_KEY && p < end) {
+        switch (*p++) {
+            case SORTKEYS_ELEMENT:
+                p = sortkeys_read_slice(p, &elem.member);
+                p = sortkeys_read_slice(p, &elem.value);
+                p = sortkeys_read_slice(p, &elem.id);
+                sortkeys_check(out->on_element(out->ud, &info, &elem), "on_element", &info);
+                break;
+            case SORTKEYS_GROUP:
+                p = sortkeys_read_slice(p, &group.name);
+                p = sortkeys_read_slice(p, &group.last_id);
+                p = sortkeys_read_u64(p, &group.entries_read);
+                if (out->on_stream_group) {
+                    sortkeys_check(out->on_stream_group(out->ud, &info, &group), "on_stream_group", &info);
+                }
+                break;
+            case SORTKEYS_CONSUMER:
+                p = sortkeys_read_slice(p, &consumer.name);
+                p = sortkeys_read_u64(p, &consumer.seen_time);
+                p = sortkeys_read_u64(p, &consumer.active_time);
+                p = sortkeys_read_u64(p, &consumer.group);
+                if (out->on_stream_consumer) {
+                    sortkeys_check(out->on_stream_consumer(out->ud, &info, &consumer), "on_stream_consumer", &info);
+                }
+                break;
+            default:
+                p = sortkeys_read_slice(p, &pending.id);
+                p = sortkeys_read_u64(p, &pending.delivery_time);
+                p = sortkeys_read_u64(p, &pending.delivery_count);
+                p = sortkeys_read_u64(p, &pending.group);
+                p = sortkeys_read_u64(p, &pending.consumer);
+                if (out->on_stream_pending) {
+                    sortkeys_check(out->on_stream_pending(out->ud, &info, &pending), "on_stream_pending", &info);
+                }
+                break;
+        }
+    }
+    if (out->on_key_end) sortkeys_check(out->on_key_end(out->ud, &info), "on_key_end", &info);
+}
+
+static int
+sortkeys_print_key(void *ud, const rdb_key_info *key)
+{
+    digest128 d;
+    char hex[DIGEST_HEX_SIZE];
+
+    printf("%d\t%s\t%lld\t", key->db_num, key->type_name, (long long)key->expire_time);
+    print_escaped(stdout, key->key.ptr, key->key.len);
+    if (key->digest) {
+        d.h1 = key->digest[0];
+        d.h2 = key->digest[1];
+        digest_hex(&d, hex);
+        printf("\t%s", hex);
+    }
+    putchar('\n');
+    return RDB_PLUGIN_SKIP_KEY;
+}
+
+void
+sortkeys_run(const char *path, const rdb_plugin *out, size_t max_bytes, const char *tmp_dir, int digest)
+{
+    sortkeys_ctx ctx;
+    rdb_plugin handlers, printer;
+    rdb_parser *p;
+    rdb_slice key, val;
+    uint64_t offset = 0;
+    const char *msg;
+    int ret;
+
+    if (!out) {
+        memset(&printer, 0, sizeof(printer));
+        printer.abi_version = RDB_PLUGIN_ABI_VERSION;
+        printer.on_key_begin = sortkeys_print_key;
+        out = &printer;
+    }
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.out = out;
+    ctx.sorter = extsort_create(tmp_dir, 0, max_bytes);
+    ctx.cur_db = -1;
+
+    memset(&handlers, 0, sizeof(handlers));
+    handlers.abi_version = RDB_PLUGIN_ABI_VERSION;
+    handlers.ud = &ctx;
+    handlers.on_header = sortkeys_on_header;
+    handlers.on_aux = sortkeys_on_aux;
+    handlers.on_db = sortkeys_on_db;
+    handlers.on_resizedb = sortkeys_on_resizedb;
+    handlers.on_key_begin = sortkeys_on_key_begin;
+    handlers.on_element = sortkeys_on_element;
+    handlers.on_key_end = sortkeys_on_key_end;
+    handlers.on_stream_group = sortkeys_on_stream_group;
+    handlers.on_stream_consumer = sortkeys_on_stream_consumer;
+    handlers.on_stream_pending = sortkeys_on_stream_pending;
+
+    if ((p = rdb_parser_create(&handlers)) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at create parser.\n");
+    }
+    rdb_parser_set_digest(p, digest);
+    progress_attach(p, path);
+    if ((ret = rdb_parser_open(p, path)) == 0) ret = rdb_parser_run(p);
+    if (ret != 0) {
+        msg = rdb_parser_error(p, &offset);
+        logger(ERROR, "Exited, as rdb %s can't be parsed, %s at offset %llu.\n", path, msg,
+                (unsigned long long)offset);
+    }
+    progress_done(p, path);
+    rdb_parser_free(p);
+
+    extsort_finish(ctx.sorter);
+    ctx.cur_db = -1;
+    while (extsort_next(ctx.sorter, &key, &val)) {
+        sortkeys_replay_key(&ctx, &key, &val);
+    }
+    if (out->on_eof && out->on_eof(out->ud) < 0) {
+        logger(ERROR, "Exited, as plugin on_eof failed.\n");
+    }
+    fflush(stdout);
+    extsort_free(ctx.sorter);
+    free(ctx.key.ptr);
+    free(ctx.rec.ptr);
+    free(ctx.resizes);
+}
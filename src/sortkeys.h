@@ -0,0 +1,18 @@
+/*
+ * Keys of a rdb in order of db and key, as the order in rdb is of hash
+ * tables. Keys with their elements are sorted on disk by extsort, then
+ * replayed to the output plugin, so memory is bounded by max_bytes.
+ */
+#ifndef _SORTKEYS_H_
+#define _SORTKEYS_H_
+#include <stddef.h>
+#include "rdb_plugin.h"
+
+#define SORTKEYS_DEFAULT_MEM_MB 256
+
+/*
+ * out is NULL to print db, type, expire time and key of each key, and the
+ * digest of its value if digest is set.
+ */
+void sortkeys_run(const char *path, const rdb_plugin *out, size_t max_bytes, const char *tmp_dir, int digest);
+#endif
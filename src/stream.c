@@ -0,0 +1,182 @@
+#include "stream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "listpack.h"
+
+void
+stream_id_decode(const char *raw, stream_id *id)
+{
+    int i;
+    const uint8_t *s = (const uint8_t *)raw;
+
+    // both ms and seq are stored in big endian
+    id->ms = id->seq = 0;
+    for (i = 0; i < 8; i++) {
+        id->ms = (id->ms << 8) | s[i];
+        id->seq = (id->seq << 8) | s[i + 8];
+    }
+}
+
+int
+stream_id_format(char *buf, stream_id *id)
+{
+    return snprintf(buf, STREAM_ID_STR_SIZE, "%llu-%llu",
+            (unsigned long long)id->ms, (unsigned long long)id->seq);
+}
+
+static const char *
+stream_lp_next_int(const char *p, int64_t *v)
+{
+    lp_entry entry;
+    char buf[32];
+
+    if ((p = listpack_next(p, &entry)) == NULL) return NULL;
+    if (!entry.sval) {
+        *v = entry.lval;
+    } else {
+        // integer fields are always int encoded by redis, keep it safe anyway.
+        snprintf(buf, sizeof(buf), "%.*s", (int)entry.slen, entry.sval);
+        *v = strtoll(buf, NULL, 10);
+    }
+    return p;
+}
+
+/* return 0 if malloc failed, the old entries are kept */
+static int
+stream_entries_reserve(lp_entry **entries, int64_t *cap, int64_t n)
+{
+    lp_entry *e;
+
+    if (n <= *cap) return 1;
+    if ((e = realloc(*entries, n * sizeof(lp_entry))) == NULL) return 0;
+    *entries = e;
+    *cap = n;
+    return 1;
+}
+
+/*
+ * Walk entries of a stream listpack node, the node starts with a master entry:
+ * count, deleted, master fields count, master fields, 0. Then each entry is:
+ * flags, ms-diff, seq-diff, [fields count], values or field-value pairs,
+ * lp-count. Entries which have the same fields as master only store values,
+ * the fields are resolved from master entry here.
+ *
+ * fn is called with fields and values of each live entry, both point into
+ * arrays which are reused by the next entry. Return the count of entries,
+ * or STREAM_ERR_TRUNCATED or STREAM_ERR_NOMEM.
+ */
+int64_t
+stream_walk_listpack(stream_walker *w, const char *lp, stream_id *master, stream_entry_fn fn, void *ud)
+{
+    int64_t i, n = 0, count, deleted, nfields, flags, ms_diff, seq_diff, lp_count;
+    const char *p;
+    lp_entry flag, *fields;
+    stream_id id;
+
+    p = listpack_first(lp);
+    if ((p = stream_lp_next_int(p, &count)) == NULL
+            || (p = stream_lp_next_int(p, &deleted)) == NULL
+            || (p = stream_lp_next_int(p, &nfields)) == NULL) {
+        return STREAM_ERR_TRUNCATED;
+    }
+    if (!stream_entries_reserve(&w->master_fields, &w->master_fields_cap, nfields)) return STREAM_ERR_NOMEM;
+    for (i = 0; i < nfields; i++) {
+        if ((p = listpack_next(p, &w->master_fields[i])) == NULL) return STREAM_ERR_TRUNCATED;
+    }
+    // master entry terminator
+    if ((p = stream_lp_next_int(p, &lp_count)) == NULL) return STREAM_ERR_TRUNCATED;
+
+    while ((p = listpack_next(p, &flag)) != NULL) {
+        flags = flag.sval ? 0 : flag.lval;
+        if ((p = stream_lp_next_int(p, &ms_diff)) == NULL
+                || (p = stream_lp_next_int(p, &seq_diff)) == NULL) {
+            return STREAM_ERR_TRUNCATED;
+        }
+        id.ms = master->ms + ms_diff;
+        id.seq = master->seq + seq_diff;
+
+        count = nfields;
+        if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS)) {
+            if ((p = stream_lp_next_int(p, &count)) == NULL) return STREAM_ERR_TRUNCATED;
+            if (!stream_entries_reserve(&w->fields, &w->fields_cap, count)) return STREAM_ERR_NOMEM;
+        }
+        if (!stream_entries_reserve(&w->values, &w->values_cap, count)) return STREAM_ERR_NOMEM;
+        fields = (flags & STREAM_ITEM_FLAG_SAMEFIELDS) ? w->master_fields : w->fields;
+        for (i = 0; i < count; i++) {
+            if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS)
+                    && (p = listpack_next(p, &w->fields[i])) == NULL) {
+                return STREAM_ERR_TRUNCATED;
+            }
+            if ((p = listpack_next(p, &w->values[i])) == NULL) return STREAM_ERR_TRUNCATED;
+        }
+        if ((p = stream_lp_next_int(p, &lp_count)) == NULL) return STREAM_ERR_TRUNCATED;
+
+        if (flags & STREAM_ITEM_FLAG_DELETED) continue;
+        fn(ud, &id, fields, w->values, count);
+        n++;
+    }
+
+    return n;
+}
+
+/* take n entries of a checked listpack, return 0 if it ends before them */
+static int
+stream_check_take(const char **p, int64_t n, int64_t *last)
+{
+    lp_entry entry;
+
+    for (; n > 0; n--) {
+        if ((*p = listpack_next(*p, &entry)) == NULL) return 0;
+        if (last) *last = entry.sval ? -1 : entry.lval;
+    }
+    return 1;
+}
+
+/*
+ * Check a node of stream as a listpack, and that the master entry and the
+ * entries after it are complete, so stream_walk_listpack never runs past it.
+ */
+const char *
+stream_validate_listpack(const char *lp, size_t len, size_t *off)
+{
+    const char *reason, *p;
+    int64_t count, nfields, flags;
+    lp_entry entry;
+
+    if ((reason = listpack_validate(lp, len, 0, off)) != NULL) return reason;
+    p = listpack_first(lp);
+    *off = LP_HDR_SIZE;
+    if (!stream_check_take(&p, 2, NULL) || !stream_check_take(&p, 1, &nfields)) {
+        return "master entry is truncated";
+    }
+    // a count beyond the bytes of listpack can't be right
+    if (nfields < 0 || (uint64_t)nfields > len) return "bad count of master fields";
+    if (!stream_check_take(&p, nfields + 1, NULL)) return "master entry is truncated";
+
+    for (;;) {
+        *off = p - lp;
+        if ((p = listpack_next(p, &entry)) == NULL) break;
+        flags = entry.sval ? 0 : entry.lval;
+        if (!stream_check_take(&p, 2, NULL)) return "entry is truncated";
+        count = nfields;
+        if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS)) {
+            if (!stream_check_take(&p, 1, &count)) return "entry is truncated";
+            if (count < 0 || (uint64_t)count > len) return "bad count of entry fields";
+            count *= 2;
+        }
+        if (!stream_check_take(&p, count + 1, NULL)) return "entry is truncated";
+    }
+    return NULL;
+}
+
+void
+stream_walker_free(stream_walker *w)
+{
+    free(w->master_fields);
+    free(w->fields);
+    free(w->values);
+    memset(w, 0, sizeof(*w));
+}
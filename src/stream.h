@@ -0,0 +1,38 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+#include <stdint.h>
+#include <stddef.h>
+#include "listpack.h"
+
+#define STREAM_ID_SIZE 16
+#define STREAM_ID_STR_SIZE 42
+#define STREAM_ITEM_FLAG_DELETED (1 << 0)
+#define STREAM_ITEM_FLAG_SAMEFIELDS (1 << 1)
+
+typedef struct {
+    uint64_t ms;
+    uint64_t seq;
+} stream_id;
+
+// scratch entries of the walk, reused between nodes and entries.
+typedef struct {
+    lp_entry *master_fields;
+    int64_t master_fields_cap;
+    lp_entry *fields;
+    int64_t fields_cap;
+    lp_entry *values;
+    int64_t values_cap;
+} stream_walker;
+
+// stream_walk_listpack fails with them, a checked node is never truncated.
+#define STREAM_ERR_TRUNCATED -1
+#define STREAM_ERR_NOMEM -2
+
+typedef void (*stream_entry_fn)(void *ud, stream_id *id, lp_entry *fields, lp_entry *values, int64_t count);
+
+void stream_id_decode(const char *raw, stream_id *id);
+int stream_id_format(char *buf, stream_id *id);
+int64_t stream_walk_listpack(stream_walker *w, const char *lp, stream_id *master, stream_entry_fn fn, void *ud);
+const char *stream_validate_listpack(const char *lp, size_t len, size_t *off);
+void stream_walker_free(stream_walker *w);
+#endif
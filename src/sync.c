@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include "sync.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "log.h"
+
+typedef struct {
+    int fd;
+    char buf[SYNC_BUF_SIZE];
+    size_t pos, end;
+} sync_conn;
+
+static int
+sync_connect_unix(const char *path)
+{
+    int fd;
+    struct sockaddr_un sa;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        logger(ERROR, "Exited, as unix socket path %s is too long.\n", path);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+sync_connect_tcp(const char *addr)
+{
+    int fd = -1;
+    char host[256], *port;
+    struct addrinfo hints, *res, *ai;
+
+    if (strlen(addr) >= sizeof(host)) return -1;
+    strcpy(host, addr);
+    port = strrchr(host, ':');
+    *port++ = '\0';
+    // [::1]:6379
+    if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+        host[strlen(host) - 1] = '\0';
+        memmove(host, host + 1, strlen(host));
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void
+sync_fill(sync_conn *c)
+{
+    ssize_t n;
+
+    while ((n = read(c->fd, c->buf, SYNC_BUF_SIZE)) < 0 && errno == EINTR);
+    if (n < 0) logger(ERROR, "Exited, as read from master failed, %s.\n", strerror(errno));
+    if (n == 0) logger(ERROR, "Exited, as master closed the connection.\n");
+    c->pos = 0;
+    c->end = n;
+}
+
+/* read a reply line without \r\n, empty lines are keepalives of the master */
+static void
+sync_read_line(sync_conn *c, char *line, size_t size)
+{
+    size_t len;
+    char ch;
+
+    do {
+        len = 0;
+        for (;;) {
+            if (c->pos == c->end) sync_fill(c);
+            ch = c->buf[c->pos++];
+            if (ch == '\n') break;
+            if (ch != '\r' && len < size - 1) line[len++] = ch;
+        }
+    } while (len == 0);
+    line[len] = '\0';
+}
+
+static void
+sync_command(sync_conn *c, const char *cmd, char *reply, size_t size)
+{
+    char buf[128];
+    size_t len, done = 0;
+    ssize_t n;
+
+    len = snprintf(buf, sizeof(buf), "%s\r\n", cmd);
+    while (done < len) {
+        if ((n = write(c->fd, buf + done, len - done)) < 0) {
+            if (errno == EINTR) continue;
+            logger(ERROR, "Exited, as write to master failed, %s.\n", strerror(errno));
+        }
+        done += n;
+    }
+    sync_read_line(c, reply, size);
+}
+
+/* feed bytes of the payload until the master's eof mark */
+static int
+sync_feed_until_mark(rdb_parser *p, sync_conn *c, const char *mark)
+{
+    char *win, *found;
+    size_t len, keep = 0;
+    int ret;
+
+    if ((win = malloc(SYNC_BUF_SIZE + SYNC_EOF_MARK_SIZE)) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at sync.\n");
+    }
+    for (;;) {
+        if (c->pos == c->end) sync_fill(c);
+        // the mark may be split between reads, so the tail is kept
+        len = c->end - c->pos;
+        memcpy(win + keep, c->buf + c->pos, len);
+        c->pos = c->end;
+        len += keep;
+        if ((found = memmem(win, len, mark, SYNC_EOF_MARK_SIZE)) != NULL) {
+            ret = rdb_parser_feed(p, win, found - win);
+            break;
+        }
+        keep = len < SYNC_EOF_MARK_SIZE - 1 ? len : SYNC_EOF_MARK_SIZE - 1;
+        if ((ret = rdb_parser_feed(p, win, len - keep)) != 0) break;
+        memmove(win, win + len - keep, keep);
+    }
+    free(win);
+    return ret;
+}
+
+static int
+sync_feed_bulk(rdb_parser *p, sync_conn *c, uint64_t remaining)
+{
+    size_t n;
+    int ret;
+
+    while (remaining > 0) {
+        if (c->pos == c->end) sync_fill(c);
+        n = c->end - c->pos;
+        if (n > remaining) n = remaining;
+        if ((ret = rdb_parser_feed(p, c->buf + c->pos, n)) != 0) return ret;
+        c->pos += n;
+        remaining -= n;
+    }
+    return 0;
+}
+
+/*
+ * Handshake as a replica and feed the rdb payload to the parser, which is
+ * sent as $<len>\r\n<payload>, or $EOF:<mark>\r\n<payload><mark> by
+ * diskless masters. Return the result of rdb_parser_feed or finish.
+ */
+int
+sync_load(rdb_parser *p, const char *addr)
+{
+    sync_conn *c;
+    char line[256], mark[SYNC_EOF_MARK_SIZE];
+    int ret, use_mark = 0;
+    uint64_t len = 0;
+
+    if ((c = calloc(1, sizeof(sync_conn))) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at sync.\n");
+    }
+    c->fd = strchr(addr, ':') && !strchr(addr, '/') ? sync_connect_tcp(addr) : sync_connect_unix(addr);
+    if (c->fd < 0) {
+        logger(ERROR, "Exited, as connect to master %s failed.\n", addr);
+    }
+
+    sync_command(c, "PING", line, sizeof(line));
+    if (line[0] == '-') logger(ERROR, "Exited, as master replied %s.\n", line);
+    // without eof capability the master sends the payload with length
+    sync_command(c, "REPLCONF capa eof capa psync2", line, sizeof(line));
+    if (line[0] == '-') logger(WARN, "master replied %s to REPLCONF.", line);
+    sync_command(c, "PSYNC ? -1", line, sizeof(line));
+    if (line[0] == '-') {
+        // masters before 2.8 only know SYNC, which replies with the payload
+        logger(WARN, "master replied %s to PSYNC, fall back to SYNC.", line);
+        sync_command(c, "SYNC", line, sizeof(line));
+    } else {
+        if (strncmp(line, "+FULLRESYNC", 11) != 0) {
+            logger(ERROR, "Exited, as master replied %s to PSYNC.\n", line);
+        }
+        sync_read_line(c, line, sizeof(line));
+    }
+
+    if (line[0] != '$') {
+        logger(ERROR, "Exited, as bad rdb payload header %s from master.\n", line);
+    }
+    if (strncmp(line, "$EOF:", 5) == 0 && strlen(line) == 5 + SYNC_EOF_MARK_SIZE) {
+        memcpy(mark, line + 5, SYNC_EOF_MARK_SIZE);
+        use_mark = 1;
+    } else {
+        len = strtoull(line + 1, NULL, 10);
+    }
+
+    ret = use_mark ? sync_feed_until_mark(p, c, mark) : sync_feed_bulk(p, c, len);
+    if (ret == 0) ret = rdb_parser_finish(p);
+
+    close(c->fd);
+    free(c);
+    return ret;
+}
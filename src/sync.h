@@ -0,0 +1,14 @@
+/*
+ * Full sync from a redis master, rdbtools acts as a replica and the rdb
+ * payload is fed to the parser as it arrives, nothing is written to disk.
+ */
+#ifndef _SYNC_H_
+#define _SYNC_H_
+#include "rdb.h"
+
+#define SYNC_BUF_SIZE (64 * 1024)
+#define SYNC_EOF_MARK_SIZE 40
+
+/* addr is host:port, or a unix socket path */
+int sync_load(rdb_parser *p, const char *addr);
+#endif
@@ -1,33 +1,85 @@
 #include "util.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/*
+ * Format v into buf, which must have at least LONG_STR_SIZE bytes,
+ * return the length of string without the trailing '\0'. Two digits
+ * are taken per division, from the end of a scratch buffer.
+ */
+int
+ll2str(char *buf, long long v)
+{
+    int len;
+    unsigned long long uv;
+    unsigned int i;
+    char tmp[LONG_STR_SIZE], *p = tmp + LONG_STR_SIZE;
+
+    uv = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    while (uv >= 100) {
+        i = (uv % 100) * 2;
+        uv /= 100;
+        *--p = digit_pairs[i + 1];
+        *--p = digit_pairs[i];
+    }
+    if (uv >= 10) {
+        i = uv * 2;
+        *--p = digit_pairs[i + 1];
+        *--p = digit_pairs[i];
+    } else {
+        *--p = '0' + uv;
+    }
+    if (v < 0) *--p = '-';
+
+    len = tmp + LONG_STR_SIZE - p;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+
+    return len;
+}
 
 char *
 ll2string(long long v)
 {
-    int i, len = 2;
-    long long tmp;
     char *buf;
     
-    tmp = v;
-    while ((tmp /= 10) > 0) len++;
-    
-    buf = malloc(len);
+    buf = malloc(LONG_STR_SIZE);
     if (!buf) {
         fprintf(stderr, "Exited, as malloc failed at ll2string.\n");
         exit(1);
     }
-
-    i = len - 2;
-    while (v > 0) {
-        buf[i--] = v % 10 + '0';
-        v /= 10;
-    }
-    buf[len - 1] = '\0';
+    ll2str(buf, v);
 
     return buf;
 }
 
+/* print s to fp, backslash and bytes out of printable ascii are escaped */
+void
+print_escaped(FILE *fp, const char *s, size_t len)
+{
+    size_t i;
+    unsigned char c;
+
+    for (i = 0; i < len; i++) {
+        c = s[i];
+        if (c == '\\') {
+            fputs("\\\\", fp);
+        } else if (c < 0x20 || c >= 0x7f) {
+            fprintf(fp, "\\x%02x", c);
+        } else {
+            putc(c, fp);
+        }
+    }
+}
+
 #ifdef _UTIL_
 int main()
 {
@@ -35,10 +87,12 @@ int main()
     int v2 = 10;
     int v3 = 100;
     int v4 = 100123;
+    int v5 = -100123;
     printf("%d to %s\n", v1, ll2string(v1));
     printf("%d to %s\n", v2, ll2string(v2));
     printf("%d to %s\n", v3, ll2string(v3));
     printf("%d to %s\n", v4, ll2string(v4));
+    printf("%d to %s\n", v5, ll2string(v5));
     return 0;
 }
 #endif
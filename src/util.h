@@ -1,4 +1,9 @@
 #ifndef _UITL_H_
 #define _UITL_H_
+#include <stdio.h>
+#define LONG_STR_SIZE 21
+
 char * ll2string(long long v);
+int ll2str(char *buf, long long v);
+void print_escaped(FILE *fp, const char *s, size_t len);
 #endif
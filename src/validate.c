@@ -0,0 +1,56 @@
+#include "validate.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rdb.h"
+#include "progress.h"
+#include "log.h"
+
+static int
+validate_on_key_begin(void *ud, const rdb_key_info *key)
+{
+    (*(uint64_t *)ud)++;
+    // values are checked before on_key_begin, elements aren't needed
+    return RDB_PLUGIN_SKIP_KEY;
+}
+
+uint64_t
+validate_run(const char *path, int salvage)
+{
+    rdb_plugin handlers;
+    rdb_parser *p;
+    uint64_t keys = 0, errors, skipped, ranges, offset = 0;
+    const char *msg;
+    int ret;
+
+    memset(&handlers, 0, sizeof(handlers));
+    handlers.abi_version = RDB_PLUGIN_ABI_VERSION;
+    handlers.ud = &keys;
+    handlers.on_key_begin = validate_on_key_begin;
+
+    if ((p = rdb_parser_create(&handlers)) == NULL) {
+        logger(ERROR, "Exited, as malloc failed at create parser.\n");
+    }
+    rdb_parser_set_validate(p, 1);
+    rdb_parser_set_salvage(p, salvage);
+    progress_attach(p, path);
+    if ((ret = rdb_parser_open(p, path)) == 0) ret = rdb_parser_run(p);
+    if (ret != 0) {
+        msg = rdb_parser_error(p, &offset);
+        logger(ERROR, "Exited, as rdb %s can't be parsed, %s at offset %llu.\n", path, msg,
+                (unsigned long long)offset);
+    }
+    progress_done(p, path);
+    errors = rdb_parser_bad_values(p);
+    skipped = rdb_parser_skipped_bytes(p, &ranges);
+    rdb_parser_free(p);
+
+    printf("%s: %llu keys, %llu bad values", path, (unsigned long long)keys, (unsigned long long)errors);
+    if (salvage) {
+        printf(", %llu bytes skipped in %llu ranges", (unsigned long long)skipped, (unsigned long long)ranges);
+    }
+    putchar('\n');
+    fflush(stdout);
+    return errors + ranges;
+}
@@ -0,0 +1,15 @@
+/*
+ * Structural check of rdb files. Encoded values are checked by the parser
+ * anyway, this parses without handlers and reports every bad value with its
+ * offset, key and reason instead of exiting at the first one.
+ */
+#ifndef _VALIDATE_H_
+#define _VALIDATE_H_
+#include <stdint.h>
+
+/*
+ * Print a line for each bad value and a summary, return the count of them.
+ * With salvage, bad records are skipped too and counted in the return.
+ */
+uint64_t validate_run(const char *path, int salvage);
+#endif
@@ -6,7 +6,6 @@
 #include <string.h>
 
 #include "util.h"
-#include "log.h"
 #include "endian.h"
 
 uint32_t
@@ -102,10 +101,8 @@ ziplist_entry_str(const char *entry)
       || enc == ZIP_ENC_STR_32B) {
         
         slen = ziplist_entry_strlen(entry);
-        str = malloc(slen + 1); 
-        if (!str) {
-            logger(ERROR, "Exited, as malloc failed at ziplist entry str.\n");
-        }
+        // NULL as for integers, the library never exits
+        if ((str = malloc(slen + 1)) == NULL) return NULL;
         memcpy(str, content, slen);
         str[slen] = '\0';
     }
@@ -115,110 +112,184 @@ ziplist_entry_str(const char *entry)
 uint8_t
 ziplist_entry_int(const char *entry, int64_t *v)
 {
-    int8_t  v8;
+    lp_entry e;
+
+    if (!ziplist_next(entry, &e) || e.sval) return 0;
+    *v = e.lval;
+    return 1;
+}
+
+/* integer of n bytes at p, in little endian */
+static int64_t
+ziplist_read_int(const uint8_t *p, int n)
+{
     int16_t v16;
     int32_t v32;
     int64_t v64;
-    uint8_t enc;
-    uint32_t pre_len_size;
-    char *content;
-    
-    pre_len_size = ziplist_prev_len_size(entry);
-    content = (char *)entry + pre_len_size;
-    enc = entry[pre_len_size];
-    
-    // add one byte for encode.
-    if (enc == ZIP_ENC_INT8) {
-        memcpy(&v8, content + 1, sizeof(int8_t));
-        *v = v8;
-    } else if (enc == ZIP_ENC_INT16) {
-        memcpy(&v16, content + 1, sizeof(int16_t));
-        memrev16ifbe(&v16);
-        *v = v16;
-    } else if (enc == ZIP_ENC_INT24) {
-        memcpy(&v32, content + 1, 3);
-        memrev32ifbe(&v32);
-        *v = v32;
-    } else if (enc == ZIP_ENC_INT32) {
-        memcpy(&v32, content + 1, sizeof(int32_t));
-        memrev32ifbe(&v32);
-        *v = v32;
-    } else if (enc == ZIP_ENC_INT64){
-        memcpy(&v64, content + 1, sizeof(int64_t));
-        memrev64ifbe(&v64);
-        *v = v64;
-    } else if ((enc & 0xf0) == 0xf0){
-        v8 = content[0] & 0x0f;
-        *v = v8;
-    } else {
-        return 0;
+
+    switch (n) {
+        case 1: return (int8_t)p[0];
+        case 2:
+            memcpy(&v16, p, 2);
+            memrev16ifbe(&v16);
+            return v16;
+        case 3:
+            // stored as the high 3 bytes of (v << 8), shift back to keep the sign.
+            v32 = 0;
+            memcpy((uint8_t *)&v32 + 1, p, 3);
+            memrev32ifbe(&v32);
+            return v32 >> 8;
+        case 4:
+            memcpy(&v32, p, 4);
+            memrev32ifbe(&v32);
+            return v32;
+        default:
+            memcpy(&v64, p, 8);
+            memrev64ifbe(&v64);
+            return v64;
     }
-  
-    return  1;
 }
 
-void
-push_ziplist_list_or_set (lua_State *L, const char *zl)
+/*
+ * Decode the entry at p without any copy, same view as listpack_next, return
+ * the start of the next entry, or NULL if p is the end of ziplist. The prev
+ * length and encoding are read once, it's the inner loop of ziplist values.
+ */
+const char *
+ziplist_next(const char *p, lp_entry *entry)
 {
-    int64_t i = 0, v;
-    char *entry, *str;
+    const uint8_t *s = (const uint8_t *)p;
+    uint8_t enc;
 
-    entry = (char *)ZL_ENTRY(zl);
-    while (!ZIP_IS_END(entry)) {
-        if (ziplist_entry_is_str(entry)) {
-            str = ziplist_entry_str(entry); 
-        } else {
-            if(ziplist_entry_int(entry, &v) > 0) {
-                str = ll2string(v);
+    entry->sval = NULL;
+    entry->slen = 0;
+    if (s[0] == ZIPLIST_END) return NULL;
+
+    s += s[0] < ZIPLIST_BIGLEN ? 1 : 5;
+    enc = s[0];
+    switch (enc & ZIP_ENC_STR_MASK) {
+        case ZIP_ENC_STR_6B:
+            entry->slen = enc & ~ZIP_ENC_STR_MASK;
+            s += 1;
+            break;
+        case ZIP_ENC_STR_14B:
+            entry->slen = ((enc & ~ZIP_ENC_STR_MASK) << 8) | s[1];
+            s += 2;
+            break;
+        case ZIP_ENC_STR_32B:
+            entry->slen = ((uint32_t)s[1] << 24) | ((uint32_t)s[2] << 16) | ((uint32_t)s[3] << 8) | s[4];
+            s += 5;
+            break;
+        default:
+            switch (enc) {
+                case ZIP_ENC_INT8:  entry->lval = ziplist_read_int(s + 1, 1); return (const char *)s + 2;
+                case ZIP_ENC_INT16: entry->lval = ziplist_read_int(s + 1, 2); return (const char *)s + 3;
+                case ZIP_ENC_INT24: entry->lval = ziplist_read_int(s + 1, 3); return (const char *)s + 4;
+                case ZIP_ENC_INT32: entry->lval = ziplist_read_int(s + 1, 4); return (const char *)s + 5;
+                case ZIP_ENC_INT64: entry->lval = ziplist_read_int(s + 1, 8); return (const char *)s + 9;
+                default:
+                    // 4 bits immediate integer, 0001 ~ 1101 stands for 0 ~ 12.
+                    entry->lval = (enc & 0x0f) - 1;
+                    return (const char *)s + 1;
             }
-        }
-        script_push_list_elem(L, str,  i++);
-        entry += ziplist_entry_size(entry);
-        free(str);
     }
+    entry->sval = (const char *)s;
+    return (const char *)s + entry->slen;
 }
 
-void
-push_ziplist_hash_or_zset(lua_State *L, const char *zl)
+/*
+ * Check the ziplist of len bytes once before it's decoded by the unchecked
+ * ziplist_next, return NULL if it's fine, or the reason and its offset in
+ * *off. pairs is set for hash and zset, whose entries come in pairs.
+ */
+const char *
+ziplist_validate(const char *zl, size_t len, int pairs, size_t *off)
 {
-    int64_t v;
-    char *entry, *str, *key, *val;
+    const uint8_t *s = (const uint8_t *)zl;
+    uint32_t prevlen, prev = 0, slen, count = 0, tail = ZL_HDR_SIZE, bytes, hdr_tail;
+    size_t p = ZL_HDR_SIZE, pl, hdr;
+    uint8_t enc;
 
-    entry = (char *)ZL_ENTRY(zl);
-    while (!ZIP_IS_END(entry)) {
-        int i;
-        for (i = 0; i < 2; i++) {
-            if (ziplist_entry_is_str(entry)) {
-                str = ziplist_entry_str(entry); 
-            } else {
-                if(ziplist_entry_int(entry, &v) > 0) {
-                    str = ll2string(v);
-                }
-            }
-            if(i == 0) {
-                key = str;
-            } else {
-                val = str;
-            }
-            entry += ziplist_entry_size(entry);
-        }
+    *off = 0;
+    if (len < ZL_HDR_SIZE + 1) return "shorter than the header";
+    memcpy(&bytes, s, 4);
+    memcpy(&hdr_tail, s + 4, 4);
+    memrev32ifbe(&bytes);
+    memrev32ifbe(&hdr_tail);
+    if (bytes != len) return "total bytes in the header don't match";
 
-        script_pushtablestring(L, key, val);
-        free(key);
-        free(val);
+    while (p < len && s[p] != ZIPLIST_END) {
+        *off = p;
+        if (s[p] < ZIPLIST_BIGLEN) {
+            prevlen = s[p];
+            pl = 1;
+        } else {
+            if (p + 5 > len) return "entry runs past the end";
+            memcpy(&prevlen, s + p + 1, 4);
+            memrev32ifbe(&prevlen);
+            pl = 5;
+        }
+        if (prevlen != prev) return "prev length of entry doesn't match";
+        if (p + pl >= len) return "entry runs past the end";
+        enc = s[p + pl];
+        hdr = 1;
+        slen = 0;
+        switch (enc & ZIP_ENC_STR_MASK) {
+            case ZIP_ENC_STR_6B:
+                slen = enc & ~ZIP_ENC_STR_MASK;
+                break;
+            case ZIP_ENC_STR_14B:
+                if (p + pl + 2 > len) return "entry runs past the end";
+                slen = ((enc & ~ZIP_ENC_STR_MASK) << 8) | s[p + pl + 1];
+                hdr = 2;
+                break;
+            case ZIP_ENC_STR_32B:
+                if (p + pl + 5 > len) return "entry runs past the end";
+                slen = ((uint32_t)s[p + pl + 1] << 24) | ((uint32_t)s[p + pl + 2] << 16)
+                    | ((uint32_t)s[p + pl + 3] << 8) | s[p + pl + 4];
+                hdr = 5;
+                break;
+            default:
+                if (enc == ZIP_ENC_INT8) slen = 1;
+                else if (enc == ZIP_ENC_INT16) slen = 2;
+                else if (enc == ZIP_ENC_INT24) slen = 3;
+                else if (enc == ZIP_ENC_INT32) slen = 4;
+                else if (enc == ZIP_ENC_INT64) slen = 8;
+                else if (enc < 0xf1 || enc > 0xfd) return "unknown encoding of entry";
+        }
+        // an entry is followed by the next one or the end byte at least
+        if ((uint64_t)p + pl + hdr + slen >= len) return "entry runs past the end";
+        tail = p;
+        prev = pl + hdr + slen;
+        p += prev;
+        count++;
     }
+    *off = p;
+    if (p >= len) return "no end byte";
+    if (p != len - 1) return "bytes after the end byte";
+    *off = 4;
+    if (hdr_tail != tail) return "tail offset in the header doesn't match";
+    *off = 8;
+    if (ZL_LEN(zl) != 0xffff && ZL_LEN(zl) != count) return "count of entries in the header doesn't match";
+    if (pairs && count % 2 != 0) return "odd count of entries in pairs";
+    return NULL;
 }
 
 void
 ziplist_dump(const char *s)
 {
-    uint32_t i = 0, len;
     char *entry, *str;
+    const char *reason;
+    size_t off;
 
     printf("ziplist { \n");
     printf("bytes: %u\n", ZL_BYTES(s));
     printf("len: %u\n", ZL_LEN(s));
-    len = ZL_LEN(s);
+    // entries are walked without checks, so a bad ziplist is not walked
+    if ((reason = ziplist_validate(s, ZL_BYTES(s), 0, &off)) != NULL) {
+        printf("====== Ziplist error at %zu, %s. ======\n", off, reason);
+        return;
+    }
     entry = (char *)ZL_ENTRY(s);
     while (!ZIP_IS_END(entry)) {
         if (ziplist_entry_is_str(entry)) {
@@ -234,11 +305,6 @@ ziplist_dump(const char *s)
             }
         }
         entry += ziplist_entry_size(entry);
-        ++i;
     }
     printf("}\n");
-    if(i < (0xffff - 1) && i != len) {
-        printf("====== Ziplist len error. ======\n");
-        exit(1);
-    }
 }
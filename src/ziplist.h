@@ -1,7 +1,8 @@
 #ifndef _ZIPLIST_H_
 #define _ZIPLIST_H_
 #include <stdint.h>
-#include "script.h"
+#include <stddef.h>
+#include "listpack.h"
 
 #define ZIPLIST_BIGLEN 254
 #define ZIPLIST_END 0xff
@@ -22,6 +23,8 @@
 #define ZL_LEN(zl) *((uint16_t*)((zl) + 2 * sizeof(uint32_t)))
 #define ZL_HDR_SIZE (2 * sizeof(uint32_t) + sizeof(uint16_t))
 #define ZL_ENTRY(zl) ((uint8_t *)zl + ZL_HDR_SIZE)
+// zllen is 0xffff when the count of entries doesn't fit in 16 bits.
+#define ZL_LEN_HINT(zl) (ZL_LEN(zl) == 0xffff ? 0 : ZL_LEN(zl))
 
 typedef struct {
     uint32_t bytes;
@@ -30,7 +33,11 @@ typedef struct {
     char entrys[0];
 } ziplist;
 
-void push_ziplist_hash_or_zset(lua_State *L, const char *zl);
-void push_ziplist_list_or_set (lua_State *L, const char *zl);
+const char *ziplist_next(const char *p, lp_entry *entry);
+uint8_t ziplist_entry_is_str(const char *entry);
+uint32_t ziplist_entry_size(const char *entry);
+char *ziplist_entry_str(const char *entry);
+uint8_t ziplist_entry_int(const char *entry, int64_t *v);
+const char *ziplist_validate(const char *zl, size_t len, int pairs, size_t *off);
 void ziplist_dump(const char *s);
 #endif
@@ -6,10 +6,6 @@
 #include "log.h"
 #include "endian.h"
 
-#define ZM_END 0xff
-#define ZM_BIGLEN 0xfd
-#define ZM_IS_END(entry) ((uint8_t)entry[0] == ZM_END)
-
 uint32_t
 zipmap_entry_len_size(const char *entry)
 {
@@ -47,37 +43,95 @@ zipmap_entry_len (const char *entry)
     return  zipmap_entry_len_size(entry) + zipmap_entry_strlen(entry);
 }
 
-void push_zipmap(lua_State *L, const char *zm)
+const char *
+zipmap_first(const char *zm)
 {
-    int klen, vlen;
-    char *key, *val;
+    return zm + 1;
+}
 
-    ++zm;
-    while (!ZM_IS_END(zm)) {
-        // key
-        klen = zipmap_entry_strlen(zm);
-        key = malloc(klen + 1);
-        if (!key) {
-            logger(ERROR, "Exited, as malloc failed at zipmap.\n");
-        }
-        memcpy(key, zm + zipmap_entry_len_size(zm), klen);
-        key[klen] = '\0';
-        zm += zipmap_entry_len(zm);
+/*
+ * Decode the pair at p without any copy, return the start of the next pair,
+ * or NULL if p is the end of zipmap. value is followed by a free byte and
+ * the unused bytes it counts.
+ */
+/* length of the string at p, and the start of its bytes */
+static const char *
+zipmap_read_str(const char *p, lp_entry *entry)
+{
+    uint32_t slen;
 
-        // value
-        vlen = zipmap_entry_strlen(zm);
-        val = malloc(vlen + 1);
-        if (!val) {
-            logger(ERROR, "Exited, as malloc failed at zipmap.\n");
-        }
-        memcpy(val, zm + zipmap_entry_len_size(zm) + 1, vlen);
-        val[vlen] = '\0';
-        zm += zipmap_entry_len(zm) + 1;
+    if ((uint8_t)p[0] < ZM_BIGLEN) {
+        entry->slen = (uint8_t)p[0];
+        entry->sval = p + 1;
+    } else {
+        memcpy(&slen, p + 1, 4);
+        memrev32ifbe(&slen);
+        entry->slen = slen;
+        entry->sval = p + 5;
+    }
+    return entry->sval;
+}
 
-        script_pushtablestring(L, key, val);
-        free(key);
-        free(val);
+const char *
+zipmap_next(const char *p, lp_entry *field, lp_entry *value)
+{
+    if (ZM_IS_END(p)) return NULL;
+
+    p = zipmap_read_str(p, field) + field->slen;
+    // the free byte is after the length, and counts unused bytes after the value
+    p = zipmap_read_str(p, value);
+    value->sval = p + 1;
+    return p + 1 + value->slen + (uint8_t)p[0];
+}
+
+/* length of the string at p, return its header size, or 0 if it's bad */
+static size_t
+zipmap_check_str(const uint8_t *s, size_t p, size_t len, uint64_t *slen)
+{
+    uint32_t v;
+
+    if (s[p] < ZM_BIGLEN) {
+        *slen = s[p];
+        return 1;
+    }
+    if (s[p] != ZM_BIGLEN || p + 5 > len) return 0;
+    memcpy(&v, s + p + 1, 4);
+    memrev32ifbe(&v);
+    *slen = v;
+    return 5;
+}
+
+/*
+ * Check the zipmap of len bytes once before it's decoded by the unchecked
+ * zipmap_next, return NULL if it's fine, or the reason and its offset in *off.
+ */
+const char *
+zipmap_validate(const char *zm, size_t len, size_t *off)
+{
+    const uint8_t *s = (const uint8_t *)zm;
+    size_t p = 1, hdr;
+    uint64_t slen, count = 0;
+
+    *off = 0;
+    if (len < 2) return "shorter than the header";
+    while (p < len && s[p] != ZM_END) {
+        *off = p;
+        if ((hdr = zipmap_check_str(s, p, len, &slen)) == 0) return "bad length of field";
+        p += hdr + slen;
+        if (p >= len) return "field runs past the end";
+        if ((hdr = zipmap_check_str(s, p, len, &slen)) == 0) return "bad length of value";
+        // the free byte, and the unused bytes it counts after the value
+        if (p + hdr >= len) return "value runs past the end";
+        p += hdr + 1 + slen + s[p + hdr];
+        if (p >= len) return "value runs past the end";
+        count++;
     }
+    *off = p;
+    if (p >= len) return "no end byte";
+    if (p != len - 1) return "bytes after the end byte";
+    *off = 0;
+    if (s[0] < 254 && s[0] != count) return "count of pairs in the header doesn't match";
+    return NULL;
 }
 
 void
@@ -112,6 +166,5 @@ zipmap_dump(const char *zm)
 
     if(len >=254 && i == len) {
         printf("===== zipmap len error.\n");
-        exit(1);
     }
 }
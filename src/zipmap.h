@@ -1,8 +1,21 @@
 #ifndef _ZIPMAP_H_
 #define _ZIPMAP_H_
 
-#include "script.h"
+#include <stddef.h>
+#include "listpack.h"
 
-void push_zipmap(lua_State *L, const char *zm);
+#define ZM_END 0xff
+#define ZM_BIGLEN 0xfd
+#define ZM_IS_END(entry) ((uint8_t)entry[0] == ZM_END)
+
+// zmlen is the count of pairs, and 254 means it's unknown.
+#define ZM_LEN_HINT(zm) ((uint8_t)(zm)[0] < 254 ? (uint8_t)(zm)[0] : 0)
+
+const char *zipmap_first(const char *zm);
+const char *zipmap_next(const char *p, lp_entry *field, lp_entry *value);
+uint32_t zipmap_entry_len_size(const char *entry);
+uint32_t zipmap_entry_strlen(const char *entry);
+uint32_t zipmap_entry_len(const char *entry);
+const char *zipmap_validate(const char *zm, size_t len, size_t *off);
 void zipmap_dump(const char *zm);
 #endif
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+"""
+Fake redis master which replays a fixture as the full sync payload, to try
+rdbtools --from-socket without a redis server.
+
+$ ./tests/fake_master.py tests/dump7.2.rdb --port 16379 &
+$ cd src && ./rdbtools --from-socket 127.0.0.1:16379 -s ../scripts/example.lua
+
+--eof sends it like a diskless master ($EOF:<mark>), --sync-only rejects
+PSYNC like masters before 2.8, and --chunk sends the payload in small
+pieces to exercise partial records.
+"""
+import argparse
+import os
+import socket
+import time
+
+REPL_ID = "8371b4fb1155b71f4a04d3e1bc3e18c4a990aeeb"
+MARK = b"b8d6f1a7c3e2094f5d1a6b7c8e9f0a1b2c3d4e5f"
+
+
+def read_command(f):
+    line = f.readline()
+    if not line:
+        return None
+    return line.decode().strip().split()
+
+
+def serve(conn, args, rdb):
+    f = conn.makefile("rb")
+    while True:
+        cmd = read_command(f)
+        if cmd is None:
+            return
+        name = cmd[0].upper() if cmd else ""
+        if name == "PING":
+            conn.sendall(b"+PONG\r\n")
+        elif name == "REPLCONF":
+            conn.sendall(b"+OK\r\n")
+        elif name == "PSYNC" and args.sync_only:
+            conn.sendall(b"-ERR unknown command 'PSYNC'\r\n")
+        elif name in ("PSYNC", "SYNC"):
+            if name == "PSYNC":
+                conn.sendall(("+FULLRESYNC %s 0\r\n" % REPL_ID).encode())
+            # keepalives while the rdb is being saved
+            conn.sendall(b"\n\n")
+            if args.eof:
+                conn.sendall(b"$EOF:" + MARK + b"\r\n")
+                payload = rdb + MARK
+            else:
+                conn.sendall(b"$%d\r\n" % len(rdb))
+                payload = rdb
+            # replication stream goes on after the payload
+            payload += b"*1\r\n$4\r\nPING\r\n"
+            for i in range(0, len(payload), args.chunk):
+                conn.sendall(payload[i:i + args.chunk])
+                if args.delay:
+                    time.sleep(args.delay)
+            f.read()
+            return
+        else:
+            conn.sendall(b"-ERR unknown command\r\n")
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("rdb")
+    parser.add_argument("--port", type=int, default=16379)
+    parser.add_argument("--unix", help="listen on a unix socket instead of tcp")
+    parser.add_argument("--eof", action="store_true")
+    parser.add_argument("--sync-only", action="store_true")
+    parser.add_argument("--chunk", type=int, default=64 * 1024)
+    parser.add_argument("--delay", type=float, default=0)
+    parser.add_argument("--once", action="store_true", help="exit after one replica")
+    args = parser.parse_args()
+
+    with open(args.rdb, "rb") as f:
+        rdb = f.read()
+
+    if args.unix:
+        if os.path.exists(args.unix):
+            os.unlink(args.unix)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.bind(args.unix)
+    else:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.bind(("127.0.0.1", args.port))
+    sock.listen(1)
+    while True:
+        conn, _ = sock.accept()
+        try:
+            serve(conn, args, rdb)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+        finally:
+            conn.close()
+        if args.once:
+            break
+
+
+if __name__ == "__main__":
+    main()